@@ -23,6 +23,7 @@
 #include "app/app.h"
 
 #include "app/app_options.h"
+#include "app/batch_filters.h"
 #include "app/check_update.h"
 #include "app/color_utils.h"
 #include "app/commands/commands.h"
@@ -37,6 +38,7 @@
 #include "app/file_system.h"
 #include "app/find_widget.h"
 #include "app/gui_xml.h"
+#include "app/images_unloader.h"
 #include "app/ini_file.h"
 #include "app/load_widget.h"
 #include "app/log.h"
@@ -65,6 +67,7 @@
 #include "raster/layer.h"
 #include "raster/palette.h"
 #include "raster/sprite.h"
+#include "raster/stock.h"
 #include "scripting/engine.h"
 #include "ui/intern.h"
 #include "ui/ui.h"
@@ -97,11 +100,13 @@ public:
   UIContext m_ui_context;
   RecentFiles m_recent_files;
   app::DataRecovery m_recovery;
+  app::ImagesUnloader m_imagesUnloader;
   scripting::Engine m_scriptingEngine;
 
   Modules(bool console, bool verbose)
     : m_loggerModule(verbose)
-    , m_recovery(&m_ui_context) {
+    , m_recovery(&m_ui_context)
+    , m_imagesUnloader(&m_ui_context) {
   }
 };
 
@@ -115,6 +120,8 @@ App::App(int argc, const char* argv[])
   , m_isGui(false)
   , m_isShell(false)
   , m_exporter(NULL)
+  , m_batchFilters(NULL)
+  , m_invalidFilters(false)
 {
   ASSERT(m_instance == NULL);
   m_instance = this;
@@ -135,6 +142,26 @@ App::App(int argc, const char* argv[])
     m_exporter->setScale(options.scale());
   }
 
+  if (options.hasFilterParams()) {
+    m_batchFilters.reset(new BatchFilters);
+
+    try {
+      // Without --batch the GUI is started with the filtered
+      // documents, so we don't overwrite the given files in that case.
+      if (m_isGui && options.filterOutputDir().empty())
+        throw base::Exception("--filter overwrites the given files, use it with --batch or --filter-output");
+
+      m_batchFilters->setFilters(options.filters());
+      m_batchFilters->setChannels(options.filterChannels());
+      m_batchFilters->setOutputDir(options.filterOutputDir());
+    }
+    catch (const base::Exception& e) {
+      std::cerr << e.what() << '\n';
+      m_batchFilters.reset(NULL);
+      m_invalidFilters = true;
+    }
+  }
+
   // Register well-known image file types.
   FileFormatsManager::instance().registerAllFormats();
 
@@ -175,6 +202,12 @@ App::App(int argc, const char* argv[])
 
 int App::run()
 {
+  // Do nothing (not even the GUI) if the filters to apply are invalid
+  if (m_invalidFilters)
+    return 1;
+
+  int exitCode = 0;
+
   // Initialize GUI interface
   if (isGui()) {
     PRINTF("GUI mode\n");
@@ -232,10 +265,24 @@ int App::run()
         // Add the document to the exporter.
         if (m_exporter != NULL)
           m_exporter->addDocument(document);
+
+        // Add the document to be filtered.
+        if (m_batchFilters != NULL)
+          m_batchFilters->addDocument(document);
       }
     }
   }
 
+  // Filter
+  if (m_batchFilters != NULL) {
+    PRINTF("Applying filters...\n");
+
+    if (!m_batchFilters->applyFilters())
+      exitCode = 1;
+
+    m_batchFilters.reset(NULL);
+  }
+
   // Export
   if (m_exporter != NULL) {
     PRINTF("Exporting sheet...\n");
@@ -244,6 +291,22 @@ int App::run()
     m_exporter.reset(NULL);
   }
 
+  // Cels that couldn't be loaded in batch mode (in GUI mode they are
+  // reported by the ImagesUnloader after each command)
+  if (!isGui()) {
+    const Documents& docs = m_modules->m_ui_context.getDocuments();
+    Console console;
+
+    for (Documents::const_iterator it=docs.begin(); it != docs.end(); ++it) {
+      std::string error = (*it)->getSprite()->getStock()->popLoadError();
+      if (!error.empty()) {
+        console.printf("Some cels of \"%s\" couldn't be loaded.\n%s",
+                       (*it)->getFilename().c_str(), error.c_str());
+        exitCode = 1;
+      }
+    }
+  }
+
   // Run the GUI
   if (isGui()) {
 #ifdef ENABLE_UPDATER
@@ -282,7 +345,7 @@ int App::run()
     }
   }
 
-  return 0;
+  return exitCode;
 }
 
 // Finishes the Aseprite application.
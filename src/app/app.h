@@ -39,6 +39,7 @@ namespace raster {
 }
 
 namespace app {
+  class BatchFilters;
   class Document;
   class DocumentExporter;
   class LegacyModules;
@@ -93,6 +94,8 @@ namespace app {
     base::UniquePtr<MainWindow> m_mainWindow;
     FileList m_files;
     base::UniquePtr<DocumentExporter> m_exporter;
+    base::UniquePtr<BatchFilters> m_batchFilters;
+    bool m_invalidFilters;        // True if the filters of the command line are invalid
   };
 
   void app_refresh_screen();
@@ -50,6 +50,9 @@ AppOptions::AppOptions(int argc, const char* argv[])
   //Option& splitLayers = m_po.add("split-layers").description("Specifies that each layer of the given file should be saved as a different image in the sheet.");
   //Option& rotsprite = m_po.add("rotsprite").requiresValue("<angle1,angle2,...>").description("Specifies different angles to export the given image.");
   //Option& merge = m_po.add("merge").requiresValue("<datafiles>").description("Merge several sprite sheets in one.");
+  Option& filter = m_po.add("filter").requiresValue("<filters>").description("Apply filters to all frames and layers of the given files and save them\n(e.g. \"invert-color;convolution-matrix:blur-3x3\"),\nrequires --batch or --filter-output");
+  Option& filterChannels = m_po.add("filter-channels").requiresValue("<rgbaki>").description("Channels modified by --filter");
+  Option& filterOutput = m_po.add("filter-output").requiresValue("<dir>").description("Save filtered files in this directory instead of overwriting them");
   Option& verbose = m_po.add("verbose").description("Explain what is being done (in stderr or a log file)");
   Option& help = m_po.add("help").mnemonic('?').description("Display this help and exits");
   Option& version = m_po.add("version").description("Output version information and exit");
@@ -64,6 +67,9 @@ AppOptions::AppOptions(int argc, const char* argv[])
     m_data = data.value();
     // m_textureFormat = textureFormat.value();
     m_sheet = sheet.value();
+    m_filters = filter.value();
+    m_filterChannels = filterChannels.value();
+    m_filterOutputDir = filterOutput.value();
     // if (scale.enabled())
     //   m_scale = std::strtod(scale.value().c_str(), NULL);
     // m_scaleMode = scaleMode.value();
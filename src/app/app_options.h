@@ -58,6 +58,15 @@ public:
       !m_sheet.empty();
   }
 
+  // Filter options
+  const std::string& filters() const { return m_filters; }
+  const std::string& filterChannels() const { return m_filterChannels; }
+  const std::string& filterOutputDir() const { return m_filterOutputDir; }
+
+  bool hasFilterParams() {
+    return !m_filters.empty();
+  }
+
 private:
   void showHelp();
   void showVersion();
@@ -75,6 +84,10 @@ private:
   std::string m_sheet;
   double m_scale;
   std::string m_scaleMode;
+
+  std::string m_filters;
+  std::string m_filterChannels;
+  std::string m_filterOutputDir;
 };
 
 } // namespace app
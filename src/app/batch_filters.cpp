@@ -0,0 +1,437 @@
+/* Aseprite
+ * Copyright (C) 2001-2013  David Capello
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "app/batch_filters.h"
+
+#include "app/color.h"
+#include "app/color_utils.h"
+#include "app/commands/filters/convolution_matrix_stock.h"
+#include "app/document.h"
+#include "app/file/file.h"
+#include "base/exception.h"
+#include "base/path.h"
+#include "base/scoped_lock.h"
+#include "base/thread.h"
+#include "base/unique_ptr.h"
+#include "filters/brightness_contrast_filter.h"
+#include "filters/color_curve.h"
+#include "filters/color_curve_filter.h"
+#include "filters/convolution_matrix.h"
+#include "filters/convolution_matrix_filter.h"
+#include "filters/filter_indexed_data.h"
+#include "filters/filter_manager.h"
+#include "filters/invert_color_filter.h"
+#include "filters/median_filter.h"
+#include "filters/point_filter_chain.h"
+#include "filters/replace_color_filter.h"
+#include "raster/cel.h"
+#include "raster/image.h"
+#include "raster/images_collector.h"
+#include "raster/layer.h"
+#include "raster/palette.h"
+#include "raster/primitives.h"
+#include "raster/rgbmap.h"
+#include "raster/sprite.h"
+
+#include <cstdlib>
+
+namespace app {
+
+using namespace filters;
+using namespace raster;
+
+namespace {
+
+  // Applies a filter to a whole image (there is no selection in
+  // batch mode).
+  class ImageFilterManager : public FilterManager
+                           , public FilterIndexedData {
+  public:
+    ImageFilterManager(const Image* src, Image* dst, Target target,
+                       Palette* palette, RgbMap* rgbmap)
+      : m_src(src)
+      , m_dst(dst)
+      , m_target(target)
+      , m_palette(palette)
+      , m_rgbmap(rgbmap)
+      , m_row(0) {
+    }
+
+    void applyFilter(Filter* filter) {
+      for (m_row=0; m_row<m_src->getHeight(); ++m_row) {
+        switch (m_src->getPixelFormat()) {
+          case IMAGE_RGB:       filter->applyToRgba(this); break;
+          case IMAGE_GRAYSCALE: filter->applyToGrayscale(this); break;
+          case IMAGE_INDEXED:   filter->applyToIndexed(this); break;
+        }
+      }
+    }
+
+    // FilterManager implementation
+    const void* getSourceAddress() { return m_src->getPixelAddress(0, m_row); }
+    void* getDestinationAddress() { return m_dst->getPixelAddress(0, m_row); }
+    int getWidth() { return m_src->getWidth(); }
+    Target getTarget() { return m_target; }
+    FilterIndexedData* getIndexedData() { return this; }
+    bool skipPixel() { return false; }
+    const Image* getSourceImage() { return m_src; }
+    int getX() { return 0; }
+    int getY() { return m_row; }
+
+    // FilterIndexedData implementation
+    Palette* getPalette() { return m_palette; }
+    RgbMap* getRgbMap() { return m_rgbmap; }
+
+  private:
+    const Image* m_src;
+    Image* m_dst;
+    Target m_target;
+    Palette* m_palette;
+    RgbMap* m_rgbmap;
+    int m_row;
+  };
+
+  const Target kDefaultTarget =
+    TARGET_RED_CHANNEL |
+    TARGET_GREEN_CHANNEL |
+    TARGET_BLUE_CHANNEL |
+    TARGET_GRAY_CHANNEL;
+
+  int param_to_int(const std::string& param)
+  {
+    char* end;
+    int value = std::strtol(param.c_str(), &end, 10);
+    if (param.empty() || *end != 0)
+      throw base::Exception("Invalid filter parameter \"%s\"", param.c_str());
+    return value;
+  }
+
+}
+
+BatchFilters::BatchFilters()
+  : m_channels(0)
+  , m_nextDocument(0)
+{
+}
+
+BatchFilters::~BatchFilters()
+{
+}
+
+void BatchFilters::setFilters(const std::string& filters)
+{
+  std::string::size_type i = 0, j;
+
+  m_specs.clear();
+  do {
+    j = filters.find(';', i);
+    std::string spec = filters.substr(i, j == std::string::npos ? j: j-i);
+    if (!spec.empty())
+      m_specs.push_back(parseFilter(spec));
+    i = j+1;
+  } while (j != std::string::npos);
+}
+
+void BatchFilters::setChannels(const std::string& channels)
+{
+  m_channels = 0;
+
+  for (size_t i=0; i<channels.size(); ++i) {
+    switch (channels[i]) {
+      case 'r': m_channels |= TARGET_RED_CHANNEL; break;
+      case 'g': m_channels |= TARGET_GREEN_CHANNEL; break;
+      case 'b': m_channels |= TARGET_BLUE_CHANNEL; break;
+      case 'a': m_channels |= TARGET_ALPHA_CHANNEL; break;
+      case 'k': m_channels |= TARGET_GRAY_CHANNEL; break;
+      case 'i': m_channels |= TARGET_INDEX_CHANNEL; break;
+      default:
+        throw base::Exception("Invalid channel '%c' (use \"rgbaki\" letters)", channels[i]);
+    }
+  }
+}
+
+void BatchFilters::addDocument(Document* document)
+{
+  m_documents.push_back(document);
+}
+
+bool BatchFilters::applyFilters()
+{
+  if (m_specs.empty() || m_documents.empty())
+    return true;
+
+  // Filter documents in parallel (each thread takes the next
+  // document to be filtered).
+  int nthreads = MID(1, base::thread::hardware_concurrency(), (int)m_documents.size());
+  std::vector<base::thread*> threads;
+
+  m_nextDocument = 0;
+  for (int i=1; i<nthreads; ++i)
+    threads.push_back(new base::thread(&BatchFilters::thread_proxy, this));
+
+  applyToDocuments();
+
+  for (size_t i=0; i<threads.size(); ++i) {
+    threads[i]->join();
+    delete threads[i];
+  }
+
+  // Save documents from this thread (file formats are not prepared
+  // to be used from several threads at the same time).
+  bool saved = true;
+
+  for (size_t i=0; i<m_documents.size(); ++i) {
+    Document* document = m_documents[i];
+
+    if (!m_outputDir.empty())
+      document->setFilename(base::join_path(m_outputDir,
+                                            base::get_file_name(document->getFilename())));
+
+    if (save_document(document) != 0)
+      saved = false;
+  }
+
+  return saved;
+}
+
+void BatchFilters::thread_proxy(BatchFilters* self)
+{
+  self->applyToDocuments();
+}
+
+void BatchFilters::applyToDocuments()
+{
+  Document* document;
+
+  while (getNextDocument(document))
+    applyToDocument(document);
+}
+
+bool BatchFilters::getNextDocument(Document*& document)
+{
+  base::scoped_lock hold(m_mutex);
+
+  if (m_nextDocument < m_documents.size()) {
+    document = m_documents[m_nextDocument++];
+    return true;
+  }
+  else
+    return false;
+}
+
+void BatchFilters::applyToDocument(Document* document)
+{
+  Sprite* sprite = document->getSprite();
+  Filters filters, owned;
+  std::vector<Target> targets;
+  RgbMap rgbmap;
+  Palette* rgbmapPalette = NULL;
+
+  createFilters(sprite->getPixelFormat(), filters, targets, owned);
+
+  ImagesCollector images(sprite->getFolder(), FrameNumber(0), true, false);
+  for (ImagesCollector::ItemsIterator it=images.begin(), end=images.end();
+       it != end; ++it) {
+    Image* image = it->image();
+    Palette* palette = sprite->getPalette(it->cel()->getFrame());
+    base::UniquePtr<Image> src(Image::createCopy(image));
+
+    if (image->getPixelFormat() == IMAGE_INDEXED && rgbmapPalette != palette) {
+      rgbmap.regenerate(palette);
+      rgbmapPalette = palette;
+    }
+
+    for (size_t i=0; i<filters.size(); ++i) {
+      if (i > 0)
+        copy_image(src.get(), image, 0, 0);
+
+      ImageFilterManager filterMgr(src.get(), image, targets[i], palette, &rgbmap);
+      filterMgr.applyFilter(filters[i]);
+    }
+  }
+
+  for (size_t i=0; i<owned.size(); ++i)
+    delete owned[i];
+}
+
+// Creates the filters to be applied to a document with the given
+// pixel format. Consecutive point filters with the same target are
+// combined in one PointFilterChain so they are applied in one pass.
+// All created filters are added to "owned" list.
+void BatchFilters::createFilters(PixelFormat format, Filters& filters,
+                                 std::vector<Target>& targets, Filters& owned)
+{
+  PointFilter* lastPointFilter = NULL;
+  PointFilterChain* chain = NULL;
+
+  for (size_t i=0; i<m_specs.size(); ++i) {
+    const FilterSpec& spec = m_specs[i];
+    const std::vector<std::string>& params = spec.params;
+    Target target = (m_channels ? m_channels: spec.target);
+    Filter* filter = NULL;
+    PointFilter* pointFilter = NULL;
+
+    if (spec.name == "invert-color") {
+      pointFilter = new InvertColorFilter;
+    }
+    else if (spec.name == "color-curve") {
+      ColorCurveFilter* curveFilter = new ColorCurveFilter;
+      curveFilter->setCurve(spec.curve.get());
+      pointFilter = curveFilter;
+    }
+    else if (spec.name == "brightness-contrast") {
+      BrightnessContrastFilter* bcFilter = new BrightnessContrastFilter;
+      bcFilter->setBrightness(param_to_int(params[0]));
+      bcFilter->setContrast(params.size() > 1 ? param_to_int(params[1]): 0);
+      pointFilter = bcFilter;
+    }
+    else if (spec.name == "convolution-matrix") {
+      // Each document uses its own copy of the matrix, because
+      // SharedPtr's counters cannot be shared between threads.
+      ConvolutionMatrixFilter* convFilter = new ConvolutionMatrixFilter;
+      convFilter->setMatrix(SharedPtr<ConvolutionMatrix>(new ConvolutionMatrix(*spec.matrix)));
+      filter = convFilter;
+    }
+    else if (spec.name == "despeckle") {
+      MedianFilter* medianFilter = new MedianFilter;
+      medianFilter->setSize(param_to_int(params[0]),
+                            param_to_int(params[params.size() > 1 ? 1: 0]));
+      filter = medianFilter;
+    }
+    else if (spec.name == "replace-color") {
+      ReplaceColorFilter* replaceFilter = new ReplaceColorFilter;
+      replaceFilter->setFrom(color_utils::color_for_image(Color::fromString(params[0]), format));
+      replaceFilter->setTo(color_utils::color_for_image(Color::fromString(params[1]), format));
+      replaceFilter->setTolerance(params.size() > 2 ? param_to_int(params[2]): 0);
+      filter = replaceFilter;
+    }
+
+    if (pointFilter) {
+      owned.push_back(pointFilter);
+
+      // Chain this filter with the previous point filter.
+      if (lastPointFilter && targets.back() == target) {
+        if (!chain) {
+          chain = new PointFilterChain;
+          chain->addFilter(lastPointFilter);
+          owned.push_back(chain);
+          filters.back() = chain;
+        }
+        chain->addFilter(pointFilter);
+        continue;
+      }
+
+      filter = lastPointFilter = pointFilter;
+    }
+    else {
+      owned.push_back(filter);
+      lastPointFilter = NULL;
+    }
+
+    chain = NULL;
+    filters.push_back(filter);
+    targets.push_back(target);
+  }
+}
+
+BatchFilters::FilterSpec BatchFilters::parseFilter(const std::string& spec)
+{
+  FilterSpec result;
+  std::string::size_type i, j;
+
+  i = spec.find(':');
+  result.name = spec.substr(0, i);
+  result.target = kDefaultTarget;
+
+  while (i != std::string::npos) {
+    j = spec.find(':', i+1);
+    result.params.push_back(spec.substr(i+1, j == std::string::npos ? j: j-i-1));
+    i = j;
+  }
+
+  const std::vector<std::string>& params = result.params;
+
+  if (result.name == "invert-color") {
+    // No parameters
+  }
+  else if (result.name == "color-curve") {
+    // Points of the curve as "x,y" (e.g. "color-curve:0,0:128,200:255,255")
+    result.curve.reset(new ColorCurve(ColorCurve::Linear));
+    for (size_t k=0; k<params.size(); ++k) {
+      std::string::size_type comma = params[k].find(',');
+      if (comma == std::string::npos)
+        throw base::Exception("Invalid color curve point \"%s\"", params[k].c_str());
+
+      result.curve->addPoint(gfx::Point(param_to_int(params[k].substr(0, comma)),
+                                        param_to_int(params[k].substr(comma+1))));
+    }
+    if (params.size() < 2)
+      throw base::Exception("A color curve needs at least two points");
+
+    result.target |= TARGET_ALPHA_CHANNEL;
+  }
+  else if (result.name == "brightness-contrast") {
+    // Brightness and contrast (from -100 to +100)
+    if (params.empty() || params.size() > 2)
+      throw base::Exception("Use brightness-contrast:<brightness>[:<contrast>]");
+
+    for (size_t k=0; k<params.size(); ++k)
+      param_to_int(params[k]);
+  }
+  else if (result.name == "convolution-matrix") {
+    // Name of the matrix in the stock
+    if (params.size() != 1)
+      throw base::Exception("Use convolution-matrix:<matrix-name>");
+
+    ConvolutionMatrixStock stock;
+    result.matrix = stock.getByName(params[0].c_str());
+    if (!result.matrix)
+      throw base::Exception("Convolution matrix \"%s\" not found", params[0].c_str());
+
+    result.target = result.matrix->getDefaultTarget();
+  }
+  else if (result.name == "despeckle") {
+    // Width and height of the median filter
+    if (params.empty() || params.size() > 2)
+      throw base::Exception("Use despeckle:<width>[:<height>]");
+
+    for (size_t k=0; k<params.size(); ++k)
+      if (param_to_int(params[k]) < 1)
+        throw base::Exception("Invalid despeckle size \"%s\"", params[k].c_str());
+  }
+  else if (result.name == "replace-color") {
+    // From/to colors (e.g. "rgb{255,0,0}" or "index{4}") and tolerance
+    if (params.size() < 2 || params.size() > 3)
+      throw base::Exception("Use replace-color:<from>:<to>[:<tolerance>]");
+
+    if (params.size() > 2)
+      param_to_int(params[2]);
+
+    result.target |= TARGET_ALPHA_CHANNEL;
+  }
+  else
+    throw base::Exception("Unknown filter \"%s\"", result.name.c_str());
+
+  return result;
+}
+
+} // namespace app
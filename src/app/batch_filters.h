@@ -0,0 +1,103 @@
+/* Aseprite
+ * Copyright (C) 2001-2013  David Capello
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef APP_BATCH_FILTERS_H_INCLUDED
+#define APP_BATCH_FILTERS_H_INCLUDED
+#pragma once
+
+#include "base/disable_copying.h"
+#include "base/mutex.h"
+#include "base/shared_ptr.h"
+#include "filters/target.h"
+#include "raster/pixel_format.h"
+
+#include <string>
+#include <vector>
+
+namespace filters {
+  class ColorCurve;
+  class ConvolutionMatrix;
+  class Filter;
+}
+
+namespace app {
+  class Document;
+
+  // Applies filters given in the command line to all frames and
+  // layers of the loaded documents, and saves the results.
+  class BatchFilters {
+  public:
+    BatchFilters();
+    ~BatchFilters();
+
+    // Sets the list of filters to apply (in order). Each filter is
+    // specified as "name[:param1:param2...]", and filters are
+    // separated by ';'. Throws a base::Exception if some filter or
+    // parameter is not valid.
+    void setFilters(const std::string& filters);
+
+    // Sets the channels to modify with letters "rgbaki" (red, green,
+    // blue, alpha, gray, index). By default each filter modifies the
+    // same channels as its command in the UI.
+    void setChannels(const std::string& channels);
+
+    // Sets the directory where filtered documents are saved. By
+    // default documents are overwritten.
+    void setOutputDir(const std::string& dir) { m_outputDir = dir; }
+
+    void addDocument(Document* document);
+
+    // Applies the filters to all documents (several documents at the
+    // same time in different threads), and then saves them. Returns
+    // false if some document couldn't be saved.
+    bool applyFilters();
+
+  private:
+    struct FilterSpec {
+      std::string name;
+      std::vector<std::string> params;
+      filters::Target target;
+      SharedPtr<filters::ColorCurve> curve;
+      SharedPtr<filters::ConvolutionMatrix> matrix;
+    };
+
+    typedef std::vector<filters::Filter*> Filters;
+
+    static void thread_proxy(BatchFilters* self);
+    void applyToDocuments();
+    bool getNextDocument(Document*& document);
+    void applyToDocument(Document* document);
+    void createFilters(raster::PixelFormat format, Filters& filters,
+                       std::vector<filters::Target>& targets, Filters& owned);
+    FilterSpec parseFilter(const std::string& spec);
+
+    std::vector<FilterSpec> m_specs;
+    filters::Target m_channels;
+    std::string m_outputDir;
+    std::vector<Document*> m_documents;
+
+    // Next document to be filtered by a thread.
+    base::mutex m_mutex;
+    size_t m_nextDocument;
+
+    DISABLE_COPYING(BatchFilters);
+  };
+
+} // namespace app
+
+#endif
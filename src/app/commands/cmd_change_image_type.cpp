@@ -69,6 +69,12 @@ void ChangePixelFormatCommand::onLoadParams(Params* params)
   std::string dithering = params->get("dithering");
   if (dithering == "ordered")
     m_dithering = DITHERING_ORDERED;
+  else if (dithering == "floyd-steinberg")
+    m_dithering = DITHERING_FLOYD_STEINBERG;
+  else if (dithering == "sierra-lite")
+    m_dithering = DITHERING_SIERRA_LITE;
+  else if (dithering == "atkinson")
+    m_dithering = DITHERING_ATKINSON;
   else
     m_dithering = DITHERING_NONE;
 }
@@ -81,7 +87,7 @@ bool ChangePixelFormatCommand::onEnabled(Context* context)
   if (sprite != NULL &&
       sprite->getPixelFormat() == IMAGE_INDEXED &&
       m_format == IMAGE_INDEXED &&
-      m_dithering == DITHERING_ORDERED)
+      m_dithering != DITHERING_NONE)
     return false;
 
   return sprite != NULL;
@@ -95,7 +101,7 @@ bool ChangePixelFormatCommand::onChecked(Context* context)
   if (sprite != NULL &&
       sprite->getPixelFormat() == IMAGE_INDEXED &&
       m_format == IMAGE_INDEXED &&
-      m_dithering == DITHERING_ORDERED)
+      m_dithering != DITHERING_NONE)
     return false;
 
   return
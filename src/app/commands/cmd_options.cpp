@@ -83,6 +83,9 @@ void OptionsCommand::onExecute(Context* context)
   Widget* undo_size_limit = app::find_widget<Widget>(window, "undo_size_limit");
   Widget* undo_goto_modified = app::find_widget<Widget>(window, "undo_goto_modified");
   ComboBox* screen_scale = app::find_widget<ComboBox>(window, "screen_scale");
+  ComboBox* ase_compression = app::find_widget<ComboBox>(window, "ase_compression");
+  Widget* ase_lazy_loading = app::find_widget<Widget>(window, "ase_lazy_loading");
+  Widget* ase_incremental_save = app::find_widget<Widget>(window, "ase_incremental_save");
   Widget* button_ok = app::find_widget<Widget>(window, "button_ok");
 
   // Cursor color
@@ -149,6 +152,24 @@ void OptionsCommand::onExecute(Context* context)
   if (get_config_bool("Options", "UndoGotoModified", true))
     undo_goto_modified->setSelected(true);
 
+  // Compression level of .ase files (zlib levels)
+  ase_compression->addItem("Fast");
+  ase_compression->addItem("Default");
+  ase_compression->addItem("Best");
+  switch (get_config_int("ASE", "CompressionLevel", -1)) {
+    case 1: ase_compression->setSelectedItemIndex(0); break;
+    case 9: ase_compression->setSelectedItemIndex(2); break;
+    default: ase_compression->setSelectedItemIndex(1); break;
+  }
+
+  // Decompress cels of .ase files when they are used
+  if (get_config_bool("ASE", "LazyLoading", false))
+    ase_lazy_loading->setSelected(true);
+
+  // Copy unmodified cels when .ase files are saved
+  if (get_config_bool("ASE", "IncrementalSave", true))
+    ase_incremental_save->setSelected(true);
+
   // Show the window and wait the user to close it
   window->openWindowInForeground();
 
@@ -174,6 +195,12 @@ void OptionsCommand::onExecute(Context* context)
     set_config_int("Options", "UndoSizeLimit", undo_size_limit_value);
     set_config_bool("Options", "UndoGotoModified", undo_goto_modified->isSelected());
 
+    static const int ase_compression_levels[] = { 1, -1, 9 };
+    set_config_int("ASE", "CompressionLevel",
+                   ase_compression_levels[MID(0, ase_compression->getSelectedItemIndex(), 2)]);
+    set_config_bool("ASE", "LazyLoading", ase_lazy_loading->isSelected());
+    set_config_bool("ASE", "IncrementalSave", ase_incremental_save->isSelected());
+
     int new_screen_scaling = screen_scale->getSelectedItemIndex()+1;
     if (new_screen_scaling != get_screen_scaling()) {
       set_screen_scaling(new_screen_scaling);
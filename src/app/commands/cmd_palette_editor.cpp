@@ -70,6 +70,10 @@ namespace app {
 using namespace gfx;
 using namespace ui;
 
+// Number of k-means iterations used to refine the median-cut palette
+// when "Refine" is checked in the Palette Editor.
+static const int kRefinementIterations = 8;
+
 class PaletteEntryEditor : public Window {
 public:
   PaletteEntryEditor();
@@ -91,6 +95,7 @@ protected:
   void onPasteColorsClick(Event& ev);
   void onRampClick(Event& ev);
   void onQuantizeClick(Event& ev);
+  void onRefineClick(Event& ev);
 
 private:
   void selectColorType(app::Color::Type type);
@@ -115,6 +120,7 @@ private:
   Button m_pasteButton;
   Button m_rampButton;
   Button m_quantizeButton;
+  CheckBox m_refineCheck;
 
   // This variable is used to avoid updating the m_hexColorEntry text
   // when the color change is generated from a
@@ -255,6 +261,7 @@ PaletteEntryEditor::PaletteEntryEditor()
   , m_pasteButton("Paste")
   , m_rampButton("Ramp")
   , m_quantizeButton("Quantize")
+  , m_refineCheck("Refine")
   , m_disableHexUpdate(false)
   , m_redrawAll(false)
   , m_implantChange(false)
@@ -272,6 +279,7 @@ PaletteEntryEditor::PaletteEntryEditor()
   setup_mini_look(&m_pasteButton);
   setup_mini_look(&m_rampButton);
   setup_mini_look(&m_quantizeButton);
+  setup_mini_look(&m_refineCheck);
 
   // Top box
   m_topBox.addChild(&m_rgbButton);
@@ -291,6 +299,7 @@ PaletteEntryEditor::PaletteEntryEditor()
   }
   m_bottomBox.addChild(&m_rampButton);
   m_bottomBox.addChild(&m_quantizeButton);
+  m_bottomBox.addChild(&m_refineCheck);
 
   // Main vertical box
   m_vbox.addChild(&m_topBox);
@@ -301,6 +310,7 @@ PaletteEntryEditor::PaletteEntryEditor()
 
   // Hide (or show) the "More Options" depending the saved value in .cfg file
   m_bottomBox.setVisible(get_config_bool("PaletteEditor", "ShowMoreOptions", false));
+  m_refineCheck.setSelected(get_config_bool("PaletteEditor", "RefineQuantization", false));
 
   m_rgbButton.Click.connect(&PaletteEntryEditor::onColorTypeButtonClick, this);
   m_hsvButton.Click.connect(&PaletteEntryEditor::onColorTypeButtonClick, this);
@@ -309,6 +319,7 @@ PaletteEntryEditor::PaletteEntryEditor()
   m_pasteButton.Click.connect(&PaletteEntryEditor::onPasteColorsClick, this);
   m_rampButton.Click.connect(&PaletteEntryEditor::onRampClick, this);
   m_quantizeButton.Click.connect(&PaletteEntryEditor::onQuantizeClick, this);
+  m_refineCheck.Click.connect(&PaletteEntryEditor::onRefineClick, this);
 
   m_rgbSliders.ColorChange.connect(&PaletteEntryEditor::onColorSlidersChange, this);
   m_hsvSliders.ColorChange.connect(&PaletteEntryEditor::onColorSlidersChange, this);
@@ -593,13 +604,24 @@ void PaletteEntryEditor::onQuantizeClick(Event& ev)
       return;
     }
 
-    palette = quantization::create_palette_from_rgb(sprite, reader.frame());
+    // The median-cut palette is refined with some k-means iterations
+    // if "Refine" is checked (slower, but with better colors).
+    quantization::PaletteOptions options;
+    if (m_refineCheck.isSelected())
+      options.refinementIterations = kRefinementIterations;
+
+    palette = quantization::create_palette_from_rgb(sprite, reader.frame(), options);
   }
 
   setNewPalette(palette, "Quantize Palette");
   delete palette;
 }
 
+void PaletteEntryEditor::onRefineClick(Event& ev)
+{
+  set_config_bool("PaletteEditor", "RefineQuantization", m_refineCheck.isSelected());
+}
+
 void PaletteEntryEditor::setPaletteEntry(const app::Color& color)
 {
   PaletteView* palView = ColorBar::instance()->getPaletteView();
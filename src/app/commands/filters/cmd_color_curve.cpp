@@ -75,6 +75,7 @@ protected:
     // editor. But anyway, we have to re-set the same curve in the
     // filter to regenerate the map used internally by the filter
     // (which is calculated inside setCurve() method).
+    stopPreview();
     m_filter.setCurve(m_editor.getCurve());
 
     restartPreview();
@@ -71,6 +71,7 @@ public:
 private:
   void onSizeChange()
   {
+    stopPreview();
     m_filter.setSize(m_widthEntry->getTextInt(),
                      m_heightEntry->getTextInt());
     restartPreview();
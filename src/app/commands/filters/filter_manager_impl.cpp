@@ -28,6 +28,8 @@
 #include "app/ui/editor/editor.h"
 #include "app/undo_transaction.h"
 #include "app/undoers/image_area.h"
+#include "base/scoped_lock.h"
+#include "base/thread.h"
 #include "filters/filter.h"
 #include "raster/cel.h"
 #include "raster/image.h"
@@ -40,14 +42,141 @@
 #include "ui/view.h"
 #include "ui/widget.h"
 
+#include <algorithm>
 #include <cstdlib>
 #include <cstring>
+#include <vector>
 
 namespace app {
 
 using namespace std;
 using namespace ui;
-  
+
+// Number of rows that a thread processes each time it takes a band
+// of the image (when the filter is applied in parallel).
+static const int kRowsPerBand = 8;
+
+// Maximum number of filtered images (by thread) waiting to be copied
+// to the sprite (when the filter is applied to several
+// frames/layers).
+static const int kImagesPerThread = 2;
+
+// Number of rows that are represented by each filtered row in the
+// low resolution pass of the preview.
+static const int kLowResRows = 4;
+
+// FilterManager used to apply the filter from different threads at
+// the same time. Each thread has its own RowsFilterManager (with its
+// own image, current row and mask iterator).
+class FilterManagerImpl::RowsFilterManager : public FilterManager
+                                           , public FilterIndexedData {
+public:
+  RowsFilterManager(FilterManagerImpl* mgr, Palette* palette, RgbMap* rgbmap)
+    : m_mgr(mgr)
+    , m_palette(palette)
+    , m_rgbmap(rgbmap)
+    , m_row(0) {
+  }
+
+  static void bands_thread_proxy(RowsFilterManager* rows) {
+    rows->applyToBands();
+  }
+
+  static void images_thread_proxy(RowsFilterManager* rows, std::vector<ImageToFilter>* images) {
+    rows->applyToImages(*images);
+  }
+
+  // Applies the filter to bands of rows of "image" until there are
+  // no more rows to process (or the process is cancelled).
+  void applyToBands() {
+    int row1, row2;
+    int finishedRows = 0;
+
+    m_image = m_mgr->getImageToFilter();
+
+    while (m_mgr->getNextBand(finishedRows, row1, row2)) {
+      applyToRows(row1, row2);
+      finishedRows = row2 - row1;
+    }
+  }
+
+  // Applies the filter to the next images to be filtered from the
+  // given list until there are no more images to process (or the
+  // process is cancelled).
+  void applyToImages(std::vector<ImageToFilter>& images) {
+    int index;
+
+    while (m_mgr->getNextImage(index)) {
+      // Wait the main thread to commit the filtered images
+      if (index < 0)
+        base::this_thread::sleep_for(0.001);
+      else
+        applyToImage(images, index);
+    }
+  }
+
+  // Applies the filter to the given image of the list (creating its
+  // destination image).
+  void applyToImage(std::vector<ImageToFilter>& images, int index) {
+    ImageToFilter& image = images[index];
+
+    image.dst = crop_image(image.src, 0, 0, image.src->getWidth(), image.src->getHeight(), 0);
+    m_image = image;
+    applyToRows(0, m_image.h);
+
+    m_mgr->setImageFiltered(index);
+  }
+
+  // Applies the filter to one row of the given image.
+  void applyToRow(const ImageToFilter& image, int row) {
+    m_image = image;
+    applyToRows(row, row+1);
+  }
+
+  // FilterManager implementation
+  const void* getSourceAddress() { return m_image.src->getPixelAddress(m_image.x, m_row+m_image.y); }
+  void* getDestinationAddress() { return m_image.dst->getPixelAddress(m_image.x, m_row+m_image.y); }
+  int getWidth() { return m_image.w; }
+  Target getTarget() { return m_image.target; }
+  FilterIndexedData* getIndexedData() { return this; }
+  const Image* getSourceImage() { return m_image.src; }
+  int getX() { return m_image.x; }
+  int getY() { return m_image.y+m_row; }
+
+  bool skipPixel() {
+    bool skip = false;
+
+    if ((m_image.mask) && (m_image.mask->getBitmap())) {
+      if (!*m_maskIterator)
+        skip = true;
+
+      ++m_maskIterator;
+    }
+
+    return skip;
+  }
+
+  // FilterIndexedData implementation
+  Palette* getPalette() { return m_palette; }
+  RgbMap* getRgbMap() { return m_rgbmap; }
+
+private:
+  void applyToRows(int row1, int row2) {
+    for (m_row=row1; m_row<row2; ++m_row) {
+      m_mgr->lockMaskRow(m_image, m_row, m_maskBits, m_maskIterator);
+      m_mgr->applyFilterToRow(this);
+    }
+  }
+
+  FilterManagerImpl* m_mgr;
+  Palette* m_palette;
+  RgbMap* m_rgbmap;
+  ImageToFilter m_image;
+  int m_row;
+  ImageBits<BitmapTraits> m_maskBits;
+  ImageBits<BitmapTraits>::iterator m_maskIterator;
+};
+
 FilterManagerImpl::FilterManagerImpl(Context* context, Filter* filter)
   : m_context(context)
   , m_location(context->getActiveLocation())
@@ -108,7 +237,7 @@ void FilterManagerImpl::begin()
   updateMask(m_mask, m_src);
 }
 
-void FilterManagerImpl::beginForPreview()
+bool FilterManagerImpl::beginForPreview()
 {
   Document* document = m_location.document();
 
@@ -147,7 +276,7 @@ void FilterManagerImpl::beginForPreview()
     if ((w < 1) || (h < 1)) {
       m_preview_mask.reset(NULL);
       m_row = -1;
-      return;
+      return false;
     }
 
     m_preview_mask->intersect(x, y, w, h);
@@ -156,8 +285,18 @@ void FilterManagerImpl::beginForPreview()
   if (!updateMask(m_mask, m_src)) {
     m_preview_mask.reset(NULL);
     m_row = -1;
-    return;
+    return false;
   }
+
+  // Regenerate the RgbMap (if it's needed) in this thread, so the
+  // preview can be calculated in a background thread.
+  if (m_location.sprite()->getPixelFormat() == IMAGE_INDEXED)
+    getRgbMap();
+
+  // Buffer where the background thread filters the preview.
+  m_previewBuffer.reset(Image::createCopy(m_dst));
+
+  return true;
 }
 
 void FilterManagerImpl::end()
@@ -168,22 +307,8 @@ void FilterManagerImpl::end()
 bool FilterManagerImpl::applyStep()
 {
   if ((m_row >= 0) && (m_row < m_h)) {
-    if ((m_mask) && (m_mask->getBitmap())) {
-      int x = m_x - m_mask->getBounds().x + m_offset_x;
-      int y = m_row + m_y - m_mask->getBounds().y + m_offset_y;
-
-      m_maskBits = m_mask->getBitmap()
-        ->lockBits<BitmapTraits>(Image::ReadLock,
-                                 gfx::Rect(x, y, m_w - x, m_h - y));
-
-      m_maskIterator = m_maskBits.begin();
-    }
-
-    switch (m_location.sprite()->getPixelFormat()) {
-      case IMAGE_RGB:       m_filter->applyToRgba(this); break;
-      case IMAGE_GRAYSCALE: m_filter->applyToGrayscale(this); break;
-      case IMAGE_INDEXED:   m_filter->applyToIndexed(this); break;
-    }
+    lockMaskRow(getImageToFilter(), m_row, m_maskBits, m_maskIterator);
+    applyFilterToRow(this);
     ++m_row;
 
     return true;
@@ -196,15 +321,27 @@ bool FilterManagerImpl::applyStep()
 void FilterManagerImpl::apply()
 {
   bool cancelled = false;
+  int nthreads = 1;
 
-  begin();
-  while (!cancelled && applyStep()) {
-    if (m_progressDelegate) {
-      // Report progress.
-      m_progressDelegate->reportProgress(m_progressBase + m_progressWidth * (m_row+1) / m_h);
+  // Thread-safe filters are applied by several threads, each one
+  // processing different bands of rows.
+  if (m_filter->isThreadSafe())
+    nthreads = std::min<int>(base::thread::hardware_concurrency(),
+                             (m_h+kRowsPerBand-1) / kRowsPerBand);
 
-      // Does the user cancelled the whole process?
-      cancelled = m_progressDelegate->isCancelled();
+  begin();
+  if (nthreads > 1) {
+    cancelled = !applyInBands(nthreads);
+  }
+  else {
+    while (!cancelled && applyStep()) {
+      if (m_progressDelegate) {
+        // Report progress.
+        m_progressDelegate->reportProgress(m_progressBase + m_progressWidth * (m_row+1) / m_h);
+
+        // Does the user cancelled the whole process?
+        cancelled = m_progressDelegate->isCancelled();
+      }
     }
   }
 
@@ -222,6 +359,102 @@ void FilterManagerImpl::apply()
   }
 }
 
+// Applies the filter to all rows using "nthreads" threads (the
+// current one included). Returns false if the process was cancelled.
+bool FilterManagerImpl::applyInBands(int nthreads)
+{
+  Palette* palette = NULL;
+  RgbMap* rgbmap = NULL;
+
+  // The RgbMap is regenerated (if it's needed) here, before the
+  // threads use it.
+  if (m_location.sprite()->getPixelFormat() == IMAGE_INDEXED) {
+    palette = getPalette();
+    rgbmap = getRgbMap();
+  }
+
+  m_nextRow = 0;
+  m_finishedRows = 0;
+  m_cancelled = false;
+
+  std::vector<RowsFilterManager*> rows(nthreads);
+  std::vector<base::thread*> threads(nthreads-1);
+
+  for (int i=0; i<nthreads; ++i)
+    rows[i] = new RowsFilterManager(this, palette, rgbmap);
+
+  for (int i=0; i<nthreads-1; ++i)
+    threads[i] = new base::thread(&RowsFilterManager::bands_thread_proxy, rows[i+1]);
+
+  rows[0]->applyToBands();
+
+  for (int i=0; i<nthreads-1; ++i) {
+    threads[i]->join();
+    delete threads[i];
+  }
+
+  for (int i=0; i<nthreads; ++i)
+    delete rows[i];
+
+  return !m_cancelled;
+}
+
+// Called by each thread to report that it has processed
+// "finishedRows", and to get the next band of rows [row1,row2) to
+// process. Returns false if there are no more rows.
+bool FilterManagerImpl::getNextBand(int finishedRows, int& row1, int& row2)
+{
+  base::scoped_lock hold(m_bandsMutex);
+
+  if (finishedRows > 0) {
+    m_finishedRows += finishedRows;
+
+    if (m_progressDelegate) {
+      m_progressDelegate->reportProgress(m_progressBase + m_progressWidth * m_finishedRows / m_h);
+
+      if (m_progressDelegate->isCancelled())
+        m_cancelled = true;
+    }
+  }
+
+  if (m_cancelled || m_nextRow >= m_h)
+    return false;
+
+  row1 = m_nextRow;
+  row2 = m_nextRow = std::min(m_nextRow+kRowsPerBand, m_h);
+  return true;
+}
+
+// Called by each thread to get the index of the next image to be
+// filtered. Returns false if there are no more images (or the
+// process was cancelled). "index" is -1 if the thread has to wait
+// because there are too many filtered images to be committed.
+bool FilterManagerImpl::getNextImage(int& index)
+{
+  base::scoped_lock hold(m_bandsMutex);
+
+  if (m_cancelled || m_nextImage >= (int)m_filtered.size())
+    return false;
+
+  if (m_nextImage >= m_maxImage)
+    index = -1;
+  else
+    index = m_nextImage++;
+  return true;
+}
+
+void FilterManagerImpl::setImageFiltered(int index)
+{
+  base::scoped_lock hold(m_bandsMutex);
+  m_filtered[index] = true;
+}
+
+bool FilterManagerImpl::isImageFiltered(int index)
+{
+  base::scoped_lock hold(m_bandsMutex);
+  return m_filtered[index];
+}
+
 void FilterManagerImpl::applyToTarget()
 {
   bool cancelled = false;
@@ -243,34 +476,243 @@ void FilterManagerImpl::applyToTarget()
   m_progressBase = 0.0f;
   m_progressWidth = 1.0f / images.size();
 
-  // For each target image
+  // Each image is filtered by a different thread (if the filter is
+  // thread-safe and there are several images)
+  int nthreads = 1;
+  if (m_filter->isThreadSafe() && images.size() > 1)
+    nthreads = std::min<int>(base::thread::hardware_concurrency(), images.size());
+
+  if (nthreads > 1) {
+    cancelled = !applyToImagesInParallel(images, nthreads);
+  }
+  else {
+    // For each target image
+    for (ImagesCollector::ItemsIterator it = images.begin();
+         it != images.end() && !cancelled;
+         ++it) {
+      applyToImage(it->layer(), it->image(), it->cel()->getX(), it->cel()->getY());
+
+      // Is there a delegate to know if the process was cancelled by the user?
+      if (m_progressDelegate)
+        cancelled = m_progressDelegate->isCancelled();
+
+      // Make progress
+      m_progressBase += m_progressWidth;
+    }
+  }
+
+  undo.commit();
+}
+
+// Applies the filter to all images using "nthreads" threads (the
+// current one included). Each thread takes the next image to be
+// filtered, and the current thread copies the filtered images to the
+// sprite in the same order as the ImagesCollector returns them (so
+// the undo history is the same as applying the filter to each image
+// sequentially). Returns false if the process was cancelled.
+bool FilterManagerImpl::applyToImagesInParallel(ImagesCollector& images, int nthreads)
+{
+  std::vector<ImageToFilter> list;
+
   for (ImagesCollector::ItemsIterator it = images.begin();
-       it != images.end() && !cancelled;
+       it != images.end();
        ++it) {
-    applyToImage(it->layer(), it->image(), it->cel()->getX(), it->cel()->getY());
+    initArea(it->layer(), it->image(), it->cel()->getX(), it->cel()->getY());
+    begin();
+
+    // The destination image is created by the thread that filters it
+    ImageToFilter image = getImageToFilter();
+    image.dst = NULL;
+    list.push_back(image);
+  }
+
+  nthreads = std::min<int>(nthreads, list.size());
+
+  Palette* palette = NULL;
+  RgbMap* rgbmap = NULL;
 
-    // Is there a delegate to know if the process was cancelled by the user?
-    if (m_progressDelegate)
-      cancelled = m_progressDelegate->isCancelled();
+  if (m_location.sprite()->getPixelFormat() == IMAGE_INDEXED) {
+    palette = getPalette();
+    rgbmap = getRgbMap();
+  }
+
+  m_filtered.assign(list.size(), false);
+  m_nextImage = 0;
+  m_maxImage = nthreads*kImagesPerThread;
+  m_cancelled = false;
+
+  std::vector<RowsFilterManager*> rows(nthreads);
+  std::vector<base::thread*> threads;
+
+  for (int i=0; i<nthreads; ++i)
+    rows[i] = new RowsFilterManager(this, palette, rgbmap);
+
+  for (int i=0; i<nthreads-1; ++i)
+    threads.push_back(new base::thread(&RowsFilterManager::images_thread_proxy, rows[i+1], &list));
+
+  size_t committed = 0;
+  try {
+    while (committed < list.size()) {
+      int index;
+
+      if (isImageFiltered(committed)) {
+        commitImage(list[committed]);
+        ++committed;
+
+        {
+          base::scoped_lock hold(m_bandsMutex);
+          m_maxImage = committed + nthreads*kImagesPerThread;
+        }
+
+        // Make progress
+        m_progressBase += m_progressWidth;
+
+        if (m_progressDelegate) {
+          m_progressDelegate->reportProgress(m_progressBase);
+
+          if (m_progressDelegate->isCancelled()) {
+            base::scoped_lock hold(m_bandsMutex);
+            m_cancelled = true;
+            break;
+          }
+        }
+      }
+      // Filter an image in this thread too
+      else if (getNextImage(index) && index >= 0)
+        rows[0]->applyToImage(list, index);
+      // Wait other threads to filter the next image to be committed
+      else
+        base::this_thread::sleep_for(0.001);
+    }
+  }
+  catch (...) {
+    {
+      base::scoped_lock hold(m_bandsMutex);
+      m_cancelled = true;
+    }
+    finishImagesInParallel(list, rows, threads);
+    throw;
+  }
+
+  finishImagesInParallel(list, rows, threads);
+  return (committed == list.size());
+}
+
+// Waits the threads of applyToImagesInParallel(), and deletes the
+// filtered images that weren't committed.
+void FilterManagerImpl::finishImagesInParallel(std::vector<ImageToFilter>& images,
+                                               std::vector<RowsFilterManager*>& rows,
+                                               std::vector<base::thread*>& threads)
+{
+  for (size_t i=0; i<threads.size(); ++i) {
+    threads[i]->join();
+    delete threads[i];
+  }
+
+  for (size_t i=0; i<rows.size(); ++i)
+    delete rows[i];
 
-    // Make progress
-    m_progressBase += m_progressWidth;
+  for (size_t i=0; i<images.size(); ++i) {
+    delete images[i].dst;
+    images[i].dst = NULL;
   }
+}
+
+// Copies the filtered image to the sprite (with its own undo group)
+// and deletes the filtered copy.
+void FilterManagerImpl::commitImage(ImageToFilter& image)
+{
+  UndoTransaction undo(m_context, m_filter->getName(), undo::ModifyDocument);
+
+  // Undo stuff
+  if (undo.isEnabled())
+    undo.pushUndoer(new undoers::ImageArea(undo.getObjects(), image.src,
+                                           image.x, image.y, image.w, image.h));
+
+  // Copy "dst" to "src"
+  copy_image(image.src, image.dst, 0, 0);
 
   undo.commit();
+
+  delete image.dst;
+  image.dst = NULL;
 }
 
-void FilterManagerImpl::flush()
+void FilterManagerImpl::applyToPreview(const gfx::Rect& area, PreviewPass pass)
+{
+  Palette* palette = NULL;
+  RgbMap* rgbmap = NULL;
+
+  if (m_location.sprite()->getPixelFormat() == IMAGE_INDEXED) {
+    palette = getPalette();
+    rgbmap = getRgbMap();
+  }
+
+  ImageToFilter image = getImageToFilter();
+  image.dst = m_previewBuffer;
+  image.x = area.x;
+  image.y = area.y;
+  image.w = area.w;
+  image.h = area.h;
+
+  RowsFilterManager rows(this, palette, rgbmap);
+  int bytesPerPixel = calculate_rowstride_bytes(image.dst->getPixelFormat(), 1);
+
+  for (int row=0; row<image.h; ++row) {
+    bool lowResRow = ((row % kLowResRows) == 0);
+
+    if (pass == LowResPass) {
+      if (!lowResRow)
+        continue;
+
+      rows.applyToRow(image, row);
+
+      // Repeat the filtered row in the next rows (only in selected pixels)
+      const uint8_t* filtered = image.dst->getPixelAddress(image.x, image.y+row);
+
+      for (int copyRow=row+1; copyRow<row+kLowResRows && copyRow<image.h; ++copyRow) {
+        uint8_t* dst = image.dst->getPixelAddress(image.x, image.y+copyRow);
+
+        if ((image.mask) && (image.mask->getBitmap())) {
+          ImageBits<BitmapTraits> maskBits;
+          ImageBits<BitmapTraits>::iterator maskIterator;
+          lockMaskRow(image, copyRow, maskBits, maskIterator);
+
+          for (int x=0; x<image.w; ++x, ++maskIterator)
+            if (*maskIterator)
+              memcpy(dst + x*bytesPerPixel, filtered + x*bytesPerPixel, bytesPerPixel);
+        }
+        else
+          memcpy(dst, filtered, image.w*bytesPerPixel);
+      }
+    }
+    else if (!lowResRow) {
+      rows.applyToRow(image, row);
+    }
+  }
+}
+
+Image* FilterManagerImpl::cropPreview(const gfx::Rect& area) const
+{
+  return crop_image(m_previewBuffer, area.x, area.y, area.w, area.h, 0);
+}
+
+void FilterManagerImpl::copyToDestination(const gfx::Rect& area, const Image* image)
+{
+  copy_image(m_dst, image, area.x, area.y);
+}
+
+void FilterManagerImpl::flush(const gfx::Rect& area)
 {
   if (m_row >= 0) {
     gfx::Rect rect;
 
     Editor* editor = current_editor;
-    editor->editorToScreen(m_x+m_offset_x,
-                           m_y+m_offset_y+m_row-1,
+    editor->editorToScreen(area.x+m_offset_x,
+                           area.y+m_offset_y,
                            &rect.x, &rect.y);
-    rect.w = (m_w << editor->getZoom());
-    rect.h = (1 << editor->getZoom());
+    rect.w = (area.w << editor->getZoom());
+    rect.h = (area.h << editor->getZoom());
 
     gfx::Region reg1(rect);
     gfx::Region reg2;
@@ -291,6 +733,47 @@ void* FilterManagerImpl::getDestinationAddress()
   return m_dst->getPixelAddress(m_x, m_row+m_y);
 }
 
+FilterManagerImpl::ImageToFilter FilterManagerImpl::getImageToFilter()
+{
+  ImageToFilter image;
+  image.src = m_src;
+  image.dst = m_dst;
+  image.x = m_x;
+  image.y = m_y;
+  image.w = m_w;
+  image.h = m_h;
+  image.offset_x = m_offset_x;
+  image.offset_y = m_offset_y;
+  image.mask = m_mask;
+  image.target = m_target;
+  return image;
+}
+
+void FilterManagerImpl::lockMaskRow(const ImageToFilter& image, int row,
+                                    ImageBits<BitmapTraits>& maskBits,
+                                    ImageBits<BitmapTraits>::iterator& maskIterator)
+{
+  if ((image.mask) && (image.mask->getBitmap())) {
+    int x = image.x - image.mask->getBounds().x + image.offset_x;
+    int y = row + image.y - image.mask->getBounds().y + image.offset_y;
+
+    maskBits = image.mask->getBitmap()
+      ->lockBits<BitmapTraits>(Image::ReadLock,
+                               gfx::Rect(x, y, image.w, 1));
+
+    maskIterator = maskBits.begin();
+  }
+}
+
+void FilterManagerImpl::applyFilterToRow(FilterManager* filterMgr)
+{
+  switch (m_location.sprite()->getPixelFormat()) {
+    case IMAGE_RGB:       m_filter->applyToRgba(filterMgr); break;
+    case IMAGE_GRAYSCALE: m_filter->applyToGrayscale(filterMgr); break;
+    case IMAGE_INDEXED:   m_filter->applyToIndexed(filterMgr); break;
+  }
+}
+
 bool FilterManagerImpl::skipPixel()
 {
   bool skip = false;
@@ -316,6 +799,14 @@ RgbMap* FilterManagerImpl::getRgbMap()
 }
 
 void FilterManagerImpl::init(const Layer* layer, Image* image, int offset_x, int offset_y)
+{
+  initArea(layer, image, offset_x, offset_y);
+  m_dst.reset(crop_image(image, 0, 0, image->getWidth(), image->getHeight(), 0));
+}
+
+// Prepares the area of "image" to be filtered (without creating the
+// destination image).
+void FilterManagerImpl::initArea(const Layer* layer, Image* image, int offset_x, int offset_y)
 {
   m_offset_x = offset_x;
   m_offset_y = offset_y;
@@ -324,10 +815,10 @@ void FilterManagerImpl::init(const Layer* layer, Image* image, int offset_x, int
     throw InvalidAreaException();
 
   m_src = image;
-  m_dst.reset(crop_image(image, 0, 0, image->getWidth(), image->getHeight(), 0));
   m_row = -1;
   m_mask = NULL;
   m_preview_mask.reset(NULL);
+  m_previewBuffer.reset(NULL);
 
   m_target = m_targetOrig;
 
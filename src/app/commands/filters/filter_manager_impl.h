@@ -22,17 +22,25 @@
 
 #include "app/document_location.h"
 #include "base/exception.h"
+#include "base/mutex.h"
 #include "base/unique_ptr.h"
 #include "filters/filter_indexed_data.h"
 #include "filters/filter_manager.h"
+#include "gfx/rect.h"
 #include "raster/image_bits.h"
 #include "raster/image_traits.h"
 #include "raster/pixel_format.h"
 
 #include <cstring>
+#include <vector>
+
+namespace base {
+  class thread;
+}
 
 namespace raster {
   class Image;
+  class ImagesCollector;
   class Layer;
   class Mask;
   class Sprite;
@@ -77,6 +85,12 @@ namespace app {
       virtual bool isCancelled() = 0;
     };
 
+    // Passes of the progressive preview (see applyToPreview())
+    enum PreviewPass {
+      LowResPass,               // Filters one of each kLowResRows rows, repeating it in the next rows
+      FullResPass               // Filters the rest of rows
+    };
+
     FilterManagerImpl(Context* context, Filter* filter);
     ~FilterManagerImpl();
 
@@ -87,18 +101,38 @@ namespace app {
     void setTarget(Target target);
 
     void begin();
-    void beginForPreview();
+    bool beginForPreview();
     void end();
     bool applyStep();
     void applyToTarget();
 
+    // Applies the filter to the given area of the preview (a part of
+    // getArea() after beginForPreview()). It can be called from a
+    // background thread meanwhile the filter isn't modified. The
+    // pixels are filtered in a private buffer (not in the destination
+    // image, which is being rendered in the editor), use
+    // cropPreview() to get the filtered area.
+    void applyToPreview(const gfx::Rect& area, PreviewPass pass);
+
+    // Returns a copy of the given area of the preview buffer. It must
+    // be called from the same thread that calls applyToPreview().
+    Image* cropPreview(const gfx::Rect& area) const;
+
+    // Copies an area returned by cropPreview() into the destination
+    // image (from the UI thread).
+    void copyToDestination(const gfx::Rect& area, const Image* image);
+
+    // Area of the image where the filter is applied.
+    gfx::Rect getArea() const { return gfx::Rect(m_x, m_y, m_w, m_h); }
+
     Document* getDocument() { return m_location.document(); }
     Sprite* getSprite() { return m_location.sprite(); }
     Layer* getLayer() { return m_location.layer(); }
     Image* getDestinationImage() const { return m_dst; }
 
-    // Updates the current editor to show the progress of the preview.
-    void flush();
+    // Updates the current editor to show the given area (in image
+    // coordinates) of the preview.
+    void flush(const gfx::Rect& area);
 
     // FilterManager implementation
     const void* getSourceAddress();
@@ -116,9 +150,37 @@ namespace app {
     RgbMap* getRgbMap();
 
   private:
+    class RowsFilterManager;
+
+    // An image and the area of it where the filter is applied.
+    struct ImageToFilter {
+      Image* src;
+      Image* dst;
+      int x, y, w, h;
+      int offset_x, offset_y;
+      Mask* mask;
+      Target target;
+    };
+
     void init(const Layer* layer, Image* image, int offset_x, int offset_y);
+    void initArea(const Layer* layer, Image* image, int offset_x, int offset_y);
     void apply();
     void applyToImage(Layer* layer, Image* image, int x, int y);
+    bool applyInBands(int nthreads);
+    bool applyToImagesInParallel(ImagesCollector& images, int nthreads);
+    void finishImagesInParallel(std::vector<ImageToFilter>& images,
+                                std::vector<RowsFilterManager*>& rows,
+                                std::vector<base::thread*>& threads);
+    void commitImage(ImageToFilter& image);
+    bool getNextBand(int finishedRows, int& row1, int& row2);
+    bool getNextImage(int& index);
+    void setImageFiltered(int index);
+    bool isImageFiltered(int index);
+    ImageToFilter getImageToFilter();
+    void lockMaskRow(const ImageToFilter& image, int row,
+                     raster::ImageBits<raster::BitmapTraits>& maskBits,
+                     raster::ImageBits<raster::BitmapTraits>::iterator& maskIterator);
+    void applyFilterToRow(FilterManager* filterMgr);
     bool updateMask(Mask* mask, const Image* image);
 
     Context* m_context;
@@ -131,11 +193,23 @@ namespace app {
     int m_offset_x, m_offset_y;
     Mask* m_mask;
     base::UniquePtr<Mask> m_preview_mask;
+    base::UniquePtr<Image> m_previewBuffer;
     raster::ImageBits<raster::BitmapTraits> m_maskBits;
     raster::ImageBits<raster::BitmapTraits>::iterator m_maskIterator;
     Target m_targetOrig;          // Original targets
     Target m_target;              // Filtered targets
 
+    // Rows (or images) to be processed by the threads when the filter
+    // is applied in parallel (see applyInBands() and
+    // applyToImagesInParallel())
+    base::mutex m_bandsMutex;
+    int m_nextRow;
+    int m_finishedRows;
+    int m_nextImage;
+    int m_maxImage;               // Images after this one must wait to be filtered
+    std::vector<bool> m_filtered; // Images already filtered
+    bool m_cancelled;
+
     // Hooks
     float m_progressBase;
     float m_progressWidth;
@@ -23,21 +23,58 @@
 #include "app/commands/filters/filter_preview.h"
 
 #include "app/commands/filters/filter_manager_impl.h"
+#include "app/util/render.h"
+#include "base/scoped_lock.h"
+#include "base/thread.h"
+#include "raster/image.h"
 #include "raster/sprite.h"
 #include "ui/manager.h"
 #include "ui/message.h"
 #include "ui/widget.h"
-#include "app/util/render.h"
+
+#include <algorithm>
+#include <vector>
 
 namespace app {
 
 using namespace ui;
 using namespace filters;
 
+// Size of the tiles in which the preview is calculated.
+static const int kTileSize = 64;
+
+// Milliseconds between updates of the editor.
+static const int kFlushInterval = 15;
+
+namespace {
+
+  // Sorts tiles by their distance to the center of the area.
+  class DistanceToCenter {
+  public:
+    DistanceToCenter(const gfx::Point& center) : m_center(center) { }
+
+    bool operator()(const gfx::Rect& a, const gfx::Rect& b) const {
+      return distance(a) < distance(b);
+    }
+
+  private:
+    int distance(const gfx::Rect& rc) const {
+      int dx = rc.x + rc.w/2 - m_center.x;
+      int dy = rc.y + rc.h/2 - m_center.y;
+      return dx*dx + dy*dy;
+    }
+
+    gfx::Point m_center;
+  };
+
+}
+
 FilterPreview::FilterPreview(FilterManagerImpl* filterMgr)
   : Widget(kGenericWidget)
   , m_filterMgr(filterMgr)
-  , m_timer(1, this)
+  , m_timer(kFlushInterval, this)
+  , m_done(false)
+  , m_cancelled(false)
 {
   setVisible(false);
 }
@@ -45,24 +82,45 @@ FilterPreview::FilterPreview(FilterManagerImpl* filterMgr)
 FilterPreview::~FilterPreview()
 {
   stop();
+  clearTiles();
 }
 
 void FilterPreview::stop()
 {
-  if (m_timer.isRunning()) {
-    ASSERT(m_filterMgr != NULL);
+  pause();
 
+  if (m_filterMgr)
     m_filterMgr->end();
-  }
 
   m_filterMgr = NULL;
   m_timer.stop();
 }
 
+void FilterPreview::pause()
+{
+  if (m_thread) {
+    {
+      base::scoped_lock hold(m_mutex);
+      m_cancelled = true;
+    }
+
+    m_thread->join();
+    m_thread.reset(NULL);
+  }
+}
+
 void FilterPreview::restartPreview()
 {
-  m_filterMgr->beginForPreview();
-  m_timer.start();
+  pause();
+
+  clearTiles();
+  m_done = false;
+  m_cancelled = false;
+
+  if (m_filterMgr->beginForPreview()) {
+    m_thread.reset(new base::thread(&FilterPreview::thread_proxy, this));
+    m_timer.start();
+  }
 }
 
 FilterManagerImpl* FilterPreview::getFilterManager() const
@@ -80,6 +138,8 @@ bool FilterPreview::onProcessMessage(Message* msg)
       break;
 
     case kCloseMessage:
+      pause();
+
       RenderEngine::setPreviewImage(NULL, NULL);
 
       // Stop the preview timer.
@@ -87,16 +147,85 @@ bool FilterPreview::onProcessMessage(Message* msg)
       break;
 
     case kTimerMessage:
-      if (m_filterMgr) {
-        if (m_filterMgr->applyStep())
-          m_filterMgr->flush();
-        else
-          m_timer.stop();
-      }
+      if (m_filterMgr)
+        flushDirtyArea();
       break;
   }
 
   return Widget::onProcessMessage(msg);
 }
 
+// Applies the filter to the preview area by tiles.
+//
+// [preview thread]
+//
+void FilterPreview::applyFilterInBackground()
+{
+  gfx::Rect area = m_filterMgr->getArea();
+  std::vector<gfx::Rect> tiles;
+
+  for (int y=area.y; y<area.y+area.h; y+=kTileSize)
+    for (int x=area.x; x<area.x+area.w; x+=kTileSize)
+      tiles.push_back(gfx::Rect(x, y, kTileSize, kTileSize).createIntersect(area));
+
+  std::sort(tiles.begin(), tiles.end(),
+            DistanceToCenter(gfx::Point(area.x+area.w/2, area.y+area.h/2)));
+
+  for (int pass=FilterManagerImpl::LowResPass;
+       pass<=FilterManagerImpl::FullResPass; ++pass) {
+    for (size_t i=0; i<tiles.size(); ++i) {
+      if (isCancelled())
+        return;
+
+      m_filterMgr->applyToPreview(tiles[i], (FilterManagerImpl::PreviewPass)pass);
+      Image* image = m_filterMgr->cropPreview(tiles[i]);
+
+      base::scoped_lock hold(m_mutex);
+      m_tiles.push_back(Tile(tiles[i], image));
+    }
+  }
+
+  base::scoped_lock hold(m_mutex);
+  m_done = true;
+}
+
+bool FilterPreview::isCancelled()
+{
+  base::scoped_lock hold(m_mutex);
+  return m_cancelled;
+}
+
+// Shows the tiles filtered in the background thread in the editor.
+void FilterPreview::flushDirtyArea()
+{
+  std::vector<gfx::Rect> dirtyArea;
+  bool done;
+  {
+    base::scoped_lock hold(m_mutex);
+
+    for (size_t i=0; i<m_tiles.size(); ++i) {
+      m_filterMgr->copyToDestination(m_tiles[i].bounds, m_tiles[i].image);
+      dirtyArea.push_back(m_tiles[i].bounds);
+      delete m_tiles[i].image;
+    }
+    m_tiles.clear();
+    done = m_done;
+  }
+
+  for (size_t i=0; i<dirtyArea.size(); ++i)
+    m_filterMgr->flush(dirtyArea[i]);
+
+  if (done)
+    m_timer.stop();
+}
+
+void FilterPreview::clearTiles()
+{
+  base::scoped_lock hold(m_mutex);
+
+  for (size_t i=0; i<m_tiles.size(); ++i)
+    delete m_tiles[i].image;
+  m_tiles.clear();
+}
+
 } // namespace app
@@ -21,14 +21,33 @@
 #pragma once
 
 #include "base/compiler_specific.h"
+#include "base/mutex.h"
+#include "base/unique_ptr.h"
+#include "gfx/rect.h"
 #include "ui/timer.h"
 #include "ui/widget.h"
 
+#include <vector>
+
+namespace base {
+  class thread;
+}
+
+namespace raster {
+  class Image;
+}
+
 namespace app {
 
   class FilterManagerImpl;
 
   // Invisible widget to control a effect-preview in the current editor.
+  //
+  // The preview is calculated in a background thread, by tiles from
+  // the center of the visible area to the borders, first with a low
+  // resolution pass and then with the full resolution one. The thread
+  // filters a private buffer, and the timer copies the tiles that are
+  // ready to the preview image and updates the editor.
   class FilterPreview : public ui::Widget {
   public:
     FilterPreview(FilterManagerImpl* filterMgr);
@@ -38,12 +57,39 @@ namespace app {
     void restartPreview();
     FilterManagerImpl* getFilterManager() const;
 
+    // Stops the background thread. It must be called before
+    // modifying the filter parameters (then call restartPreview()).
+    void pause();
+
   protected:
     bool onProcessMessage(ui::Message* msg) OVERRIDE;
 
   private:
+    // A filtered tile waiting to be shown in the editor.
+    struct Tile {
+      gfx::Rect bounds;
+      raster::Image* image;
+
+      Tile(const gfx::Rect& bounds, raster::Image* image)
+        : bounds(bounds), image(image) { }
+    };
+
+    static void thread_proxy(FilterPreview* preview) {
+      preview->applyFilterInBackground();
+    }
+
+    void applyFilterInBackground();
+    bool isCancelled();
+    void flushDirtyArea();
+    void clearTiles();
+
     FilterManagerImpl* m_filterMgr;
     ui::Timer m_timer;
+    base::UniquePtr<base::thread> m_thread;
+    base::mutex m_mutex;          // Mutex to access m_tiles, m_done and m_cancelled fields
+    std::vector<Tile> m_tiles;    // Tiles already filtered but not shown yet
+    bool m_done;
+    bool m_cancelled;
   };
 
 } // namespace app
@@ -131,8 +131,14 @@ void FilterWindow::restartPreview()
     m_preview.restartPreview();
 }
 
+void FilterWindow::stopPreview()
+{
+  m_preview.pause();
+}
+
 void FilterWindow::setNewTarget(Target target)
 {
+  stopPreview();
   m_filterMgr->setTarget(target);
   m_targetButton.setTarget(target);
 }
@@ -156,6 +162,7 @@ void FilterWindow::onShowPreview(Event& ev)
 void FilterWindow::onTargetButtonChange()
 {
   // Change the targets in the filter manager and restart the filter preview.
+  stopPreview();
   m_filterMgr->setTarget(m_targetButton.getTarget());
   restartPreview();
 }
@@ -166,6 +173,7 @@ void FilterWindow::onTiledChange()
 
   // Call derived class implementation of setupTiledMode() so the
   // filter is modified.
+  stopPreview();
   setupTiledMode(m_tiledCheck->isSelected() ? TILED_BOTH: TILED_NONE);
 
   // Restart the preview.
@@ -56,6 +56,11 @@ namespace app {
     void restartPreview();
 
   protected:
+    // Stops the background preview. You must call this method before
+    // modifying parameters of the Filter (the preview thread could be
+    // using them).
+    void stopPreview();
+
     // Changes the target buttons. Used by convolution matrix filter
     // which specified different targets for each matrix.
     void setNewTarget(Target target);
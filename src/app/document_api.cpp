@@ -57,6 +57,9 @@
 #include "app/undoers/set_sprite_size.h"
 #include "app/undoers/set_stock_pixel_format.h"
 #include "app/undoers/set_total_frames.h"
+#include "base/mutex.h"
+#include "base/scoped_lock.h"
+#include "base/thread.h"
 #include "base/unique_ptr.h"
 #include "raster/algorithm/flip_image.h"
 #include "raster/algorithm/shrink_bounds.h"
@@ -74,6 +77,93 @@
 
 namespace app {
 
+namespace {
+
+// Converts a set of images to other pixel format using several
+// threads (each thread takes the next image to be converted).
+class ImagesConversion {
+public:
+  ImagesConversion(const std::vector<Image*>& images,
+                   PixelFormat newFormat,
+                   DitheringMethod ditheringMethod,
+                   const RgbMap* rgbmap,
+                   const Palette* palette,
+                   bool hasBackgroundLayer)
+    : m_images(images)
+    , m_newImages(images.size(), (Image*)NULL)
+    , m_newFormat(newFormat)
+    , m_ditheringMethod(ditheringMethod)
+    , m_rgbmap(rgbmap)
+    , m_palette(palette)
+    , m_hasBackgroundLayer(hasBackgroundLayer)
+    , m_nextImage(0) {
+  }
+
+  // Returns the converted images (NULL for NULL images).
+  const std::vector<Image*>& newImages() const {
+    return m_newImages;
+  }
+
+  void run() {
+    int nthreads = MID(1, base::thread::hardware_concurrency(), (int)m_images.size());
+
+    // Error diffusion uses all threads to convert each image.
+    if (m_ditheringMethod != DITHERING_NONE &&
+        m_ditheringMethod != DITHERING_ORDERED)
+      nthreads = 1;
+
+    std::vector<base::thread*> threads;
+    for (int i=1; i<nthreads; ++i)
+      threads.push_back(new base::thread(&ImagesConversion::thread_proxy, this));
+
+    convertImages();
+
+    for (size_t i=0; i<threads.size(); ++i) {
+      threads[i]->join();
+      delete threads[i];
+    }
+  }
+
+private:
+  static void thread_proxy(ImagesConversion* self) {
+    self->convertImages();
+  }
+
+  void convertImages() {
+    int i;
+
+    while (getNextImage(i)) {
+      if (m_images[i])
+        m_newImages[i] = quantization::convert_pixel_format
+          (m_images[i], m_newFormat, m_ditheringMethod,
+           m_rgbmap, m_palette, m_hasBackgroundLayer);
+    }
+  }
+
+  bool getNextImage(int& i) {
+    base::scoped_lock hold(m_mutex);
+
+    if (m_nextImage < (int)m_images.size()) {
+      i = m_nextImage++;
+      return true;
+    }
+    else
+      return false;
+  }
+
+  const std::vector<Image*>& m_images;
+  std::vector<Image*> m_newImages;
+  PixelFormat m_newFormat;
+  DitheringMethod m_ditheringMethod;
+  const RgbMap* m_rgbmap;
+  const Palette* m_palette;
+  bool m_hasBackgroundLayer;
+  int m_nextImage;
+  base::mutex m_mutex;
+};
+
+} // anonymous namespace
+
 DocumentApi::DocumentApi(Document* document, undo::UndoersCollector* undoers)
   : m_document(document)
   , m_undoers(undoers)
@@ -141,10 +231,6 @@ void DocumentApi::trimSprite(Sprite* sprite, color_t bgcolor)
 
 void DocumentApi::setPixelFormat(Sprite* sprite, PixelFormat newFormat, DitheringMethod dithering_method)
 {
-  Image* old_image;
-  Image* new_image;
-  int c;
-
   if (sprite->getPixelFormat() == newFormat)
     return;
 
@@ -157,20 +243,26 @@ void DocumentApi::setPixelFormat(Sprite* sprite, PixelFormat newFormat, Ditherin
   // TODO Review this, why we use the palette in frame 0?
   FrameNumber frame(0);
 
-  // Use the rgbmap for the specified sprite
+  // Use the rgbmap for the specified sprite (it's regenerated here,
+  // before the threads use it).
   const RgbMap* rgbmap = sprite->getRgbMap(frame);
 
-  for (c=0; c<sprite->getStock()->size(); c++) {
-    old_image = sprite->getStock()->getImage(c);
-    if (!old_image)
-      continue;
-
-    new_image = quantization::convert_pixel_format
-      (old_image, newFormat, dithering_method, rgbmap,
-       sprite->getPalette(frame),
-       sprite->getBackgroundLayer() != NULL);
-
-    replaceStockImage(sprite, c, new_image);
+  // Convert all images in parallel, then replace them in the stock
+  // (and add the undoers) from this thread.
+  Stock* stock = sprite->getStock();
+  std::vector<Image*> old_images(stock->size());
+  for (int c=0; c<stock->size(); c++)
+    old_images[c] = stock->getImage(c);
+
+  ImagesConversion conversion(old_images, newFormat, dithering_method, rgbmap,
+                              sprite->getPalette(frame),
+                              sprite->getBackgroundLayer() != NULL);
+  conversion.run();
+
+  for (int c=0; c<stock->size(); c++) {
+    Image* new_image = conversion.newImages()[c];
+    if (new_image)
+      replaceStockImage(sprite, c, new_image);
   }
 
   // Change sprite's pixel format.
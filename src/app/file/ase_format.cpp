@@ -24,13 +24,24 @@
 #include "app/file/file.h"
 #include "app/file/file_format.h"
 #include "app/file/format_options.h"
+#include "app/ini_file.h"
 #include "base/cfile.h"
 #include "base/exception.h"
 #include "base/file_handle.h"
+#include "base/fs.h"
+#include "base/mutex.h"
+#include "base/scoped_lock.h"
+#include "base/thread.h"
+#include "base/unique_ptr.h"
 #include "raster/raster.h"
 #include "zlib.h"
 
+#include <algorithm>
+#include <map>
 #include <stdio.h>
+#include <string.h>
+#include <utility>
+#include <vector>
 
 #define ASE_FILE_MAGIC                  0xA5E0
 #define ASE_FILE_FRAME_MAGIC            0xF1FA
@@ -80,6 +91,253 @@ static ASE_FrameHeader *current_frame_header = NULL;
 static int chunk_type;
 static int chunk_start;
 
+// Decompresses the images of compressed cels using several threads.
+// The compressed data of each cel is read from the file in the
+// loader's thread, and the decompression is delayed until flush() is
+// called (or there are too many bytes waiting to be decompressed).
+// The progress of the FileOp includes the decompression, and it can
+// be stopped meanwhile the cels are decompressed.
+class CompressedCelsDecoder {
+public:
+  CompressedCelsDecoder(FileOp* fop, size_t fileSize);
+  ~CompressedCelsDecoder();
+
+  // Reports the progress of the loader until the given position of
+  // the file (cels waiting to be decompressed are not counted).
+  void progress(size_t pos);
+
+  // Reads the compressed data of the image from the current position
+  // of the file to "chunk_end".
+  void addImage(FILE* f, Image* image, size_t chunk_end);
+
+  // Copies the "src" image to "dst" when the "src" image is
+  // completely decompressed.
+  void addCopy(const Image* src, Image* dst);
+
+  void flush();
+
+private:
+  struct Job {
+    Image* image;
+    std::vector<uint8_t> data;
+    std::string error;
+    size_t size;                // Size of the compressed data
+    bool done;
+
+    Job(Image* image) : image(image), size(0), done(false) { }
+  };
+
+  static void thread_proxy(CompressedCelsDecoder* self);
+  void decodeJobs(bool reportProgress);
+  Job* getNextJob(Job* finishedJob);
+  void clearJobs();
+
+  FileOp* m_fop;
+  size_t m_fileSize;
+  size_t m_readPos;             // Position of the file read until now
+  std::vector<Job*> m_jobs;
+  std::vector<std::pair<const Image*, Image*> > m_copies;
+  size_t m_pendingBytes;
+  size_t m_nextJob;
+  size_t m_decodedBytes;        // Compressed bytes already decoded in flush()
+  bool m_stop;                  // True if the FileOp was stopped
+  base::mutex m_mutex;
+};
+
+class CompressedCelsLoader;
+
+// Compresses the images of the cels to be saved using several
+// threads. Cels are compressed in batches, in the same order they
+// are written in the file, and the file is written only from the
+// saver's thread. If a "source" loader is given, the original
+// compressed pixels of unmodified images are copied from its file
+// instead of being compressed again. Cels with the same pixels of a
+// previous cel in the same layer are saved as linked cels.
+class CompressedCelsEncoder {
+public:
+  CompressedCelsEncoder(Sprite* sprite, int level, CompressedCelsLoader* source);
+
+  // Returns true if the cel must be saved as a link to a previous
+  // cel (its pixels aren't saved again).
+  bool isLinkedCel(const Cel* cel) const;
+
+  // Writes the frame of the cel linked by the given one.
+  void writeLink(FILE* f, const Cel* cel);
+
+  // Writes the size and the compressed pixels of the cel's image in
+  // the file. Cels must be written in the same order as
+  // ase_file_write_cels() does.
+  void writeImage(FILE* f, const Cel* cel);
+
+  // Loads lazy images that weren't saved in the file (e.g. images
+  // that aren't used by cels). It must be called before the original
+  // file of these images is replaced.
+  void loadUnsavedImages();
+
+  // Replaces the file of the loader with the saved one ("newFile"
+  // is moved to "filename" if it's a temporary file), and makes the
+  // loader to load images from it.
+  void replaceLoaderFile(CompressedCelsLoader* loader,
+                         const std::string& newFile, const std::string& filename);
+
+  // Returns true if some cel uses an image that couldn't be loaded
+  // (see CompressedCelsLoader::isImageLost()).
+  bool hasLostImages(const CompressedCelsLoader* loader) const;
+
+private:
+  struct Job {
+    const Cel* cel;
+    const Image* image;         // NULL if the pixels are copied and the image isn't loaded
+    int w, h;
+    bool copy;                  // True if the pixels are copied from the source file
+    int link;                   // Job of the linked cel (-1 if the cel isn't linked)
+    size_t srcOffset;
+    size_t srcSize;
+    std::vector<uint8_t> data;
+    std::string error;
+    size_t offset;              // Where the data was written in the file
+    size_t size;
+
+    Job(const Cel* cel)
+      : cel(cel), image(NULL), w(0), h(0), copy(false), link(-1)
+      , srcOffset(0), srcSize(0), offset(0), size(0) { }
+  };
+
+  // Jobs already added for the cels of a layer, to find the cel that
+  // a new one can be linked with.
+  struct LayerJobs {
+    std::map<int, int> byIndex;             // Stock index of the image
+    std::map<size_t, int> byOffset;         // Offset of the pixels in the source file
+    std::multimap<uint64_t, int> byHash;    // Hash of loaded images
+  };
+
+  Job& getNextCel(const Cel* cel);
+  void copyData(FILE* f, const Job& job);
+
+  void addCels(Layer* layer, FrameNumber frame, std::map<Layer*, LayerJobs>& layers);
+  int findLinkedJob(LayerJobs& jobs, const Job& job, int index);
+  void compressBatch(size_t first);
+  static void thread_proxy(CompressedCelsEncoder* self);
+  void compressJobs();
+  Job* getNextJob();
+
+  Sprite* m_sprite;
+  int m_level;
+  CompressedCelsLoader* m_source;
+  FileHandle m_sourceFile;
+  std::vector<Job> m_jobs;
+  size_t m_nextCel;             // Next cel to be written
+  size_t m_nextJob;             // Next cel to be compressed in the current batch
+  size_t m_lastJob;             // End of the current batch
+  base::mutex m_mutex;
+
+  DISABLE_COPYING(CompressedCelsEncoder);
+};
+
+// Remembers where the compressed pixels of each image are in the
+// .ase file. It's used to load images when they are used for the
+// first time (the file is opened again each time an image must be
+// loaded), and to save unmodified images without compressing them
+// again. Images are loaded from the threads that use them while the
+// sprite is saved in other thread, so the file and the entries are
+// protected by a mutex (which is never locked while the Stock is
+// used, as the Stock locks its own mutex to load images).
+class CompressedCelsLoader : public StockImageLoader {
+public:
+  struct Entry {
+    int w, h;
+    size_t offset;              // Position of the compressed pixels in the file
+    size_t size;                // Size of the compressed pixels
+    uint64_t hash;              // Hash of the pixels (when the image is loaded)
+    bool valid;                 // False if the file doesn't contain the pixels
+    bool failed;                // True if the pixels couldn't be loaded
+
+    Entry() : w(0), h(0), offset(0), size(0), hash(0), valid(false), failed(false) { }
+  };
+
+  CompressedCelsLoader(const std::string& filename, PixelFormat pixelFormat);
+
+  std::string getFilename() const;
+
+  // Returns true if the given path is the file of the loader (the
+  // path can be spelled in a different way, or be a hard link).
+  bool isFile(const std::string& filename) const;
+
+  // Returns true if the file wasn't modified since it was loaded (or
+  // saved), so the compressed pixels are in the same location.
+  bool isFileUnmodified() const;
+
+  // Loaded images cannot be released until the file is replaced (the
+  // images that aren't in the new file must be kept in memory).
+  void keepLoadedImages();
+
+  // Replaces the file of the loader with "newFile" (which is moved
+  // to "filename" if they are different), where the images are
+  // located as the given "entries" say (indexed by the stock
+  // position). The entries are
+  // swapped with the current ones. It's done with the mutex locked,
+  // so images cannot be read from a file that doesn't match the
+  // entries.
+  void replaceFile(const std::string& newFile, const std::string& filename,
+                   PixelFormat pixelFormat, std::vector<Entry>& entries);
+
+  size_t getEntryCount() const;
+  Entry getEntry(int index) const;
+
+  // Adds a lazy image in the stock for the compressed pixels located
+  // in the given "offset" of the file.
+  int addImage(Stock* stock, int w, int h, size_t offset, size_t size);
+
+  // Remembers where the pixels of an image (which is decompressed
+  // when the file is loaded) are located.
+  void setImageLocation(int index, int w, int h, size_t offset, size_t size);
+
+  // Calculates the hash of loaded images that have a location in
+  // the file.
+  void hashLoadedImages(const Stock* stock);
+
+  // Returns true if the file contains the current pixels of the
+  // image in the "index" position of the stock: the image wasn't
+  // loaded yet, or its pixels are exactly the ones in the file.
+  bool isImageInFile(const Stock* stock, int index) const;
+
+  // Returns true if the image in the "index" position of the stock
+  // is the empty image created because its pixels couldn't be
+  // loaded.
+  bool isImageLost(const Stock* stock, int index) const;
+
+  // Adds a lazy image in the stock with the same compressed pixels
+  // of the lazy image in the "index" position.
+  int addCopy(Stock* stock, int index);
+
+  // StockImageLoader implementation. If the pixels cannot be read
+  // (e.g. the file was moved or modified), an empty image is returned
+  // and the error is kept to be reported to the user (see
+  // Stock::popLoadError()), as the stock is used from code that
+  // doesn't expect exceptions.
+  Image* loadImage(int index) OVERRIDE;
+  bool isImageUnmodified(int index, const Image* image) OVERRIDE;
+  std::string popLoadError() OVERRIDE;
+
+private:
+  struct File {
+    std::string name;
+    base::FileStatus status;    // Status of the file when it was loaded (or saved)
+    PixelFormat pixelFormat;
+    int version;                // Incremented each time the file is changed
+  };
+
+  File getFile() const;
+  static Image* readImage(const Entry& entry, const File& file);
+  static bool isSameImage(const Image* image, const Entry& entry, const File& file);
+
+  mutable base::mutex m_mutex;
+  File m_file;
+  std::vector<Entry> m_entries; // Indexed by the stock position
+  std::string m_loadError;
+  bool m_keepLoaded;            // True if images cannot be released
+};
+
 static bool ase_file_read_header(FILE* f, ASE_Header* header);
 static void ase_file_prepare_header(FILE* f, ASE_Header* header, const Sprite* sprite);
 static void ase_file_write_header(FILE* f, ASE_Header* header);
@@ -89,7 +347,7 @@ static void ase_file_prepare_frame_header(FILE *f, ASE_FrameHeader *frame_header
 static void ase_file_write_frame_header(FILE *f, ASE_FrameHeader *frame_header);
 
 static void ase_file_write_layers(FILE *f, Layer *layer);
-static void ase_file_write_cels(FILE *f, Sprite *sprite, Layer *layer, FrameNumber frame);
+static void ase_file_write_cels(FILE *f, Sprite *sprite, Layer *layer, FrameNumber frame, CompressedCelsEncoder* encoder);
 
 static void ase_file_read_padding(FILE *f, int bytes);
 static void ase_file_write_padding(FILE *f, int bytes);
@@ -104,8 +362,8 @@ static Palette *ase_file_read_color2_chunk(FILE *f, Sprite *sprite, FrameNumber
 static void ase_file_write_color2_chunk(FILE *f, Palette *pal);
 static Layer *ase_file_read_layer_chunk(FILE *f, Sprite *sprite, Layer **previous_layer, int *current_level);
 static void ase_file_write_layer_chunk(FILE *f, Layer *layer);
-static Cel *ase_file_read_cel_chunk(FILE *f, Sprite *sprite, FrameNumber frame, PixelFormat pixelFormat, FileOp *fop, ASE_Header *header, size_t chunk_end);
-static void ase_file_write_cel_chunk(FILE *f, Cel *cel, LayerImage *layer, Sprite *sprite);
+static Cel *ase_file_read_cel_chunk(FILE *f, Sprite *sprite, FrameNumber frame, PixelFormat pixelFormat, FileOp *fop, ASE_Header *header, size_t chunk_end, CompressedCelsDecoder* decoder, CompressedCelsLoader* loader, bool lazy);
+static void ase_file_write_cel_chunk(FILE *f, Cel *cel, LayerImage *layer, Sprite *sprite, CompressedCelsEncoder* encoder);
 static Mask *ase_file_read_mask_chunk(FILE *f);
 static void ase_file_write_mask_chunk(FILE *f, Mask *mask);
 
@@ -167,11 +425,25 @@ bool AseFormat::onLoad(FileOp *fop)
   Layer* last_layer = sprite->getFolder();
   int current_level = -1;
 
+  // Compressed cels are decompressed in parallel
+  CompressedCelsDecoder decoder(fop, header.size);
+
+  // The loader remembers where the pixels of each cel are, so they
+  // can be decompressed when they are used for the first time, and
+  // unmodified cels can be saved without compressing them again.
+  CompressedCelsLoader* loader = NULL;
+  bool lazy = false;
+  if (!fop->oneframe) {
+    loader = new CompressedCelsLoader(fop->filename, sprite->getPixelFormat());
+    sprite->getStock()->setImageLoader(loader);
+    lazy = get_config_bool("ASE", "LazyLoading", false);
+  }
+
   /* read frame by frame to end-of-file */
   for (FrameNumber frame(0); frame<sprite->getTotalFrames(); ++frame) {
     /* start frame position */
     int frame_pos = ftell(f);
-    fop_progress(fop, (float)frame_pos / (float)header.size);
+    decoder.progress(frame_pos);
 
     /* read frame header */
     ASE_FrameHeader frame_header;
@@ -187,7 +459,7 @@ bool AseFormat::onLoad(FileOp *fop)
       for (int c=0; c<frame_header.chunks; c++) {
         /* start chunk position */
         int chunk_pos = ftell(f);
-        fop_progress(fop, (float)chunk_pos / (float)header.size);
+        decoder.progress(chunk_pos);
 
         // Read chunk information
         int chunk_size = fgetl(f);
@@ -231,7 +503,7 @@ bool AseFormat::onLoad(FileOp *fop)
 
             ase_file_read_cel_chunk(f, sprite, frame,
                                     sprite->getPixelFormat(), fop, &header,
-                                    chunk_pos+chunk_size);
+                                    chunk_pos+chunk_size, &decoder, loader, lazy);
             break;
           }
 
@@ -274,6 +546,11 @@ bool AseFormat::onLoad(FileOp *fop)
       break;
   }
 
+  decoder.flush();
+
+  if (loader)
+    loader->hashLoadedImages(sprite->getStock());
+
   fop->document = new Document(sprite);
 
   if (ferror(f)) {
@@ -292,52 +569,119 @@ bool AseFormat::onSave(FileOp *fop)
   ASE_Header header;
   ASE_FrameHeader frame_header;
 
-  FileHandle f(open_file_with_exception(fop->filename, "wb"));
+  // Unmodified cels are copied from the file where the sprite was
+  // loaded (or last saved) instead of being compressed again.
+  CompressedCelsLoader* loader =
+    dynamic_cast<CompressedCelsLoader*>(sprite->getStock()->getImageLoader());
+  CompressedCelsLoader* source =
+    (loader && get_config_bool("ASE", "IncrementalSave", true) &&
+     loader->isFileUnmodified() ? loader: NULL);
+
+  // Cels are compressed in parallel with the configured level
+  int level = get_config_int("ASE", "CompressionLevel", Z_DEFAULT_COMPRESSION);
+  CompressedCelsEncoder encoder(sprite, MID(Z_DEFAULT_COMPRESSION, level, Z_BEST_COMPRESSION), source);
+
+  // Cels that couldn't be loaded are never saved as empty images
+  if (loader && encoder.hasLostImages(loader)) {
+    fop_error(fop, "Some cels couldn't be loaded from '%s', the sprite was not saved.\n",
+              loader->getFilename().c_str());
+    return false;
+  }
 
-  /* prepare the header */
-  ase_file_prepare_header(f, &header, sprite);
+  // If the file of the loader is overwritten while it's still needed
+  // (to copy the original pixels, or to load images that weren't
+  // loaded yet), the sprite is saved in a temporary file which then
+  // replaces the original one. The temporary file is created next to
+  // the real file (not to a symbolic link to it), and it gets the
+  // permissions of the original file.
+  bool replaceLoaderFile = (loader && loader->isFile(fop->filename));
+  bool useTempFile = false;
+  std::string target = fop->filename;
+  std::string filename = fop->filename;
+
+  if (replaceLoaderFile) {
+    // The file is going to be overwritten, so loaded images cannot be
+    // released (and loaded again) from now on.
+    loader->keepLoadedImages();
+
+    if (source || sprite->getStock()->hasUnloadedImages()) {
+      target = base::get_canonical_path(fop->filename);
+      filename = base::create_unique_file(target);
+      useTempFile = true;
+    }
+  }
 
-  /* write frame */
-  for (FrameNumber frame(0); frame<sprite->getTotalFrames(); ++frame) {
+  FileHandle f(open_file_with_exception(filename, "wb"));
+  bool error;
+  try {
     /* prepare the header */
-    ase_file_prepare_frame_header(f, &frame_header);
+    ase_file_prepare_header(f, &header, sprite);
+
+    /* write frame */
+    for (FrameNumber frame(0); frame<sprite->getTotalFrames(); ++frame) {
+      /* prepare the header */
+      ase_file_prepare_frame_header(f, &frame_header);
+
+      /* frame duration */
+      frame_header.duration = sprite->getFrameDuration(frame);
+
+      /* the sprite is indexed and the palette changes? (or is the first frame) */
+      if (sprite->getPixelFormat() == IMAGE_INDEXED &&
+          (frame == 0 ||
+           sprite->getPalette(frame.previous())->countDiff(sprite->getPalette(frame), NULL, NULL) > 0)) {
+        /* write the color chunk */
+        ase_file_write_color2_chunk(f, sprite->getPalette(frame));
+      }
 
-    /* frame duration */
-    frame_header.duration = sprite->getFrameDuration(frame);
+      /* write extra chunks in the first frame */
+      if (frame == 0) {
+        LayerIterator it = sprite->getFolder()->getLayerBegin();
+        LayerIterator end = sprite->getFolder()->getLayerEnd();
 
-    /* the sprite is indexed and the palette changes? (or is the first frame) */
-    if (sprite->getPixelFormat() == IMAGE_INDEXED &&
-        (frame == 0 ||
-         sprite->getPalette(frame.previous())->countDiff(sprite->getPalette(frame), NULL, NULL) > 0)) {
-      /* write the color chunk */
-      ase_file_write_color2_chunk(f, sprite->getPalette(frame));
-    }
+        /* write layer chunks */
+        for (; it != end; ++it)
+          ase_file_write_layers(f, *it);
+      }
 
-    /* write extra chunks in the first frame */
-    if (frame == 0) {
-      LayerIterator it = sprite->getFolder()->getLayerBegin();
-      LayerIterator end = sprite->getFolder()->getLayerEnd();
+      /* write cel chunks */
+      ase_file_write_cels(f, sprite, sprite->getFolder(), frame, &encoder);
 
-      /* write layer chunks */
-      for (; it != end; ++it)
-        ase_file_write_layers(f, *it);
+      /* write the frame header */
+      ase_file_write_frame_header(f, &frame_header);
+
+      /* progress */
+      if (sprite->getTotalFrames() > 1)
+        fop_progress(fop, (float)(frame.next()) / (float)(sprite->getTotalFrames()));
     }
 
-    /* write cel chunks */
-    ase_file_write_cels(f, sprite, sprite->getFolder(), frame);
+    /* write the header */
+    ase_file_write_header(f, &header);
 
-    /* write the frame header */
-    ase_file_write_frame_header(f, &frame_header);
+    error = (ferror(f) != 0);
+    f.reset();
 
-    /* progress */
-    if (sprite->getTotalFrames() > 1)
-      fop_progress(fop, (float)(frame.next()) / (float)(sprite->getTotalFrames()));
-  }
+    if (useTempFile && error) {
+      base::delete_file(filename);
+    }
+    else if (replaceLoaderFile && !error) {
+      if (useTempFile) {
+        base::copy_file_permissions(target, filename);
+        encoder.loadUnsavedImages();
+      }
 
-  /* write the header */
-  ase_file_write_header(f, &header);
+      // Images are loaded from the new file from now on
+      encoder.replaceLoaderFile(loader, filename, target);
+    }
+  }
+  catch (...) {
+    // The temporary file is not needed anymore
+    f.reset();
+    if (useTempFile && base::is_file(filename))
+      base::delete_file(filename);
+    throw;
+  }
 
-  if (ferror(f)) {
+  if (error) {
     fop_error(fop, "Error writing file.\n");
     return false;
   }
@@ -482,7 +826,7 @@ static void ase_file_write_layers(FILE *f, Layer *layer)
   }
 }
 
-static void ase_file_write_cels(FILE *f, Sprite *sprite, Layer *layer, FrameNumber frame)
+static void ase_file_write_cels(FILE *f, Sprite *sprite, Layer *layer, FrameNumber frame, CompressedCelsEncoder* encoder)
 {
   if (layer->isImage()) {
     Cel* cel = static_cast<LayerImage*>(layer)->getCel(frame);
@@ -490,7 +834,7 @@ static void ase_file_write_cels(FILE *f, Sprite *sprite, Layer *layer, FrameNumb
 /*       fop_error(fop, "New cel in frame %d, in layer %d\n", */
 /*                   frame, sprite_layer2index(sprite, layer)); */
 
-      ase_file_write_cel_chunk(f, cel, static_cast<LayerImage*>(layer), sprite);
+      ase_file_write_cel_chunk(f, cel, static_cast<LayerImage*>(layer), sprite, encoder);
     }
   }
 
@@ -499,7 +843,7 @@ static void ase_file_write_cels(FILE *f, Sprite *sprite, Layer *layer, FrameNumb
     LayerIterator end = static_cast<LayerFolder*>(layer)->getLayerEnd();
 
     for (; it != end; ++it)
-      ase_file_write_cels(f, sprite, *it, frame);
+      ase_file_write_cels(f, sprite, *it, frame, encoder);
   }
 }
 
@@ -856,8 +1200,10 @@ static void write_raw_image(FILE* f, Image* image)
 // Compressed Image
 //////////////////////////////////////////////////////////////////////
 
+// Decompresses the zlib "data" of a compressed cel directly in the
+// rows of the given image.
 template<typename ImageTraits>
-static void read_compressed_image(FILE* f, Image* image, size_t chunk_end, FileOp* fop, ASE_Header* header)
+static void read_compressed_image(const std::vector<uint8_t>& data, Image* image)
 {
   PixelIO<ImageTraits> pixel_io;
   z_stream zstream;
@@ -872,67 +1218,215 @@ static void read_compressed_image(FILE* f, Image* image, size_t chunk_end, FileO
     throw base::Exception("ZLib error %d in inflateInit().", err);
 
   std::vector<uint8_t> scanline(ImageTraits::getRowStrideBytes(image->getWidth()));
-  std::vector<uint8_t> uncompressed(image->getHeight() * ImageTraits::getRowStrideBytes(image->getWidth()));
-  std::vector<uint8_t> compressed(4096);
-  int uncompressed_offset = 0;
+  bool stream_end = false;
 
-  while (true) {
-    size_t input_bytes;
+  zstream.next_in = (Bytef*)(data.empty() ? NULL: &data[0]);
+  zstream.avail_in = data.size();
 
-    if (ftell(f)+compressed.size() > chunk_end) {
-      input_bytes = chunk_end - ftell(f); // Remaining bytes
-      ASSERT(input_bytes < compressed.size());
+  for (y=0; y<image->getHeight(); y++) {
+    zstream.next_out = (Bytef*)&scanline[0];
+    zstream.avail_out = scanline.size();
 
-      if (input_bytes == 0)
-        break;                  // Done, we consumed all chunk
+    while (!stream_end && zstream.avail_out > 0) {
+      err = inflate(&zstream, Z_NO_FLUSH);
+      if (err == Z_STREAM_END || (err == Z_BUF_ERROR && zstream.avail_in == 0))
+        stream_end = true;
+      else if (err != Z_OK && err != Z_BUF_ERROR) {
+        inflateEnd(&zstream);
+        throw base::Exception("ZLib error %d in inflate().", err);
+      }
     }
-    else
-      input_bytes = compressed.size();
 
-    size_t bytes_read = fread(&compressed[0], 1, input_bytes, f);
-    zstream.next_in = (Bytef*)&compressed[0];
-    zstream.avail_in = bytes_read;
+    // Pixels that are not in the compressed data are zero.
+    std::fill(scanline.end()-zstream.avail_out, scanline.end(), 0);
 
-    do {
-      zstream.next_out = (Bytef*)&scanline[0];
-      zstream.avail_out = scanline.size();
+    typename ImageTraits::address_t address =
+      (typename ImageTraits::address_t)image->getPixelAddress(0, y);
 
-      err = inflate(&zstream, Z_NO_FLUSH);
-      if (err != Z_OK && err != Z_STREAM_END && err != Z_BUF_ERROR)
-        throw base::Exception("ZLib error %d in inflate().", err);
+    pixel_io.read_scanline(address, image->getWidth(), &scanline[0]);
+  }
 
-      size_t uncompressed_bytes = scanline.size() - zstream.avail_out;
-      if (uncompressed_bytes > 0) {
-        if (uncompressed_offset+uncompressed_bytes > uncompressed.size())
-          throw base::Exception("Bad compressed image.");
+  err = inflateEnd(&zstream);
+  if (err != Z_OK)
+    throw base::Exception("ZLib error %d in inflateEnd().", err);
+}
 
-        std::copy(scanline.begin(), scanline.begin()+uncompressed_bytes,
-                  uncompressed.begin()+uncompressed_offset);
+// Maximum number of compressed bytes to keep in memory.
+static const size_t kMaxPendingBytes = 64*1024*1024;
+
+CompressedCelsDecoder::CompressedCelsDecoder(FileOp* fop, size_t fileSize)
+  : m_fop(fop)
+  , m_fileSize(MAX(fileSize, size_t(1)))
+  , m_readPos(0)
+  , m_pendingBytes(0)
+  , m_nextJob(0)
+  , m_decodedBytes(0)
+  , m_stop(false)
+{
+}
 
-        uncompressed_offset += uncompressed_bytes;
-      }
-    } while (zstream.avail_out == 0);
+void CompressedCelsDecoder::progress(size_t pos)
+{
+  m_readPos = MAX(m_readPos, pos);
 
-    fop_progress(fop, (float)ftell(f) / (float)header->size);
+  // The progress stays in the position of the first cel that wasn't
+  // decompressed yet. It advances meanwhile the cels are
+  // decompressed in flush().
+  size_t decodedBytes;
+  {
+    base::scoped_lock hold(m_mutex);
+    decodedBytes = m_decodedBytes;
   }
+  size_t decodedPos = m_readPos - MIN(m_readPos, m_pendingBytes - MIN(m_pendingBytes, decodedBytes));
 
-  uncompressed_offset = 0;
-  for (y=0; y<image->getHeight(); y++) {
-    typename ImageTraits::address_t address =
-      (typename ImageTraits::address_t)image->getPixelAddress(0, y);
+  fop_progress(m_fop, (float)decodedPos / (float)m_fileSize);
+}
+
+CompressedCelsDecoder::~CompressedCelsDecoder()
+{
+  clearJobs();
+}
 
-    pixel_io.read_scanline(address, image->getWidth(), &uncompressed[uncompressed_offset]);
+void CompressedCelsDecoder::addImage(FILE* f, Image* image, size_t chunk_end)
+{
+  long pos = ftell(f);
+  size_t size = (pos >= 0 && (size_t)pos < chunk_end ? chunk_end - pos: 0);
+
+  Job* job = new Job(image);
+  m_jobs.push_back(job);
+
+  job->data.resize(size);
+  if (size > 0)
+    job->data.resize(fread(&job->data[0], 1, size, f));
+
+  job->size = job->data.size();
+  m_pendingBytes += job->size;
+  m_readPos = MAX(m_readPos, size_t(ftell(f)));
+
+  if (m_pendingBytes > kMaxPendingBytes)
+    flush();
+}
 
-    uncompressed_offset += ImageTraits::getRowStrideBytes(image->getWidth());
+void CompressedCelsDecoder::addCopy(const Image* src, Image* dst)
+{
+  m_copies.push_back(std::make_pair(src, dst));
+}
+
+void CompressedCelsDecoder::flush()
+{
+  int nthreads = MID(1, base::thread::hardware_concurrency(), (int)m_jobs.size());
+  std::vector<base::thread*> threads;
+
+  m_nextJob = 0;
+  m_decodedBytes = 0;
+  for (int i=1; i<nthreads; ++i)
+    threads.push_back(new base::thread(&CompressedCelsDecoder::thread_proxy, this));
+
+  // This thread reports the progress (and checks if the FileOp was
+  // stopped) meanwhile it decodes jobs too.
+  decodeJobs(true);
+
+  for (size_t i=0; i<threads.size(); ++i) {
+    threads[i]->join();
+    delete threads[i];
   }
 
-  err = inflateEnd(&zstream);
-  if (err != Z_OK)
-    throw base::Exception("ZLib error %d in inflateEnd().", err);
+  // Images that weren't decompressed because the FileOp was stopped
+  // are left empty.
+  for (size_t i=0; i<m_jobs.size(); ++i) {
+    if (!m_jobs[i]->done)
+      clear_image(m_jobs[i]->image, 0);
+  }
+
+  // Report errors in the same order as the cels in the file. In case
+  // of error we can show the problem, but continue loading more cels.
+  for (size_t i=0; i<m_jobs.size(); ++i) {
+    if (!m_jobs[i]->error.empty())
+      fop_error(m_fop, m_jobs[i]->error.c_str());
+  }
+
+  // Copies are done in the same order they were added, so a copy of a
+  // copy gets the final pixels.
+  for (size_t i=0; i<m_copies.size(); ++i)
+    copy_image(m_copies[i].second, m_copies[i].first, 0, 0);
+
+  clearJobs();
+  m_copies.clear();
+  m_pendingBytes = 0;
+  m_decodedBytes = 0;
+}
+
+void CompressedCelsDecoder::thread_proxy(CompressedCelsDecoder* self)
+{
+  self->decodeJobs(false);
+}
+
+void CompressedCelsDecoder::decodeJobs(bool reportProgress)
+{
+  Job* job = NULL;
+
+  while ((job = getNextJob(job)) != NULL) {
+    if (reportProgress) {
+      progress(m_readPos);
+
+      if (fop_is_stop(m_fop)) {
+        base::scoped_lock hold(m_mutex);
+        m_stop = true;
+      }
+    }
+
+    try {
+      switch (job->image->getPixelFormat()) {
+
+        case IMAGE_RGB:
+          read_compressed_image<RgbTraits>(job->data, job->image);
+          break;
+
+        case IMAGE_GRAYSCALE:
+          read_compressed_image<GrayscaleTraits>(job->data, job->image);
+          break;
+
+        case IMAGE_INDEXED:
+          read_compressed_image<IndexedTraits>(job->data, job->image);
+          break;
+      }
+    }
+    catch (const std::exception& e) {
+      job->error = e.what();
+    }
+
+    // Release the compressed data as soon as possible.
+    std::vector<uint8_t>().swap(job->data);
+  }
+}
+
+// Marks the given job as finished (if it's not NULL), and returns the
+// next job to be decoded.
+CompressedCelsDecoder::Job* CompressedCelsDecoder::getNextJob(Job* finishedJob)
+{
+  base::scoped_lock hold(m_mutex);
+
+  if (finishedJob) {
+    finishedJob->done = true;
+    m_decodedBytes += finishedJob->size;
+  }
+
+  if (!m_stop && m_nextJob < m_jobs.size())
+    return m_jobs[m_nextJob++];
+  else
+    return NULL;
+}
+
+void CompressedCelsDecoder::clearJobs()
+{
+  for (size_t i=0; i<m_jobs.size(); ++i)
+    delete m_jobs[i];
+  m_jobs.clear();
 }
 
+// Compresses the pixels of the image with zlib in "data".
 template<typename ImageTraits>
-static void write_compressed_image(FILE* f, Image* image)
+static void write_compressed_image(const Image* image, int level, std::vector<uint8_t>& data)
 {
   PixelIO<ImageTraits> pixel_io;
   z_stream zstream;
@@ -941,12 +1435,15 @@ static void write_compressed_image(FILE* f, Image* image)
   zstream.zalloc = (alloc_func)0;
   zstream.zfree  = (free_func)0;
   zstream.opaque = (voidpf)0;
-  err = deflateInit(&zstream, Z_DEFAULT_COMPRESSION);
+  err = deflateInit(&zstream, level);
   if (err != Z_OK)
     throw base::Exception("ZLib error %d in deflateInit().", err);
 
   std::vector<uint8_t> scanline(ImageTraits::getRowStrideBytes(image->getWidth()));
-  std::vector<uint8_t> compressed(4096);
+
+  data.resize(deflateBound(&zstream, scanline.size() * image->getHeight()));
+  zstream.next_out = (Bytef*)&data[0];
+  zstream.avail_out = data.size();
 
   for (y=0; y<image->getHeight(); y++) {
     typename ImageTraits::address_t address =
@@ -959,35 +1456,717 @@ static void write_compressed_image(FILE* f, Image* image)
     int flush = (y == image->getHeight()-1 ? Z_FINISH: Z_NO_FLUSH);
 
     do {
-      zstream.next_out = (Bytef*)&compressed[0];
-      zstream.avail_out = compressed.size();
+      // Grow the output buffer if it's needed
+      if (zstream.avail_out == 0) {
+        data.resize(data.size()*2);
+        zstream.next_out = (Bytef*)&data[zstream.total_out];
+        zstream.avail_out = data.size() - zstream.total_out;
+      }
 
       // Compress
       err = deflate(&zstream, flush);
-      if (err != Z_OK && err != Z_STREAM_END && err != Z_BUF_ERROR)
+      if (err != Z_OK && err != Z_STREAM_END && err != Z_BUF_ERROR) {
+        deflateEnd(&zstream);
         throw base::Exception("ZLib error %d in deflate().", err);
-
-      int output_bytes = compressed.size() - zstream.avail_out;
-      if (output_bytes > 0) {
-        if ((fwrite(&compressed[0], 1, output_bytes, f) != (size_t)output_bytes)
-            || ferror(f))
-          throw base::Exception("Error writing compressed image pixels.\n");
       }
-    } while (zstream.avail_out == 0);
+    } while (zstream.avail_in > 0 ||
+             zstream.avail_out == 0 ||
+             (flush == Z_FINISH && err != Z_STREAM_END));
   }
 
+  data.resize(zstream.total_out);
+
   err = deflateEnd(&zstream);
   if (err != Z_OK)
     throw base::Exception("ZLib error %d in deflateEnd().", err);
 }
 
+// Returns a hash of the pixels of the image (CRC-32 and Adler-32).
+static uint64_t image_hash(const Image* image)
+{
+  uLong crc = crc32(0L, Z_NULL, 0);
+  uLong adler = adler32(0L, Z_NULL, 0);
+
+  for (int y=0; y<image->getHeight(); ++y) {
+    const Bytef* row = (const Bytef*)image->getPixelAddress(0, y);
+    crc = crc32(crc, row, image->getRowStrideSize());
+    adler = adler32(adler, row, image->getRowStrideSize());
+  }
+
+  return (uint64_t(crc) << 32) | uint64_t(adler & 0xffffffff);
+}
+
+static bool is_same_image(const Image* a, const Image* b)
+{
+  if (a->getPixelFormat() != b->getPixelFormat() ||
+      a->getWidth() != b->getWidth() ||
+      a->getHeight() != b->getHeight())
+    return false;
+
+  for (int y=0; y<a->getHeight(); ++y)
+    if (memcmp(a->getPixelAddress(0, y),
+               b->getPixelAddress(0, y),
+               a->getRowStrideSize()) != 0)
+      return false;
+
+  return true;
+}
+
+// Maximum number of uncompressed bytes in each batch of cels.
+static const size_t kMaxBatchBytes = 64*1024*1024;
+
+CompressedCelsEncoder::CompressedCelsEncoder(Sprite* sprite, int level, CompressedCelsLoader* source)
+  : m_sprite(sprite)
+  , m_level(level)
+  , m_source(source)
+  , m_nextCel(0)
+  , m_nextJob(0)
+  , m_lastJob(0)
+{
+  std::map<Layer*, LayerJobs> layers;
+
+  for (FrameNumber frame(0); frame<sprite->getTotalFrames(); ++frame)
+    addCels(sprite->getFolder(), frame, layers);
+}
+
+bool CompressedCelsEncoder::isLinkedCel(const Cel* cel) const
+{
+  ASSERT(m_nextCel < m_jobs.size());
+  ASSERT(m_jobs[m_nextCel].cel == cel);
+
+  return (m_jobs[m_nextCel].link >= 0);
+}
+
+void CompressedCelsEncoder::writeLink(FILE* f, const Cel* cel)
+{
+  Job& job = getNextCel(cel);
+  const Job& linked = m_jobs[job.link];
+
+  // The pixels are in the same place of the linked cel
+  job.offset = linked.offset;
+  job.size = linked.size;
+
+  fputw(linked.cel->getFrame(), f);
+}
+
+void CompressedCelsEncoder::writeImage(FILE* f, const Cel* cel)
+{
+  Job& job = getNextCel(cel);
+  if (!job.error.empty())
+    throw base::Exception(job.error);
+
+  // Width and height
+  fputw(job.w, f);
+  fputw(job.h, f);
+
+  if (job.w == 0 || job.h == 0)
+    return;
+
+  job.offset = ftell(f);
+
+  if (job.copy) {
+    copyData(f, job);
+    job.size = job.srcSize;
+  }
+  else {
+    job.size = job.data.size();
+
+    if (!job.data.empty() &&
+        ((fwrite(&job.data[0], 1, job.data.size(), f) != job.data.size()) || ferror(f)))
+      throw base::Exception("Error writing compressed image pixels.\n");
+  }
+}
+
+// Returns the job of the next cel to be written, compressing a new
+// batch of cels if it's necessary.
+CompressedCelsEncoder::Job& CompressedCelsEncoder::getNextCel(const Cel* cel)
+{
+  // Release the data of the previous cel.
+  if (m_nextCel > 0)
+    std::vector<uint8_t>().swap(m_jobs[m_nextCel-1].data);
+
+  ASSERT(m_nextCel < m_jobs.size());
+  ASSERT(m_jobs[m_nextCel].cel == cel);
+
+  if (m_nextCel >= m_lastJob)
+    compressBatch(m_nextCel);
+
+  return m_jobs[m_nextCel++];
+}
+
+// Copies the original compressed pixels of the job's image from the
+// source file.
+void CompressedCelsEncoder::copyData(FILE* f, const Job& job)
+{
+  if (!m_sourceFile) {
+    m_sourceFile = open_file_with_exception(m_source->getFilename(), "rb");
+
+    // The pixels are in the same location only if the file wasn't
+    // modified after the encoder was created.
+    if (!m_source->isFileUnmodified())
+      throw base::Exception("'%s' was modified while the sprite was saved.\n", m_source->getFilename().c_str());
+  }
+
+  if (fseek(m_sourceFile, job.srcOffset, SEEK_SET) != 0)
+    throw base::Exception("Error reading cel pixels from '%s'.\n", m_source->getFilename().c_str());
+
+  std::vector<uint8_t> buffer(MIN(job.srcSize, size_t(1024*1024)));
+  size_t remaining = job.srcSize;
+
+  while (remaining > 0) {
+    size_t chunk = MIN(remaining, buffer.size());
+
+    if (fread(&buffer[0], 1, chunk, m_sourceFile) != chunk)
+      throw base::Exception("Error reading cel pixels from '%s'.\n", m_source->getFilename().c_str());
+
+    if (fwrite(&buffer[0], 1, chunk, f) != chunk || ferror(f))
+      throw base::Exception("Error writing compressed image pixels.\n");
+
+    remaining -= chunk;
+  }
+}
+
+void CompressedCelsEncoder::loadUnsavedImages()
+{
+  // The source file is closed so it can be replaced
+  m_sourceFile.reset();
+
+  Stock* stock = m_sprite->getStock();
+  std::vector<bool> saved(stock->size(), false);
+
+  for (size_t i=0; i<m_jobs.size(); ++i)
+    saved[m_jobs[i].cel->getImage()] = true;
+
+  for (int i=0; i<stock->size(); ++i)
+    if (!saved[i] && stock->isLazyImage(i))
+      stock->getImage(i);
+}
+
+void CompressedCelsEncoder::replaceLoaderFile(CompressedCelsLoader* loader,
+                                              const std::string& newFile, const std::string& filename)
+{
+  // The new entries are created here and then swapped with the old
+  // ones, so other threads can load images meanwhile.
+  std::vector<CompressedCelsLoader::Entry> entries(m_sprite->getStock()->size());
+
+  for (size_t i=0; i<m_jobs.size(); ++i) {
+    const Job& job = m_jobs[i];
+    if (job.w == 0 || job.h == 0)
+      continue;
+
+    int index = job.cel->getImage();
+    CompressedCelsLoader::Entry& entry = entries[index];
+    entry.w = job.w;
+    entry.h = job.h;
+    entry.offset = job.offset;
+    entry.size = job.size;
+    entry.valid = true;
+
+    // The hash of copied images is the same
+    if (job.copy)
+      entry.hash = m_source->getEntry(index).hash;
+    else if (job.image)
+      entry.hash = image_hash(job.image);
+  }
+
+  loader->replaceFile(newFile, filename, m_sprite->getPixelFormat(), entries);
+}
+
+bool CompressedCelsEncoder::hasLostImages(const CompressedCelsLoader* loader) const
+{
+  const Stock* stock = m_sprite->getStock();
+
+  for (size_t i=0; i<m_jobs.size(); ++i)
+    if (loader->isImageLost(stock, m_jobs[i].cel->getImage()))
+      return true;
+
+  return false;
+}
+
+void CompressedCelsEncoder::addCels(Layer* layer, FrameNumber frame, std::map<Layer*, LayerJobs>& layers)
+{
+  if (layer->isImage()) {
+    Cel* cel = static_cast<LayerImage*>(layer)->getCel(frame);
+    if (cel) {
+      Stock* stock = m_sprite->getStock();
+      int index = cel->getImage();
+      Job job(cel);
+
+      if (m_source && m_source->isImageInFile(stock, index)) {
+        // Copy the original pixels (without loading the image)
+        const CompressedCelsLoader::Entry& entry = m_source->getEntry(index);
+        job.copy = true;
+        job.w = entry.w;
+        job.h = entry.h;
+        job.srcOffset = entry.offset;
+        job.srcSize = entry.size;
+        if (stock->isImageLoaded(index))
+          job.image = stock->getImage(index);
+      }
+      else {
+        job.image = stock->getImage(index);
+        if (job.image) {
+          job.w = job.image->getWidth();
+          job.h = job.image->getHeight();
+        }
+      }
+
+      job.link = findLinkedJob(layers[layer], job, index);
+      m_jobs.push_back(job);
+    }
+  }
+
+  if (layer->isFolder()) {
+    LayerIterator it = static_cast<LayerFolder*>(layer)->getLayerBegin();
+    LayerIterator end = static_cast<LayerFolder*>(layer)->getLayerEnd();
+
+    for (; it != end; ++it)
+      addCels(*it, frame, layers);
+  }
+}
+
+// Returns the job of a previous cel in the same layer with the same
+// pixels of the given job (which is the next one to be added), or -1
+// if the job must save its own pixels.
+int CompressedCelsEncoder::findLinkedJob(LayerJobs& jobs, const Job& job, int index)
+{
+  if (job.w == 0 || job.h == 0)
+    return -1;
+
+  int jobIndex = (int)m_jobs.size();
+  int link = -1;
+  uint64_t hash = 0;
+
+  // A cel that uses the same image
+  std::map<int, int>::iterator it = jobs.byIndex.find(index);
+  if (it != jobs.byIndex.end())
+    link = it->second;
+
+  // An unloaded image with the same compressed pixels (e.g. a linked
+  // cel in the source file)
+  if (link < 0 && job.copy) {
+    std::map<size_t, int>::iterator it = jobs.byOffset.find(job.srcOffset);
+    if (it != jobs.byOffset.end())
+      link = it->second;
+  }
+
+  // A loaded image with the same pixels
+  if (link < 0 && job.image) {
+    // The hash of copied images was already checked by the source
+    hash = (job.copy ? m_source->getEntry(index).hash: image_hash(job.image));
+
+    std::pair<std::multimap<uint64_t, int>::iterator,
+              std::multimap<uint64_t, int>::iterator> range = jobs.byHash.equal_range(hash);
+
+    for (std::multimap<uint64_t, int>::iterator it=range.first; it!=range.second; ++it) {
+      if (is_same_image(job.image, m_jobs[it->second].image)) {
+        link = it->second;
+        break;
+      }
+    }
+  }
+
+  if (link >= 0) {
+    jobs.byIndex[index] = link;
+    return link;
+  }
+
+  jobs.byIndex[index] = jobIndex;
+  if (job.copy)
+    jobs.byOffset[job.srcOffset] = jobIndex;
+  if (job.image)
+    jobs.byHash.insert(std::make_pair(hash, jobIndex));
+  return -1;
+}
+
+// Compresses the cels from "first" until the batch is full.
+void CompressedCelsEncoder::compressBatch(size_t first)
+{
+  size_t bytes = 0;
+
+  m_nextJob = first;
+  m_lastJob = first;
+  while (m_lastJob < m_jobs.size() && (m_lastJob == first || bytes < kMaxBatchBytes)) {
+    const Job& job = m_jobs[m_lastJob++];
+    if (job.image && !job.copy && job.link < 0)
+      bytes += job.image->getRowStrideSize() * job.image->getHeight();
+  }
+
+  int nthreads = MID(1, base::thread::hardware_concurrency(), int(m_lastJob - first));
+  std::vector<base::thread*> threads;
+
+  for (int i=1; i<nthreads; ++i)
+    threads.push_back(new base::thread(&CompressedCelsEncoder::thread_proxy, this));
+
+  compressJobs();
+
+  for (size_t i=0; i<threads.size(); ++i) {
+    threads[i]->join();
+    delete threads[i];
+  }
+}
+
+void CompressedCelsEncoder::thread_proxy(CompressedCelsEncoder* self)
+{
+  self->compressJobs();
+}
+
+void CompressedCelsEncoder::compressJobs()
+{
+  Job* job;
+
+  while ((job = getNextJob()) != NULL) {
+    if (!job->image || job->copy || job->link >= 0)
+      continue;
+
+    try {
+      switch (job->image->getPixelFormat()) {
+
+        case IMAGE_RGB:
+          write_compressed_image<RgbTraits>(job->image, m_level, job->data);
+          break;
+
+        case IMAGE_GRAYSCALE:
+          write_compressed_image<GrayscaleTraits>(job->image, m_level, job->data);
+          break;
+
+        case IMAGE_INDEXED:
+          write_compressed_image<IndexedTraits>(job->image, m_level, job->data);
+          break;
+      }
+    }
+    catch (const std::exception& e) {
+      job->error = e.what();
+    }
+  }
+}
+
+CompressedCelsEncoder::Job* CompressedCelsEncoder::getNextJob()
+{
+  base::scoped_lock hold(m_mutex);
+
+  if (m_nextJob < m_lastJob)
+    return &m_jobs[m_nextJob++];
+  else
+    return NULL;
+}
+
+CompressedCelsLoader::CompressedCelsLoader(const std::string& filename, PixelFormat pixelFormat)
+  : m_keepLoaded(false)
+{
+  m_file.name = filename;
+  m_file.pixelFormat = pixelFormat;
+  m_file.version = 0;
+  base::get_file_status(filename, m_file.status);
+}
+
+std::string CompressedCelsLoader::getFilename() const
+{
+  base::scoped_lock hold(m_mutex);
+  return m_file.name;
+}
+
+bool CompressedCelsLoader::isFile(const std::string& filename) const
+{
+  File file = getFile();
+  base::FileStatus status;
+  if (!base::get_file_status(filename, status))
+    return (filename == file.name);
+
+  return status.isSameFile(file.status);
+}
+
+bool CompressedCelsLoader::isFileUnmodified() const
+{
+  File file = getFile();
+  base::FileStatus status;
+  return (base::get_file_status(file.name, status) &&
+          status.isSameVersion(file.status));
+}
+
+void CompressedCelsLoader::keepLoadedImages()
+{
+  base::scoped_lock hold(m_mutex);
+  m_keepLoaded = true;
+}
+
+void CompressedCelsLoader::replaceFile(const std::string& newFile, const std::string& filename,
+                                       PixelFormat pixelFormat, std::vector<Entry>& entries)
+{
+  base::scoped_lock hold(m_mutex);
+
+  if (newFile != filename)
+    base::move_file(newFile, filename);
+
+  base::FileStatus status;
+  base::get_file_status(filename, status);
+
+  m_file.name = filename;
+  m_file.status = status;
+  m_file.pixelFormat = pixelFormat;
+  ++m_file.version;
+  m_entries.swap(entries);
+  m_keepLoaded = false;
+}
+
+size_t CompressedCelsLoader::getEntryCount() const
+{
+  base::scoped_lock hold(m_mutex);
+  return m_entries.size();
+}
+
+CompressedCelsLoader::Entry CompressedCelsLoader::getEntry(int index) const
+{
+  base::scoped_lock hold(m_mutex);
+  ASSERT(index >= 0 && index < (int)m_entries.size());
+  return m_entries[index];
+}
+
+int CompressedCelsLoader::addImage(Stock* stock, int w, int h, size_t offset, size_t size)
+{
+  int index = stock->addLazyImage();
+  setImageLocation(index, w, h, offset, size);
+  return index;
+}
+
+void CompressedCelsLoader::setImageLocation(int index, int w, int h, size_t offset, size_t size)
+{
+  base::scoped_lock hold(m_mutex);
+
+  if (index >= (int)m_entries.size())
+    m_entries.resize(index+1);
+
+  Entry& entry = m_entries[index];
+  entry.w = w;
+  entry.h = h;
+  entry.offset = offset;
+  entry.size = size;
+  entry.valid = true;
+}
+
+void CompressedCelsLoader::hashLoadedImages(const Stock* stock)
+{
+  for (int i=0; i<(int)getEntryCount(); ++i) {
+    if (!stock->isImageLoaded(i))
+      continue;
+
+    uint64_t hash = image_hash(stock->getImage(i));
+
+    base::scoped_lock hold(m_mutex);
+    if (m_entries[i].valid)
+      m_entries[i].hash = hash;
+  }
+}
+
+bool CompressedCelsLoader::isImageInFile(const Stock* stock, int index) const
+{
+  if (index <= 0 || index >= stock->size())
+    return false;
+
+  bool loaded = stock->isImageLoaded(index);
+  if (!loaded && !stock->isLazyImage(index))
+    return false;
+
+  const Image* image = (loaded ? stock->getImage(index): NULL);
+
+  File file;
+  Entry entry;
+  {
+    base::scoped_lock hold(m_mutex);
+    if (index >= (int)m_entries.size() || !m_entries[index].valid)
+      return false;
+
+    if (!image)
+      return true;
+
+    file = m_file;
+    entry = m_entries[index];
+  }
+
+  if (!isSameImage(image, entry, file))
+    return false;
+
+  // The file could be changed while the pixels were compared
+  base::scoped_lock hold(m_mutex);
+  return (file.version == m_file.version);
+}
+
+bool CompressedCelsLoader::isImageLost(const Stock* stock, int index) const
+{
+  if (index <= 0 || !stock->isLazyImage(index))
+    return false;
+
+  base::scoped_lock hold(m_mutex);
+  return (index < (int)m_entries.size() && m_entries[index].failed);
+}
+
+int CompressedCelsLoader::addCopy(Stock* stock, int index)
+{
+  Entry entry = getEntry(index);
+  return addImage(stock, entry.w, entry.h, entry.offset, entry.size);
+}
+
+std::string CompressedCelsLoader::popLoadError()
+{
+  base::scoped_lock hold(m_mutex);
+  std::string error;
+  error.swap(m_loadError);
+  return error;
+}
+
+Image* CompressedCelsLoader::loadImage(int index)
+{
+  // The pixels are read without locking the mutex. If the file is
+  // changed meanwhile (the sprite was saved), they are read again
+  // from the new file.
+  for (;;) {
+    File file;
+    Entry entry;
+    {
+      base::scoped_lock hold(m_mutex);
+      ASSERT(index >= 0 && index < (int)m_entries.size());
+      file = m_file;
+      entry = m_entries[index];
+    }
+
+    Image* image = NULL;
+    std::string error;
+    try {
+      image = readImage(entry, file);
+    }
+    catch (const std::exception& e) {
+      error = e.what();
+    }
+
+    base::scoped_lock hold(m_mutex);
+    if (file.version != m_file.version) {
+      delete image;
+      continue;
+    }
+
+    Entry& current = m_entries[index];
+    if (!image) {
+      if (m_loadError.empty())
+        m_loadError = error;
+
+      // The empty image isn't in the file, so it will not be released,
+      // and the sprite cannot be saved while a cel uses it.
+      image = Image::create(file.pixelFormat, entry.w, entry.h);
+      clear_image(image, 0);
+      current.valid = false;
+      current.failed = true;
+    }
+    current.hash = image_hash(image);
+    return image;
+  }
+}
+
+bool CompressedCelsLoader::isImageUnmodified(int index, const Image* image)
+{
+  File file;
+  Entry entry;
+  {
+    base::scoped_lock hold(m_mutex);
+    ASSERT(index >= 0 && index < (int)m_entries.size());
+    if (m_keepLoaded)
+      return false;
+
+    file = m_file;
+    entry = m_entries[index];
+  }
+
+  if (!isSameImage(image, entry, file))
+    return false;
+
+  // The file could be changed while the pixels were compared
+  base::scoped_lock hold(m_mutex);
+  return (file.version == m_file.version && !m_keepLoaded);
+}
+
+// Returns true if the given image has exactly the pixels of the entry
+// in the file. The hash is compared first to avoid reading the file
+// when the image was modified.
+bool CompressedCelsLoader::isSameImage(const Image* image, const Entry& entry, const File& file)
+{
+  if (!entry.valid ||
+      image->getPixelFormat() != file.pixelFormat ||
+      image->getWidth() != entry.w ||
+      image->getHeight() != entry.h ||
+      image_hash(image) != entry.hash)
+    return false;
+
+  try {
+    base::UniquePtr<Image> original(readImage(entry, file));
+
+    for (int y=0; y<image->getHeight(); ++y)
+      if (memcmp(image->getPixelAddress(0, y),
+                 original->getPixelAddress(0, y),
+                 image->getRowStrideSize()) != 0)
+        return false;
+  }
+  catch (const std::exception&) {
+    return false;
+  }
+  return true;
+}
+
+CompressedCelsLoader::File CompressedCelsLoader::getFile() const
+{
+  base::scoped_lock hold(m_mutex);
+  return m_file;
+}
+
+Image* CompressedCelsLoader::readImage(const Entry& entry, const File& file)
+{
+  if (!entry.valid)
+    throw base::Exception("The pixels of the cel are not in '%s'.\n", file.name.c_str());
+
+  std::vector<uint8_t> data(entry.size);
+  FileHandle f(open_file_with_exception(file.name, "rb"));
+
+  // The pixels aren't in the same location if the file was modified
+  // (it's checked after opening the file, as it can be replaced when
+  // the sprite is saved)
+  base::FileStatus status;
+  if (!base::get_file_status(file.name, status) ||
+      !status.isSameVersion(file.status))
+    throw base::Exception("'%s' was modified or removed after it was loaded.\n", file.name.c_str());
+
+  if (entry.size > 0 &&
+      (fseek(f, entry.offset, SEEK_SET) != 0 ||
+       fread(&data[0], 1, data.size(), f) != data.size()))
+    throw base::Exception("Error reading cel pixels from '%s'.\n", file.name.c_str());
+
+  base::UniquePtr<Image> image(Image::create(file.pixelFormat, entry.w, entry.h));
+
+  switch (file.pixelFormat) {
+
+    case IMAGE_RGB:
+      read_compressed_image<RgbTraits>(data, image);
+      break;
+
+    case IMAGE_GRAYSCALE:
+      read_compressed_image<GrayscaleTraits>(data, image);
+      break;
+
+    case IMAGE_INDEXED:
+      read_compressed_image<IndexedTraits>(data, image);
+      break;
+  }
+
+  return image.release();
+}
+
 //////////////////////////////////////////////////////////////////////
 // Cel Chunk
 //////////////////////////////////////////////////////////////////////
 
 static Cel *ase_file_read_cel_chunk(FILE *f, Sprite *sprite, FrameNumber frame,
                                     PixelFormat pixelFormat,
-                                    FileOp *fop, ASE_Header *header, size_t chunk_end)
+                                    FileOp *fop, ASE_Header *header, size_t chunk_end,
+                                    CompressedCelsDecoder* decoder,
+                                    CompressedCelsLoader* loader,
+                                    bool lazy)
 {
   /* read chunk data */
   LayerIndex layer_index = LayerIndex(fgetw(f));
@@ -1052,10 +2231,27 @@ static Cel *ase_file_read_cel_chunk(FILE *f, Sprite *sprite, FrameNumber frame,
       FrameNumber link_frame = FrameNumber(fgetw(f));
       Cel* link = static_cast<LayerImage*>(layer)->getCel(link_frame);
 
-      if (link) {
-        // Create a copy of the linked cel (avoid using links cel)
-        Image* image = Image::createCopy(sprite->getStock()->getImage(link->getImage()));
+      if (link && lazy && sprite->getStock()->isLazyImage(link->getImage())) {
+        // The copy is loaded from the same compressed pixels.
+        cel->setImage(loader->addCopy(sprite->getStock(), link->getImage()));
+      }
+      else if (link) {
+        // Create a copy of the linked cel (avoid using links cel: cels
+        // are edited in-place, so they cannot share the same image).
+        // The linked image could be still compressed, so its pixels
+        // are copied by the decoder.
+        const Image* link_image = sprite->getStock()->getImage(link->getImage());
+        Image* image = Image::create(link_image->getPixelFormat(),
+                                     link_image->getWidth(),
+                                     link_image->getHeight());
+        decoder->addCopy(link_image, image);
         cel->setImage(sprite->getStock()->addImage(image));
+
+        if (loader && link->getImage() < (int)loader->getEntryCount()) {
+          const CompressedCelsLoader::Entry& entry = loader->getEntry(link->getImage());
+          if (entry.valid)
+            loader->setImageLocation(cel->getImage(), entry.w, entry.h, entry.offset, entry.size);
+        }
       }
       else {
         // Linked cel doesn't found
@@ -1070,32 +2266,24 @@ static Cel *ase_file_read_cel_chunk(FILE *f, Sprite *sprite, FrameNumber frame,
       int h = fgetw(f);
 
       if (w > 0 && h > 0) {
-        Image* image = Image::create(pixelFormat, w, h);
-
-        // Try to read pixel data
-        try {
-          switch (image->getPixelFormat()) {
+        long pos = ftell(f);
+        size_t size = (pos >= 0 && (size_t)pos < chunk_end ? chunk_end - pos: 0);
 
-            case IMAGE_RGB:
-              read_compressed_image<RgbTraits>(f, image, chunk_end, fop, header);
-              break;
+        if (lazy) {
+          // Just remember where the compressed pixels are, they are
+          // decompressed when the image is used.
+          cel->setImage(loader->addImage(sprite->getStock(), w, h, pos, size));
+        }
+        else {
+          Image* image = Image::create(pixelFormat, w, h);
 
-            case IMAGE_GRAYSCALE:
-              read_compressed_image<GrayscaleTraits>(f, image, chunk_end, fop, header);
-              break;
+          // Read the compressed pixel data (it's decompressed later).
+          decoder->addImage(f, image, chunk_end);
 
-            case IMAGE_INDEXED:
-              read_compressed_image<IndexedTraits>(f, image, chunk_end, fop, header);
-              break;
-          }
-        }
-        // OK, in case of error we can show the problem, but continue
-        // loading more cels.
-        catch (const std::exception& e) {
-          fop_error(fop, e.what());
+          cel->setImage(sprite->getStock()->addImage(image));
+          if (loader)
+            loader->setImageLocation(cel->getImage(), w, h, pos, size);
         }
-
-        cel->setImage(sprite->getStock()->addImage(image));
       }
       break;
     }
@@ -1107,10 +2295,11 @@ static Cel *ase_file_read_cel_chunk(FILE *f, Sprite *sprite, FrameNumber frame,
   return newCel;
 }
 
-static void ase_file_write_cel_chunk(FILE *f, Cel *cel, LayerImage *layer, Sprite *sprite)
+static void ase_file_write_cel_chunk(FILE *f, Cel *cel, LayerImage *layer, Sprite *sprite, CompressedCelsEncoder* encoder)
 {
   int layer_index = sprite->layerToIndex(layer);
-  int cel_type = ASE_FILE_COMPRESSED_CEL;
+  int cel_type = (encoder->isLinkedCel(cel) ? ASE_FILE_LINK_CEL:
+                                              ASE_FILE_COMPRESSED_CEL);
 
   ase_file_write_start_chunk(f, ASE_FILE_CHUNK_CEL);
 
@@ -1157,41 +2346,13 @@ static void ase_file_write_cel_chunk(FILE *f, Cel *cel, LayerImage *layer, Sprit
 
     case ASE_FILE_LINK_CEL:
       // Linked cel to another frame
-      //fputw(link->frame, f);
-      fputw(0, f);
+      encoder->writeLink(f, cel);
       break;
 
-    case ASE_FILE_COMPRESSED_CEL: {
-      Image* image = sprite->getStock()->getImage(cel->getImage());
-
-      if (image) {
-        // Width and height
-        fputw(image->getWidth(), f);
-        fputw(image->getHeight(), f);
-
-        // Pixel data
-        switch (image->getPixelFormat()) {
-
-          case IMAGE_RGB:
-            write_compressed_image<RgbTraits>(f, image);
-            break;
-
-          case IMAGE_GRAYSCALE:
-            write_compressed_image<GrayscaleTraits>(f, image);
-            break;
-
-          case IMAGE_INDEXED:
-            write_compressed_image<IndexedTraits>(f, image);
-            break;
-        }
-      }
-      else {
-        // Width and height
-        fputw(0, f);
-        fputw(0, f);
-      }
+    case ASE_FILE_COMPRESSED_CEL:
+      // Width, height, and pixel data (compressed by the encoder)
+      encoder->writeImage(f, cel);
       break;
-    }
   }
 
   ase_file_write_close_chunk(f);
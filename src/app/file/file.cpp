@@ -48,6 +48,10 @@ namespace app {
 
 using namespace base;
 
+// Maximum number of pixels used to create the palette of a loaded
+// RGB file (bigger sprites are sampled).
+static const int kMaxPaletteSamples = 1024*1024;
+
 static FileOp* fop_new(FileOpType type);
 static void fop_prepare_for_sequence(FileOp* fop);
 
@@ -662,9 +666,15 @@ void fop_post_load(FileOp* fop)
     if (fop->document->getSprite()->getPixelFormat() == IMAGE_RGB &&
         fop->document->getSprite()->getPalettes().size() <= 1 &&
         fop->document->getSprite()->getPalette(FrameNumber(0))->isBlack()) {
+      // Lazy images of other frames are not loaded just to create
+      // the palette.
+      quantization::PaletteOptions options;
+      options.maxSamples = kMaxPaletteSamples;
+      options.allFrames = !fop->document->getSprite()->getStock()->hasUnloadedImages();
+
       SharedPtr<Palette> palette
         (quantization::create_palette_from_rgb(fop->document->getSprite(),
-                                               FrameNumber(0)));
+                                               FrameNumber(0), options));
 
       fop->document->getSprite()->resetPalettes();
       fop->document->getSprite()->setPalette(palette, false);
@@ -0,0 +1,129 @@
+/* Aseprite
+ * Copyright (C) 2001-2013  David Capello
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "app/images_unloader.h"
+
+#include "app/app.h"
+#include "app/console.h"
+#include "app/context.h"
+#include "app/document.h"
+#include "app/document_access.h"
+#include "app/document_undo.h"
+#include "app/documents.h"
+#include "app/ini_file.h"
+#include "app/ui/document_view.h"
+#include "app/ui/editor/editor.h"
+#include "app/ui/main_window.h"
+#include "app/ui/workspace.h"
+#include "raster/cel.h"
+#include "raster/sprite.h"
+#include "raster/stock.h"
+#include "undo/objects_container.h"
+
+#include <set>
+
+namespace app {
+
+ImagesUnloader::ImagesUnloader(Context* context)
+  : m_context(context)
+{
+  m_context->addObserver(this);
+}
+
+ImagesUnloader::~ImagesUnloader()
+{
+  m_context->removeObserver(this);
+}
+
+// Adds in "keep" the images that could be referenced by pointer
+// after the command: images used by the undo history and images in
+// the current frame of each editor.
+static void get_images_to_keep(Document* document, std::set<const Image*>& keep)
+{
+  Sprite* sprite = document->getSprite();
+  Stock* stock = sprite->getStock();
+  undo::ObjectsContainer* objects = document->getUndo()->getObjects();
+
+  for (int i=0; i<stock->size(); ++i) {
+    if (stock->isLazyImage(i) && stock->isImageLoaded(i)) {
+      Image* image = stock->getImage(i);
+      if (objects->hasObject(image))
+        keep.insert(image);
+    }
+  }
+
+  MainWindow* mainWindow = App::instance()->getMainWindow();
+  if (!mainWindow)
+    return;
+
+  CelList cels;
+  sprite->getCels(cels);
+
+  Workspace* workspace = mainWindow->getWorkspace();
+  for (Workspace::iterator it=workspace->begin(); it != workspace->end(); ++it) {
+    DocumentView* docView = dynamic_cast<DocumentView*>(*it);
+    if (!docView || docView->getDocument() != document)
+      continue;
+
+    FrameNumber frame = docView->getEditor()->getFrame();
+    for (CelIterator it2=cels.begin(); it2 != cels.end(); ++it2) {
+      Cel* cel = *it2;
+      if (cel->getFrame() == frame && stock->isImageLoaded(cel->getImage()))
+        keep.insert(stock->getImage(cel->getImage()));
+    }
+  }
+}
+
+void ImagesUnloader::onCommandAfterExecution(Context* context)
+{
+  size_t maxBytes = get_config_int("Options", "LazyImagesMemoryLimit", 256) * 1024 * 1024;
+  const Documents& documents = context->getDocuments();
+
+  for (Documents::const_iterator it=documents.begin(); it != documents.end(); ++it) {
+    Document* document = *it;
+    Stock* stock = document->getSprite()->getStock();
+    if (!stock->getImageLoader())
+      continue;
+
+    // The cels that couldn't be loaded are shown empty
+    std::string error = stock->popLoadError();
+    if (!error.empty()) {
+      Console console;
+      console.printf("Some cels of \"%s\" couldn't be loaded and are empty.\n%s",
+                     document->getFilename().c_str(), error.c_str());
+    }
+
+    try {
+      DocumentWriter writer(document);
+      std::set<const Image*> keep;
+
+      get_images_to_keep(document, keep);
+      stock->releaseLazyImages(maxBytes, keep);
+    }
+    catch (const LockedDocumentException&) {
+      // Other thread is using the document, its images cannot be
+      // released now.
+    }
+  }
+}
+
+} // namespace app
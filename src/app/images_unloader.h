@@ -0,0 +1,49 @@
+/* Aseprite
+ * Copyright (C) 2001-2013  David Capello
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef APP_IMAGES_UNLOADER_H_INCLUDED
+#define APP_IMAGES_UNLOADER_H_INCLUDED
+#pragma once
+
+#include "app/context_observer.h"
+#include "base/compiler_specific.h"
+#include "base/disable_copying.h"
+
+namespace app {
+
+  // Releases lazy images of documents (e.g. cels of .ase files that
+  // are loaded on demand) when they use too much memory. Images are
+  // released after each command, when no one is using them. Images
+  // that couldn't be loaded are reported to the user at the same
+  // time.
+  class ImagesUnloader : public ContextObserver {
+  public:
+    ImagesUnloader(Context* context);
+    ~ImagesUnloader();
+
+  private:
+    void onCommandAfterExecution(Context* context) OVERRIDE;
+
+    Context* m_context;
+
+    DISABLE_COPYING(ImagesUnloader);
+  };
+
+} // namespace app
+
+#endif
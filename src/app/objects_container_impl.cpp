@@ -89,4 +89,9 @@ void* ObjectsContainerImpl::getObject(ObjectId id)
   return it->second;
 }
 
+bool ObjectsContainerImpl::hasObject(void* object) const
+{
+  return (m_ptrToId.find(object) != m_ptrToId.end());
+}
+
 } // namespace app
@@ -37,6 +37,7 @@ namespace app {
     void insertObject(undo::ObjectId id, void* object);
     void removeObject(undo::ObjectId id);
     void* getObject(undo::ObjectId id);
+    bool hasObject(void* object) const;
 
   private:
     undo::ObjectId m_idCounter;
@@ -96,6 +96,7 @@ namespace app {
     virtual bool getPreviewFilled() = 0;
     virtual int getSprayWidth() = 0;
     virtual int getSpraySpeed() = 0;
+    virtual int getBlurRadius() = 0;
     virtual InkType getInkType() = 0;
     virtual FreehandAlgorithm getFreehandAlgorithm() = 0;
 
@@ -105,6 +106,7 @@ namespace app {
     virtual void setPreviewFilled(bool state) = 0;
     virtual void setSprayWidth(int width) = 0;
     virtual void setSpraySpeed(int speed) = 0;
+    virtual void setBlurRadius(int radius) = 0;
     virtual void setInkType(InkType inkType) = 0;
     virtual void setFreehandAlgorithm(FreehandAlgorithm algorithm) = 0;
 
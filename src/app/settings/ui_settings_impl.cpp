@@ -585,6 +585,7 @@ class UIToolSettingsImpl
   bool m_previewFilled;
   int m_spray_width;
   int m_spray_speed;
+  int m_blur_radius;
   InkType m_inkType;
   FreehandAlgorithm m_freehandAlgorithm;
 
@@ -603,6 +604,7 @@ public:
     m_previewFilled = get_config_bool(cfg_section.c_str(), "PreviewFilled", false);
     m_spray_width = 16;
     m_spray_speed = 32;
+    m_blur_radius = 1;
     m_inkType = (InkType)get_config_int(cfg_section.c_str(), "InkType", (int)kDefaultInk);
     m_freehandAlgorithm = kDefaultFreehandAlgorithm;
 
@@ -622,6 +624,12 @@ public:
       m_spray_speed = get_config_int(cfg_section.c_str(), "SpraySpeed", m_spray_speed);
     }
 
+    if (m_tool->getInk(0)->isBlur() ||
+        m_tool->getInk(1)->isBlur()) {
+      m_blur_radius = get_config_int(cfg_section.c_str(), "BlurRadius", m_blur_radius);
+      m_blur_radius = MID(1, m_blur_radius, 32);
+    }
+
     if (m_tool->getController(0)->isFreehand() ||
         m_tool->getController(1)->isFreehand()) {
       m_freehandAlgorithm = (FreehandAlgorithm)get_config_int(cfg_section.c_str(), "FreehandAlgorithm", (int)kDefaultFreehandAlgorithm);
@@ -648,6 +656,11 @@ public:
       set_config_int(cfg_section.c_str(), "SpraySpeed", m_spray_speed);
     }
 
+    if (m_tool->getInk(0)->isBlur() ||
+        m_tool->getInk(1)->isBlur()) {
+      set_config_int(cfg_section.c_str(), "BlurRadius", m_blur_radius);
+    }
+
     if (m_tool->getController(0)->isFreehand() ||
         m_tool->getController(1)->isFreehand()) {
       set_config_int(cfg_section.c_str(), "FreehandAlgorithm", m_freehandAlgorithm);
@@ -662,6 +675,7 @@ public:
   bool getPreviewFilled() OVERRIDE { return m_previewFilled; }
   int getSprayWidth() OVERRIDE { return m_spray_width; }
   int getSpraySpeed() OVERRIDE { return m_spray_speed; }
+  int getBlurRadius() OVERRIDE { return m_blur_radius; }
   InkType getInkType() OVERRIDE { return m_inkType; }
   FreehandAlgorithm getFreehandAlgorithm() OVERRIDE { return m_freehandAlgorithm; }
 
@@ -671,6 +685,7 @@ public:
   void setPreviewFilled(bool state) OVERRIDE { m_previewFilled = state; }
   void setSprayWidth(int width) OVERRIDE { m_spray_width = width; }
   void setSpraySpeed(int speed) OVERRIDE { m_spray_speed = speed; }
+  void setBlurRadius(int radius) OVERRIDE { m_blur_radius = radius; }
   void setInkType(InkType inkType) OVERRIDE { m_inkType = inkType; }
   void setFreehandAlgorithm(FreehandAlgorithm algorithm) OVERRIDE {
     m_freehandAlgorithm = algorithm;
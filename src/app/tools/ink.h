@@ -58,10 +58,19 @@ namespace app {
       // Returns true if this ink moves cels
       virtual bool isCelMovement() const { return false; }
 
+      // Returns true if this ink blurs the image (it uses the blur
+      // radius of the tool-loop)
+      virtual bool isBlur() const { return false; }
+
       // It is called when the tool-loop start (generally when the user
       // presses a mouse button over a sprite editor)
       virtual void prepareInk(ToolLoop* loop) { }
 
+      // It is called in each step of the tool-loop before the ink is
+      // used (the source image can change between steps, e.g. with
+      // TracePolicyOverlap)
+      virtual void prepareStep(ToolLoop* loop) { }
+
       // It is used in the final stage of the tool-loop, it is called twice
       // (first with state=true and then state=false)
       virtual void setFinalStep(ToolLoop* loop, bool state) { }
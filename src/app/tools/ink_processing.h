@@ -25,6 +25,9 @@
 #include "raster/rgbmap.h"
 #include "raster/sprite.h"
 
+#include <cstring>
+#include <vector>
+
 namespace app {
 namespace tools {
 
@@ -41,8 +44,6 @@ template<typename Derived>
 class InkProcessing {
 public:
   void operator()(int x1, int y, int x2, ToolLoop* loop) {
-    int x;
-
     // Use mask
     if (loop->useMask()) {
       Point maskOrigin(loop->getMaskOrigin());
@@ -57,24 +58,76 @@ public:
       if (x2 > maskOrigin.x+maskBounds.w-1)
         x2 = maskOrigin.x+maskBounds.w-1;
 
+      if (x1 > x2)
+        return;
+
       if (Image* bitmap = loop->getMask()->getBitmap()) {
-        static_cast<Derived*>(this)->initIterators(loop, x1, y);
+        processMaskedSpans(loop, bitmap, maskOrigin, x1, y, x2);
+        return;
+      }
+    }
+
+    static_cast<Derived*>(this)->processSpan(loop, x1, y, x2);
+  }
 
-        for (x=x1; x<=x2; ++x) {
-          if (bitmap->getPixel(x-maskOrigin.x, y-maskOrigin.y))
-            static_cast<Derived*>(this)->processPixel(x, y);
+  // Processes the whole [x1,x2] span of the "y" row. Inks can
+  // replace this function with a specialized row kernel, by default
+  // it processes pixel by pixel.
+  void processSpan(ToolLoop* loop, int x1, int y, int x2) {
+    Derived* derived = static_cast<Derived*>(this);
 
-          static_cast<Derived*>(this)->moveIterators();
+    derived->initIterators(loop, x1, y);
+    for (int x=x1; x<=x2; ++x) {
+      derived->processPixel(x, y);
+      derived->moveIterators();
+    }
+  }
+
+private:
+  // Calls processSpan() for each run of selected pixels in the mask
+  // bitmap. Bitmap words are checked 64 pixels at a time, so fully
+  // selected or fully unselected areas are skipped quickly.
+  void processMaskedSpans(ToolLoop* loop, const Image* bitmap,
+                          const Point& maskOrigin, int x1, int y, int x2) {
+    const uint8_t* bits = bitmap->getPixelAddress(0, y-maskOrigin.y);
+    int u = x1 - maskOrigin.x;
+    int uend = x2 - maskOrigin.x;
+    int begin = -1;               // Beginning of the current run
+
+    while (u <= uend) {
+      if ((u & 7) == 0 && u+63 <= uend) {
+        uint32_t word[2];
+        memcpy(word, bits + (u >> 3), 8);
+
+        if (word[0] == 0xffffffff && word[1] == 0xffffffff) {
+          if (begin < 0)
+            begin = u;
+          u += 64;
+          continue;
+        }
+        else if (word[0] == 0 && word[1] == 0) {
+          if (begin >= 0) {
+            static_cast<Derived*>(this)->processSpan(loop, begin+maskOrigin.x, y, u-1+maskOrigin.x);
+            begin = -1;
+          }
+          u += 64;
+          continue;
         }
-        return;
       }
-    }
 
-    static_cast<Derived*>(this)->initIterators(loop, x1, y);
-    for (x=x1; x<=x2; ++x) {
-      static_cast<Derived*>(this)->processPixel(x, y);
-      static_cast<Derived*>(this)->moveIterators();
+      if (bits[u >> 3] & (1 << (u & 7))) {
+        if (begin < 0)
+          begin = u;
+      }
+      else if (begin >= 0) {
+        static_cast<Derived*>(this)->processSpan(loop, begin+maskOrigin.x, y, u-1+maskOrigin.x);
+        begin = -1;
+      }
+      ++u;
     }
+
+    if (begin >= 0)
+      static_cast<Derived*>(this)->processSpan(loop, begin+maskOrigin.x, y, x2);
   }
 };
 
@@ -111,6 +164,24 @@ protected:
   typename ImageTraits::address_t m_dstAddress;
 };
 
+// Fills the [x1,x2] span of the "y" row with the given pixel value.
+// It is a plain loop without dependencies between pixels, so the
+// compiler can vectorize it.
+template<typename ImageTraits>
+inline void fill_span(Image* image, int x1, int y, int x2, color_t color) {
+  typename ImageTraits::address_t dst = (typename ImageTraits::address_t)image->getPixelAddress(x1, y);
+  typename ImageTraits::address_t end = dst + (x2 - x1 + 1);
+  typename ImageTraits::pixel_t pixel = (typename ImageTraits::pixel_t)color;
+
+  for (; dst != end; ++dst)
+    *dst = pixel;
+}
+
+template<>
+inline void fill_span<IndexedTraits>(Image* image, int x1, int y, int x2, color_t color) {
+  memset(image->getPixelAddress(x1, y), color, x2 - x1 + 1);
+}
+
 //////////////////////////////////////////////////////////////////////
 // Opaque Ink
 //////////////////////////////////////////////////////////////////////
@@ -126,6 +197,10 @@ public:
     *SimpleInkProcessing<OpaqueInkProcessing<ImageTraits>, ImageTraits>::m_dstAddress = m_color;
   }
 
+  void processSpan(ToolLoop* loop, int x1, int y, int x2) {
+    fill_span<ImageTraits>(loop->getDstImage(), x1, y, x2, m_color);
+  }
+
 private:
   color_t m_color;
 };
@@ -140,33 +215,39 @@ public:
   PutAlphaInkProcessing(ToolLoop* loop) {
     m_color = loop->getPrimaryColor();
     m_opacity = loop->getOpacity();
+    m_pixel = getPixel();
   }
 
   void processPixel(int x, int y) {
-    // Do nothing
+    *SimpleInkProcessing<PutAlphaInkProcessing<ImageTraits>, ImageTraits>::m_dstAddress = m_pixel;
+  }
+
+  // All pixels get the same value (the color with the opacity as alpha)
+  void processSpan(ToolLoop* loop, int x1, int y, int x2) {
+    fill_span<ImageTraits>(loop->getDstImage(), x1, y, x2, m_pixel);
   }
 
 private:
+  color_t getPixel() const {
+    return m_color;
+  }
+
   color_t m_color;
   int m_opacity;
+  color_t m_pixel;
 };
 
 template<>
-void PutAlphaInkProcessing<RgbTraits>::processPixel(int x, int y) {
-  *m_dstAddress = rgba(rgba_getr(m_color),
-                       rgba_getg(m_color),
-                       rgba_getb(m_color),
-                       m_opacity);
+color_t PutAlphaInkProcessing<RgbTraits>::getPixel() const {
+  return rgba(rgba_getr(m_color),
+              rgba_getg(m_color),
+              rgba_getb(m_color),
+              m_opacity);
 }
 
 template<>
-void PutAlphaInkProcessing<GrayscaleTraits>::processPixel(int x, int y) {
-  *m_dstAddress = graya(graya_getv(m_color), m_opacity);
-}
-
-template<>
-void PutAlphaInkProcessing<IndexedTraits>::processPixel(int x, int y) {
-  *m_dstAddress = m_color;
+color_t PutAlphaInkProcessing<GrayscaleTraits>::getPixel() const {
+  return graya(graya_getv(m_color), m_opacity);
 }
 
 //////////////////////////////////////////////////////////////////////
@@ -182,7 +263,11 @@ public:
   }
 
   void processPixel(int x, int y) {
-    // Do nothing
+    // Do nothing (it's specialized for each case)
+  }
+
+  void processSpan(ToolLoop* loop, int x1, int y, int x2) {
+    // Do nothing (it's specialized for each case)
   }
 
 private:
@@ -190,14 +275,73 @@ private:
   int m_opacity;
 };
 
+// Row kernel equivalent to rgba_blend_normal(src, m_color, m_opacity)
+// for each pixel, with all the front color calculations hoisted out
+// of the loop.
 template<>
-void TransparentInkProcessing<RgbTraits>::processPixel(int x, int y) {
-  *m_dstAddress = rgba_blend_normal(*m_srcAddress, m_color, m_opacity);
+void TransparentInkProcessing<RgbTraits>::processSpan(ToolLoop* loop, int x1, int y, int x2) {
+  initIterators(loop, x1, y);
+
+  RgbTraits::address_t src = m_srcAddress;
+  RgbTraits::address_t dst = m_dstAddress;
+  RgbTraits::address_t end = dst + (x2 - x1 + 1);
+  int t;
+  int F_r = rgba_getr(m_color);
+  int F_g = rgba_getg(m_color);
+  int F_b = rgba_getb(m_color);
+  int F_a = INT_MULT(rgba_geta(m_color), m_opacity, t);
+
+  // Result when the back color is transparent
+  RgbTraits::pixel_t over_transparent = (m_color & 0xffffff) | (F_a << rgba_a_shift);
+
+  for (; dst != end; ++src, ++dst) {
+    RgbTraits::pixel_t back = *src;
+    int B_a = rgba_geta(back);
+
+    if (B_a == 0) {
+      *dst = over_transparent;
+    }
+    else {
+      int B_r = rgba_getr(back);
+      int B_g = rgba_getg(back);
+      int B_b = rgba_getb(back);
+      int D_a = B_a + F_a - INT_MULT(B_a, F_a, t);
+
+      *dst = rgba(B_r + (F_r-B_r) * F_a / D_a,
+                  B_g + (F_g-B_g) * F_a / D_a,
+                  B_b + (F_b-B_b) * F_a / D_a, D_a);
+    }
+  }
 }
 
+// Row kernel equivalent to graya_blend_normal(src, m_color, m_opacity)
 template<>
-void TransparentInkProcessing<GrayscaleTraits>::processPixel(int x, int y) {
-  *m_dstAddress = graya_blend_normal(*m_srcAddress, m_color, m_opacity);
+void TransparentInkProcessing<GrayscaleTraits>::processSpan(ToolLoop* loop, int x1, int y, int x2) {
+  initIterators(loop, x1, y);
+
+  GrayscaleTraits::address_t src = m_srcAddress;
+  GrayscaleTraits::address_t dst = m_dstAddress;
+  GrayscaleTraits::address_t end = dst + (x2 - x1 + 1);
+  int t;
+  int F_g = graya_getv(m_color);
+  int F_a = INT_MULT(graya_geta(m_color), m_opacity, t);
+
+  GrayscaleTraits::pixel_t over_transparent = (m_color & 0xff) | (F_a << graya_a_shift);
+
+  for (; dst != end; ++src, ++dst) {
+    GrayscaleTraits::pixel_t back = *src;
+    int B_a = graya_geta(back);
+
+    if (B_a == 0) {
+      *dst = over_transparent;
+    }
+    else {
+      int B_g = graya_getv(back);
+      int D_a = B_a + F_a - INT_MULT(B_a, F_a, t);
+
+      *dst = graya(B_g + (F_g-B_g) * F_a / D_a, D_a);
+    }
+  }
 }
 
 template<>
@@ -228,10 +372,151 @@ private:
 // Blur Ink
 //////////////////////////////////////////////////////////////////////
 
+// Sums of the pixels of a column (or of the whole window) of the blur
+// ink ("r" is the value of grayscale pixels).
+struct BlurSums {
+  int count, r, g, b, a;
+
+  BlurSums() : count(0), r(0), g(0), b(0), a(0) { }
+
+  BlurSums& operator+=(const BlurSums& o) {
+    count += o.count; r += o.r; g += o.g; b += o.b; a += o.a;
+    return *this;
+  }
+
+  BlurSums& operator-=(const BlurSums& o) {
+    count -= o.count; r -= o.r; g -= o.g; b -= o.b; a -= o.a;
+    return *this;
+  }
+};
+
+// Sums of each column of the blur window, kept between spans of the
+// same tool-loop step. A column that was used in a near row is moved
+// to the new row adding/subtracting only the rows that enter/leave
+// the window. Columns go from x=-radius to x=width+radius-1.
+class BlurColumns {
+public:
+  BlurColumns() : m_radius(0) { }
+
+  // Forgets all sums (e.g. because the source image has changed).
+  void reset(int width, int radius) {
+    m_radius = radius;
+    m_sums.assign(width + 2*radius, BlurSums());
+    m_rows.assign(width + 2*radius, 0);
+    m_valid.assign(width + 2*radius, false);
+  }
+
+  int radius() const { return m_radius; }
+
+  BlurSums& sums(int x) { return m_sums[x+m_radius]; }
+  int& row(int x) { return m_rows[x+m_radius]; }
+  bool isValid(int x) const { return m_valid[x+m_radius]; }
+  void setValid(int x) { m_valid[x+m_radius] = true; }
+
+private:
+  int m_radius;
+  std::vector<BlurSums> m_sums;
+  std::vector<int> m_rows;      // Row where each column is centered
+  std::vector<bool> m_valid;
+};
+
+// Sliding window to blur a span of pixels. The window moves one pixel
+// at a time adding the entering column and subtracting the leaving
+// one, and columns are moved between rows in the same way (see
+// BlurColumns), so each pixel costs O(1) operations for any radius.
+//
+// AddPixel must have an operator()(BlurSums&, pixel_t) to add a pixel
+// to the given sums.
+template<typename ImageTraits, typename AddPixel>
+class BlurWindow {
+public:
+  BlurWindow(const Image* srcImage, TiledMode tiledMode,
+             BlurColumns* columns, const AddPixel& addPixel)
+    : m_srcImage(srcImage)
+    , m_tiledX((tiledMode & TILED_X_AXIS) ? true: false)
+    , m_tiledY((tiledMode & TILED_Y_AXIS) ? true: false)
+    , m_columns(columns)
+    , m_radius(columns->radius())
+    , m_addPixel(addPixel) {
+  }
+
+  int size() const { return 2*m_radius+1; }
+
+  // Prepares the columns to blur the [x1,x2] span of "y" row.
+  void prepareSpan(int x1, int y, int x2) {
+    for (int x=x1-m_radius; x<=x2+m_radius; ++x)
+      moveColumn(x, y);
+
+    // Initial window (all columns of the first pixel except the last one)
+    m_window = BlurSums();
+    for (int x=x1-m_radius; x<x1+m_radius; ++x)
+      m_window += m_columns->sums(x);
+
+    m_x = x1;
+  }
+
+  // Returns the sums of the window for the next pixel of the span.
+  const BlurSums& next() {
+    m_window += m_columns->sums(m_x+m_radius);
+    m_result = m_window;
+    m_window -= m_columns->sums(m_x-m_radius);
+    ++m_x;
+    return m_result;
+  }
+
+private:
+  typename ImageTraits::pixel_t getPixel(int u, int v) const {
+    v = get_neighboring_coord(v, m_srcImage->getHeight(), m_tiledY);
+    return reinterpret_cast<typename ImageTraits::const_address_t>
+      (m_srcImage->getPixelAddress(0, v))[u];
+  }
+
+  void subPixel(BlurSums& sums, int u, int v) const {
+    BlurSums pixel;
+    m_addPixel(pixel, getPixel(u, v));
+    sums -= pixel;
+  }
+
+  // Centers the "x" column in the "y" row.
+  void moveColumn(int x, int y) {
+    BlurSums& sums = m_columns->sums(x);
+    int& row = m_columns->row(x);
+    int u = get_neighboring_coord(x, m_srcImage->getWidth(), m_tiledX);
+
+    if (m_columns->isValid(x) && ABS(y-row) < size()) {
+      for (; row < y; ++row) {
+        subPixel(sums, u, row-m_radius);
+        m_addPixel(sums, getPixel(u, row+m_radius+1));
+      }
+      for (; row > y; --row) {
+        subPixel(sums, u, row+m_radius);
+        m_addPixel(sums, getPixel(u, row-m_radius-1));
+      }
+    }
+    else {
+      sums = BlurSums();
+      for (int v=y-m_radius; v<=y+m_radius; ++v)
+        m_addPixel(sums, getPixel(u, v));
+
+      row = y;
+      m_columns->setValid(x);
+    }
+  }
+
+  const Image* m_srcImage;
+  bool m_tiledX, m_tiledY;
+  BlurColumns* m_columns;
+  int m_radius;
+  AddPixel m_addPixel;
+  BlurSums m_window;
+  BlurSums m_result;
+  int m_x;
+};
+
 template<typename ImageTraits>
 class BlurInkProcessing : public DoubleInkProcessing<BlurInkProcessing<ImageTraits>, ImageTraits> {
 public:
-  BlurInkProcessing(ToolLoop* loop) {
+  BlurInkProcessing(ToolLoop* loop, BlurColumns* columns) {
   }
   void processPixel(int x, int y) {
     // Do nothing (it's specialized for each case)
@@ -241,21 +526,30 @@ public:
 template<>
 class BlurInkProcessing<RgbTraits> : public DoubleInkProcessing<BlurInkProcessing<RgbTraits>, RgbTraits> {
 public:
-  BlurInkProcessing(ToolLoop* loop) :
+  BlurInkProcessing(ToolLoop* loop, BlurColumns* columns) :
     m_opacity(loop->getOpacity()),
-    m_tiledMode(loop->getDocumentSettings()->getTiledMode()),
-    m_srcImage(loop->getSrcImage()) {
+    m_window(loop->getSrcImage(),
+             loop->getDocumentSettings()->getTiledMode(),
+             columns, AddPixel()) {
   }
 
-  void processPixel(int x, int y) {
-    m_area.reset();
-    get_neighboring_pixels<RgbTraits>(m_srcImage, x, y, 3, 3, 1, 1, m_tiledMode, m_area);
+  void processSpan(ToolLoop* loop, int x1, int y, int x2) {
+    initIterators(loop, x1, y);
+    m_window.prepareSpan(x1, y, x2);
 
+    for (int x=x1; x<=x2; ++x) {
+      m_area = m_window.next();
+      processPixel(x, y);
+      moveIterators();
+    }
+  }
+
+  void processPixel(int x, int y) {
     if (m_area.count > 0) {
       m_area.r /= m_area.count;
       m_area.g /= m_area.count;
       m_area.b /= m_area.count;
-      m_area.a /= 9;
+      m_area.a /= m_window.size() * m_window.size();
 
       RgbTraits::pixel_t c = *m_srcAddress;
       m_area.r = rgba_getr(c) + (m_area.r-rgba_getr(c)) * m_opacity / 255;
@@ -271,51 +565,55 @@ public:
   }
 
 private:
-  struct GetPixelsDelegate {
-    int count, r, g, b, a;
-
-    void reset() { count = r = g = b = a = 0; }
-
-    void operator()(RgbTraits::pixel_t color)
+  struct AddPixel {
+    void operator()(BlurSums& sums, RgbTraits::pixel_t color) const
     {
       if (rgba_geta(color) != 0) {
-        r += rgba_getr(color);
-        g += rgba_getg(color);
-        b += rgba_getb(color);
-        a += rgba_geta(color);
-        ++count;
+        sums.r += rgba_getr(color);
+        sums.g += rgba_getg(color);
+        sums.b += rgba_getb(color);
+        sums.a += rgba_geta(color);
+        ++sums.count;
       }
     }
   };
 
   int m_opacity;
-  TiledMode m_tiledMode;
-  const Image* m_srcImage;
-  GetPixelsDelegate m_area;
+  BlurWindow<RgbTraits, AddPixel> m_window;
+  BlurSums m_area;
 };
 
 template<>
 class BlurInkProcessing<GrayscaleTraits> : public DoubleInkProcessing<BlurInkProcessing<GrayscaleTraits>, GrayscaleTraits> {
 public:
-  BlurInkProcessing(ToolLoop* loop) :
+  BlurInkProcessing(ToolLoop* loop, BlurColumns* columns) :
     m_opacity(loop->getOpacity()),
-    m_tiledMode(loop->getDocumentSettings()->getTiledMode()),
-    m_srcImage(loop->getSrcImage()) {
+    m_window(loop->getSrcImage(),
+             loop->getDocumentSettings()->getTiledMode(),
+             columns, AddPixel()) {
   }
 
-  void processPixel(int x, int y) {
-    m_area.reset();
-    get_neighboring_pixels<GrayscaleTraits>(m_srcImage, x, y, 3, 3, 1, 1, m_tiledMode, m_area);
+  void processSpan(ToolLoop* loop, int x1, int y, int x2) {
+    initIterators(loop, x1, y);
+    m_window.prepareSpan(x1, y, x2);
 
+    for (int x=x1; x<=x2; ++x) {
+      m_area = m_window.next();
+      processPixel(x, y);
+      moveIterators();
+    }
+  }
+
+  void processPixel(int x, int y) {
     if (m_area.count > 0) {
-      m_area.v /= m_area.count;
-      m_area.a /= 9;
+      m_area.r /= m_area.count;
+      m_area.a /= m_window.size() * m_window.size();
 
       GrayscaleTraits::pixel_t c = *m_srcAddress;
-      m_area.v = graya_getv(c) + (m_area.v-graya_getv(c)) * m_opacity / 255;
+      m_area.r = graya_getv(c) + (m_area.r-graya_getv(c)) * m_opacity / 255;
       m_area.a = graya_geta(c) + (m_area.a-graya_geta(c)) * m_opacity / 255;
 
-      *m_dstAddress = graya(m_area.v, m_area.a);
+      *m_dstAddress = graya(m_area.r, m_area.a);
     }
     else {
       *m_dstAddress = *m_srcAddress;
@@ -323,44 +621,47 @@ public:
   }
 
 private:
-  struct GetPixelsDelegate {
-    int count, v, a;
-
-    void reset() { count = v = a = 0; }
-
-    void operator()(GrayscaleTraits::pixel_t color)
+  struct AddPixel {
+    void operator()(BlurSums& sums, GrayscaleTraits::pixel_t color) const
     {
       if (graya_geta(color) > 0) {
-        v += graya_getv(color);
-        a += graya_geta(color);
-        ++count;
+        sums.r += graya_getv(color);
+        sums.a += graya_geta(color);
+        ++sums.count;
       }
     }
   };
 
   int m_opacity;
-  TiledMode m_tiledMode;
-  const Image* m_srcImage;
-  GetPixelsDelegate m_area;
+  BlurWindow<GrayscaleTraits, AddPixel> m_window;
+  BlurSums m_area;
 };
 
 template<>
 class BlurInkProcessing<IndexedTraits> : public DoubleInkProcessing<BlurInkProcessing<IndexedTraits>, IndexedTraits> {
 public:
-  BlurInkProcessing(ToolLoop* loop) :
+  BlurInkProcessing(ToolLoop* loop, BlurColumns* columns) :
     m_palette(get_current_palette()),
     m_rgbmap(loop->getRgbMap()),
-    m_area(get_current_palette()),
     m_opacity(loop->getOpacity()),
-    m_tiledMode(loop->getDocumentSettings()->getTiledMode()),
-    m_srcImage(loop->getSrcImage()) {
+    m_window(loop->getSrcImage(),
+             loop->getDocumentSettings()->getTiledMode(),
+             columns, AddPixel(get_current_palette())) {
   }
 
-  void processPixel(int x, int y) {
-    m_area.reset();
-    get_neighboring_pixels<IndexedTraits>(m_srcImage, x, y, 3, 3, 1, 1, m_tiledMode, m_area);
+  void processSpan(ToolLoop* loop, int x1, int y, int x2) {
+    initIterators(loop, x1, y);
+    m_window.prepareSpan(x1, y, x2);
 
-    if (m_area.count > 0 && m_area.a/9 >= 128) {
+    for (int x=x1; x<=x2; ++x) {
+      m_area = m_window.next();
+      processPixel(x, y);
+      moveIterators();
+    }
+  }
+
+  void processPixel(int x, int y) {
+    if (m_area.count > 0 && m_area.a/(m_window.size() * m_window.size()) >= 128) {
       m_area.r /= m_area.count;
       m_area.g /= m_area.count;
       m_area.b /= m_area.count;
@@ -378,32 +679,28 @@ public:
   }
 
 private:
-  struct GetPixelsDelegate {
+  struct AddPixel {
     const Palette* pal;
-    int count, r, g, b, a;
 
-    GetPixelsDelegate(const Palette* pal) : pal(pal) { }
+    AddPixel(const Palette* pal) : pal(pal) { }
 
-    void reset() { count = r = g = b = a = 0; }
-
-    void operator()(IndexedTraits::pixel_t color)
+    void operator()(BlurSums& sums, IndexedTraits::pixel_t color) const
     {
-      a += (color == 0 ? 0: 255);
+      sums.a += (color == 0 ? 0: 255);
 
       uint32_t color32 = pal->getEntry(color);
-      r += rgba_getr(color32);
-      g += rgba_getg(color32);
-      b += rgba_getb(color32);
-      count++;
+      sums.r += rgba_getr(color32);
+      sums.g += rgba_getg(color32);
+      sums.b += rgba_getb(color32);
+      sums.count++;
     }
   };
 
   const Palette* m_palette;
   const RgbMap* m_rgbmap;
   int m_opacity;
-  TiledMode m_tiledMode;
-  const Image* m_srcImage;
-  GetPixelsDelegate m_area;
+  BlurWindow<IndexedTraits, AddPixel> m_window;
+  BlurSums m_area;
 };
 
 //////////////////////////////////////////////////////////////////////
@@ -417,28 +714,49 @@ public:
     m_color1 = loop->getPrimaryColor();
     m_color2 = loop->getSecondaryColor();
     m_opacity = loop->getOpacity();
+    m_replacement = getReplacement();
   }
 
   void processPixel(int x, int y) {
-    // Do nothing (it's specialized for each case)
+    if (*this->m_srcAddress == m_color1)
+      *this->m_dstAddress = m_replacement;
+  }
+
+  // Only pixels equal to m_color1 are modified, and all of them get
+  // the same result, so the row is processed with a branch-free
+  // select that the compiler can vectorize.
+  void processSpan(ToolLoop* loop, int x1, int y, int x2) {
+    this->initIterators(loop, x1, y);
+
+    typename ImageTraits::address_t src = this->m_srcAddress;
+    typename ImageTraits::address_t dst = this->m_dstAddress;
+    typename ImageTraits::address_t end = dst + (x2 - x1 + 1);
+    typename ImageTraits::pixel_t color1 = (typename ImageTraits::pixel_t)m_color1;
+    typename ImageTraits::pixel_t replacement = (typename ImageTraits::pixel_t)m_replacement;
+
+    for (; dst != end; ++src, ++dst)
+      *dst = (*src == color1 ? replacement: *dst);
   }
 
 private:
+  color_t getReplacement() const {
+    return m_color2;
+  }
+
   color_t m_color1;
   color_t m_color2;
   int m_opacity;
+  color_t m_replacement;
 };
 
 template<>
-void ReplaceInkProcessing<RgbTraits>::processPixel(int x, int y) {
-  if (*m_srcAddress == m_color1)
-    *m_dstAddress = rgba_blend_normal(*m_srcAddress, m_color2, m_opacity);
+color_t ReplaceInkProcessing<RgbTraits>::getReplacement() const {
+  return rgba_blend_normal(m_color1, m_color2, m_opacity);
 }
 
 template<>
-void ReplaceInkProcessing<GrayscaleTraits>::processPixel(int x, int y) {
-  if (*m_srcAddress == m_color1)
-    *m_dstAddress = graya_blend_normal(*m_srcAddress, m_color2, m_opacity);
+color_t ReplaceInkProcessing<GrayscaleTraits>::getReplacement() const {
+  return graya_blend_normal(m_color1, m_color2, m_opacity);
 }
 
 template<>
@@ -610,7 +928,6 @@ enum {
   INK_OPAQUE,
   INK_PUTALPHA,
   INK_TRANSPARENT,
-  INK_BLUR,
   INK_REPLACE,
   INK_JUMBLE,
   INK_SHADING,
@@ -635,12 +952,28 @@ AlgoHLine ink_processing[][3] =
   DEFINE_INK(OpaqueInkProcessing),
   DEFINE_INK(PutAlphaInkProcessing),
   DEFINE_INK(TransparentInkProcessing),
-  DEFINE_INK(BlurInkProcessing),
   DEFINE_INK(ReplaceInkProcessing),
   DEFINE_INK(JumbleInkProcessing),
   DEFINE_INK(ShadingInkProcessing)
 };
 
+// The blur ink needs the column sums kept by BlurInk
+typedef void (*BlurHLine)(int x1, int y, int x2, ToolLoop* loop, BlurColumns* columns);
+
+template<typename ImageTraits>
+void blur_ink_processing_algo(int x1, int y, int x2, ToolLoop* loop, BlurColumns* columns)
+{
+  BlurInkProcessing<ImageTraits> ink(loop, columns);
+  ink(x1, y, x2, loop);
+}
+
+BlurHLine blur_ink_processing[3] =
+{
+  blur_ink_processing_algo<RgbTraits>,
+  blur_ink_processing_algo<GrayscaleTraits>,
+  blur_ink_processing_algo<IndexedTraits>
+};
+
 } // anonymous namespace
 } // namespace tools
 } // namespace app
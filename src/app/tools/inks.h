@@ -218,20 +218,28 @@ public:
 
 
 class BlurInk : public Ink {
-  AlgoHLine m_proc;
+  BlurHLine m_proc;
+  BlurColumns m_columns;
 
 public:
   bool isPaint() const { return true; }
   bool isEffect() const { return true; }
+  bool isBlur() const { return true; }
 
   void prepareInk(ToolLoop* loop)
   {
-    m_proc = ink_processing[INK_BLUR][MID(0, loop->getSprite()->getPixelFormat(), 2)];
+    m_proc = blur_ink_processing[MID(0, loop->getSprite()->getPixelFormat(), 2)];
+  }
+
+  void prepareStep(ToolLoop* loop)
+  {
+    // The source image can be different in each step
+    m_columns.reset(loop->getSrcImage()->getWidth(), loop->getBlurRadius());
   }
 
   void inkHline(int x1, int y, int x2, ToolLoop* loop)
   {
-    (*m_proc)(x1, y, x2, loop);
+    (*m_proc)(x1, y, x2, loop, &m_columns);
   }
 };
 
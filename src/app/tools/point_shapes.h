@@ -79,7 +79,8 @@ public:
   }
   void getModifiedArea(ToolLoop* loop, int x, int y, Rect& area)
   {
-    area = Rect(0, 0, 9999, 9999);
+    // The fill can reach any pixel of the canvas
+    area = loop->getSrcImage()->getBounds();
   }
 };
 
@@ -88,6 +88,21 @@ namespace app {
       // Should return an image where we can write pixels
       virtual Image* getDstImage() = 0;
 
+      // Source and destination images can be filled lazily, so before
+      // reading/writing pixels these functions must be called to
+      // validate the area to be used (in image coordinates).
+      virtual void validateSrcImage(const gfx::Region& rgn) = 0;
+      virtual void validateDstImage(const gfx::Region& rgn) = 0;
+
+      // Discards the pixels of the destination image inside the given
+      // region, the next validateDstImage() will copy the source
+      // pixels there again.
+      virtual void invalidateDstImage(const gfx::Region& rgn) = 0;
+
+      // Copies the valid pixels of the destination image inside the
+      // given region to the source image (used by TracePolicyOverlap).
+      virtual void copyValidDstToSrcImage(const gfx::Region& rgn) = 0;
+
       // Returns the RGB map used to convert RGB values to palette index.
       virtual RgbMap* getRgbMap() = 0;
 
@@ -156,6 +171,9 @@ namespace app {
       virtual int getSprayWidth() = 0;
       virtual int getSpraySpeed() = 0;
 
+      // Radius of the window used by the blur ink (1 means 3x3 pixels)
+      virtual int getBlurRadius() = 0;
+
       // Offset for each point
       virtual gfx::Point getOffset() = 0;
 
@@ -61,18 +61,16 @@ void ToolLoopManager::prepareLoop(const Pointer& pointer)
   // Start with no points at all
   m_points.clear();
 
-  // Prepare the image where we will draw on
-  copy_image(m_toolLoop->getDstImage(),
-             m_toolLoop->getSrcImage(), 0, 0);
-
   // Prepare the ink
   m_toolLoop->getInk()->prepareInk(m_toolLoop);
   m_toolLoop->getIntertwine()->prepareIntertwine();
 
   // Prepare preview image (the destination image will be our preview
-  // in the tool-loop time, so we can see what we are drawing)
+  // in the tool-loop time, so we can see what we are drawing). The
+  // destination image is filled lazily, so we validate it as it is
+  // rendered (see validatePreviewImage()).
   RenderEngine::setPreviewImage(m_toolLoop->getLayer(),
-                                m_toolLoop->getDstImage());
+                                m_toolLoop->getDstImage(), this);
 }
 
 void ToolLoopManager::releaseLoop(const Pointer& pointer)
@@ -161,36 +159,45 @@ void ToolLoopManager::doLoopStep(bool last_step)
   for (size_t i=0; i<points_to_interwine.size(); ++i)
     points_to_interwine[i] += offset;
 
+  // Calculate the area to be updated in all document observers.
+  Region& dirty_area = m_toolLoop->getDirtyArea();
+  calculateDirtyArea(m_toolLoop, points_to_interwine, dirty_area);
+
   switch (m_toolLoop->getTracePolicy()) {
 
     case TracePolicyAccumulate:
       // Do nothing. We accumulate traces in the destination image.
       break;
 
-    case TracePolicyLast:
-      // Copy source to destination (reset the previous trace). Useful
-      // for tools like Line and Ellipse tools (we kept the last trace only).
-      clear_image(m_toolLoop->getDstImage(), 0);
-      copy_image(m_toolLoop->getDstImage(), m_toolLoop->getSrcImage(), 0, 0);
+    case TracePolicyLast: {
+      // Copy source to destination in the area of the previous trace
+      // (reset the previous trace). Useful for tools like Line and
+      // Ellipse tools (we kept the last trace only).
+      Region old_image_area(m_oldDirtyArea);
+      old_image_area.offset(m_toolLoop->getOffset());
+
+      m_toolLoop->invalidateDstImage(old_image_area);
+      m_toolLoop->validateDstImage(old_image_area);
       break;
+    }
 
     case TracePolicyOverlap:
       // Copy destination to source (yes, destination to source). In
       // this way each new trace overlaps the previous one.
-      copy_image(m_toolLoop->getSrcImage(), m_toolLoop->getDstImage(), 0, 0);
+      m_toolLoop->copyValidDstToSrcImage(Region(m_toolLoop->getDstImage()->getBounds()));
       break;
   }
 
+  // Validate the pixels that the ink is going to use
+  validateImages(dirty_area);
+  m_toolLoop->getInk()->prepareStep(m_toolLoop);
+
   // Get the modified area in the sprite with this intertwined set of points
   if (!m_toolLoop->getFilled() || (!last_step && !m_toolLoop->getPreviewFilled()))
     m_toolLoop->getIntertwine()->joinPoints(m_toolLoop, points_to_interwine);
   else
     m_toolLoop->getIntertwine()->fillPoints(m_toolLoop, points_to_interwine);
 
-  // Calculate the area to be updated in all document observers.
-  Region& dirty_area = m_toolLoop->getDirtyArea();
-  calculateDirtyArea(m_toolLoop, points_to_interwine, dirty_area);
-
   if (m_toolLoop->getTracePolicy() == TracePolicyLast) {
     Region prev_dirty_area = dirty_area;
     dirty_area.createUnion(dirty_area, m_oldDirtyArea);
@@ -201,6 +208,53 @@ void ToolLoopManager::doLoopStep(bool last_step)
     m_toolLoop->updateDirtyArea();
 }
 
+void ToolLoopManager::validatePreviewImage(const gfx::Rect& bounds)
+{
+  m_toolLoop->validateDstImage(Region(bounds));
+}
+
+// Validates the source/destination images in the given dirty area (in
+// sprite coordinates) so the ink can read/write pixels there.
+void ToolLoopManager::validateImages(const Region& dirty_area)
+{
+  Region image_area(dirty_area);
+  image_area.offset(m_toolLoop->getOffset());
+
+  // The flood fill reads and can modify the whole canvas (its
+  // modified area isn't known until the fill is done).
+  if (m_toolLoop->getPointShape()->isFloodFill()) {
+    Region canvas_area(m_toolLoop->getSrcImage()->getBounds());
+    m_toolLoop->validateSrcImage(canvas_area);
+    m_toolLoop->validateDstImage(canvas_area);
+    return;
+  }
+
+  // Effect inks (like blur or jumble) read source pixels around the
+  // modified area.
+  if (m_toolLoop->getInk()->isEffect()) {
+    if (m_toolLoop->getDocumentSettings()->getTiledMode() != TILED_NONE) {
+      m_toolLoop->validateSrcImage(Region(m_toolLoop->getSrcImage()->getBounds()));
+    }
+    else {
+      // The blur ink reads pixels up to the blur radius, and the
+      // jumble ink depending on the speed.
+      Point speed = m_toolLoop->getSpeed() / 4;
+      int margin = MAX(1, m_toolLoop->getBlurRadius()) + MAX(ABS(speed.x), ABS(speed.y));
+      Region src_area;
+
+      for (Region::const_iterator
+             it=image_area.begin(), end=image_area.end(); it!=end; ++it) {
+        Rect rc = *it;
+        src_area.createUnion(src_area, Region(rc.enlarge(margin)));
+      }
+
+      m_toolLoop->validateSrcImage(src_area);
+    }
+  }
+
+  m_toolLoop->validateDstImage(image_area);
+}
+
 // Applies the grid settings to the specified sprite point.
 void ToolLoopManager::snapToGrid(Point& point)
 {
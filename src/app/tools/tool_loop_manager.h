@@ -22,6 +22,8 @@
 
 #include <vector>
 
+#include "app/util/render.h"
+#include "base/compiler_specific.h"
 #include "gfx/point.h"
 #include "gfx/region.h"
 
@@ -48,7 +50,7 @@ namespace app {
     // 5. When the user release the mouse:
     //    - ToolLoopManager::releaseButton
     //    - ToolLoopManager::releaseLoop
-    class ToolLoopManager {
+    class ToolLoopManager : public RenderEngine::PreviewImageValidator {
     public:
 
       // Simple container of mouse events information.
@@ -94,12 +96,17 @@ namespace app {
       // Should be called each time the user moves the mouse inside the editor.
       void movement(const Pointer& pointer);
 
+      // RenderEngine::PreviewImageValidator impl
+      void validatePreviewImage(const gfx::Rect& bounds) OVERRIDE;
+
     private:
       typedef std::vector<gfx::Point> Points;
 
       void doLoopStep(bool last_step);
       void snapToGrid(gfx::Point& point);
 
+      void validateImages(const gfx::Region& dirty_area);
+
       static void calculateDirtyArea(ToolLoop* loop,
                                      const Points& points,
                                      gfx::Region& dirty_area);
@@ -367,6 +367,23 @@ protected:
   }
 };
 
+class ContextBar::BlurRadiusField : public IntEntry
+{
+public:
+  BlurRadiusField() : IntEntry(1, 32) {
+  }
+
+protected:
+  void onValueChange() OVERRIDE {
+    IntEntry::onValueChange();
+
+    ISettings* settings = UIContext::instance()->getSettings();
+    Tool* currentTool = settings->getCurrentTool();
+    settings->getToolSettings(currentTool)
+      ->setBlurRadius(getValue());
+  }
+};
+
 
 class ContextBar::TransparentColorField : public ColorButton
 {
@@ -520,6 +537,10 @@ ContextBar::ContextBar()
   m_sprayBox->addChild(m_sprayWidth = new SprayWidthField());
   m_sprayBox->addChild(m_spraySpeed = new SpraySpeedField());
 
+  addChild(m_blurBox = new HBox());
+  m_blurBox->addChild(setup_mini_font(new Label("Blur:")));
+  m_blurBox->addChild(m_blurRadius = new BlurRadiusField());
+
   addChild(m_freehandBox = new HBox());
   m_freehandBox->addChild(m_freehandAlgo = new FreehandAlgorithmField());
 
@@ -535,6 +556,7 @@ ContextBar::ContextBar()
   tooltipManager->addTooltipFor(m_inkOpacity, "Opacity (Alpha value in RGBA)", JI_BOTTOM);
   tooltipManager->addTooltipFor(m_sprayWidth, "Spray Width", JI_BOTTOM);
   tooltipManager->addTooltipFor(m_spraySpeed, "Spray Speed", JI_BOTTOM);
+  tooltipManager->addTooltipFor(m_blurRadius, "Blur Radius (in pixels)", JI_BOTTOM);
   tooltipManager->addTooltipFor(m_transparentColor, "Transparent Color", JI_BOTTOM);
   tooltipManager->addTooltipFor(m_rotAlgo, "Rotation Algorithm", JI_BOTTOM);
   tooltipManager->addTooltipFor(m_freehandAlgo, "Freehand trace algorithm", JI_BOTTOM);
@@ -626,6 +648,7 @@ void ContextBar::updateFromTool(tools::Tool* tool)
 
   m_sprayWidth->setValue(toolSettings->getSprayWidth());
   m_spraySpeed->setValue(toolSettings->getSpraySpeed());
+  m_blurRadius->setValue(toolSettings->getBlurRadius());
 
   // True if the current tool needs opacity options
   bool hasOpacity = (tool->getInk(0)->isPaint() ||
@@ -650,6 +673,10 @@ void ContextBar::updateFromTool(tools::Tool* tool)
   bool hasSprayOptions = (tool->getPointShape(0)->isSpray() ||
                           tool->getPointShape(1)->isSpray());
 
+  // True if the current tool needs blur options
+  bool hasBlurOptions = (tool->getInk(0)->isBlur() ||
+                         tool->getInk(1)->isBlur());
+
   bool hasSelectOptions = (tool->getInk(0)->isSelection() ||
                            tool->getInk(1)->isSelection());
 
@@ -669,6 +696,7 @@ void ContextBar::updateFromTool(tools::Tool* tool)
   m_toleranceLabel->setVisible(hasTolerance);
   m_tolerance->setVisible(hasTolerance);
   m_sprayBox->setVisible(hasSprayOptions);
+  m_blurBox->setVisible(hasBlurOptions);
   m_selectionOptionsBox->setVisible(hasSelectOptions);
 
   layout();
@@ -65,6 +65,7 @@ namespace app {
     class InkOpacityField;
     class SprayWidthField;
     class SpraySpeedField;
+    class BlurRadiusField;
     class SelectionModeField;
     class TransparentColorField;
     class RotAlgorithmField;
@@ -86,6 +87,8 @@ namespace app {
     ui::Box* m_sprayBox;
     SprayWidthField* m_sprayWidth;
     SpraySpeedField* m_spraySpeed;
+    ui::Box* m_blurBox;
+    BlurRadiusField* m_blurRadius;
     ui::Box* m_selectionOptionsBox;
     SelectionModeField* m_selectionMode;
     TransparentColorField* m_transparentColor;
@@ -461,9 +461,15 @@ void PixelsMovement::stampImage()
       ExpandCelCanvas expandCelCanvas(writer.context(), TILED_NONE,
                                       m_undoTransaction);
 
+      gfx::Point dstPt(-expandCelCanvas.getCel()->getX(),
+                       -expandCelCanvas.getCel()->getY());
+
+      expandCelCanvas.validateDestCanvas(
+        gfx::Region(gfx::Rect(dstPt.x, dstPt.y,
+                              image->getWidth(), image->getHeight())));
+
       composite_image(expandCelCanvas.getDestCanvas(), image,
-                      -expandCelCanvas.getCel()->getX(),
-                      -expandCelCanvas.getCel()->getY(),
+                      dstPt.x, dstPt.y,
                       cel->getOpacity(), BLEND_MODE_NORMAL);
 
       expandCelCanvas.commit();
@@ -68,6 +68,7 @@ class ToolLoopImpl : public tools::ToolLoop,
   bool m_previewFilled;
   int m_sprayWidth;
   int m_spraySpeed;
+  int m_blurRadius;
   ISettings* m_settings;
   IDocumentSettings* m_docSettings;
   IToolSettings* m_toolSettings;
@@ -145,6 +146,7 @@ public:
 
     m_sprayWidth = m_toolSettings->getSprayWidth();
     m_spraySpeed = m_toolSettings->getSpraySpeed();
+    m_blurRadius = m_toolSettings->getBlurRadius();
 
     // Create the pen
     IPenSettings* pen_settings = m_toolSettings->getPen();
@@ -213,6 +215,18 @@ public:
   Layer* getLayer() OVERRIDE { return m_layer; }
   Image* getSrcImage() OVERRIDE { return m_expandCelCanvas.getSourceCanvas(); }
   Image* getDstImage() OVERRIDE { return m_expandCelCanvas.getDestCanvas(); }
+  void validateSrcImage(const gfx::Region& rgn) OVERRIDE {
+    m_expandCelCanvas.validateSourceCanvas(rgn);
+  }
+  void validateDstImage(const gfx::Region& rgn) OVERRIDE {
+    m_expandCelCanvas.validateDestCanvas(rgn);
+  }
+  void invalidateDstImage(const gfx::Region& rgn) OVERRIDE {
+    m_expandCelCanvas.invalidateDestCanvas(rgn);
+  }
+  void copyValidDstToSrcImage(const gfx::Region& rgn) OVERRIDE {
+    m_expandCelCanvas.copyValidDestToSourceCanvas(rgn);
+  }
   RgbMap* getRgbMap() OVERRIDE { return m_sprite->getRgbMap(m_frame); }
   bool useMask() OVERRIDE { return m_useMask; }
   Mask* getMask() OVERRIDE { return m_mask; }
@@ -231,6 +245,7 @@ public:
   bool getPreviewFilled() OVERRIDE { return m_previewFilled; }
   int getSprayWidth() OVERRIDE { return m_sprayWidth; }
   int getSpraySpeed() OVERRIDE { return m_spraySpeed; }
+  int getBlurRadius() OVERRIDE { return m_blurRadius; }
   gfx::Point getOffset() OVERRIDE { return m_offset; }
   void setSpeed(const gfx::Point& speed) OVERRIDE { m_speed = speed; }
   gfx::Point getSpeed() OVERRIDE { return m_speed; }
@@ -40,8 +40,14 @@
 #include "raster/sprite.h"
 #include "raster/stock.h"
 
+#include <cstring>
+
 namespace {
 
+// Size of the tiles (in pixels) used to validate the source and
+// destination canvases.
+const int kTileSize = 64;
+
 static raster::ImageBufferPtr src_buffer;
 static raster::ImageBufferPtr dst_buffer;
 
@@ -61,6 +67,18 @@ static void create_buffers()
   }
 }
 
+// Copies the "srcBounds" rectangle of "src" image to the (x, y)
+// position of "dst" image (the rectangle must be inside both images).
+static void copy_rect(raster::Image* dst, const raster::Image* src,
+                      int x, int y, const gfx::Rect& srcBounds)
+{
+  int bytes = raster::calculate_rowstride_bytes(src->getPixelFormat(), srcBounds.w);
+
+  for (int v=0; v<srcBounds.h; ++v)
+    memcpy(dst->getPixelAddress(x, y+v),
+           src->getPixelAddress(srcBounds.x, srcBounds.y+v), bytes);
+}
+
 }
 
 namespace app {
@@ -88,12 +106,8 @@ ExpandCelCanvas::ExpandCelCanvas(Context* context, TiledMode tiledMode, UndoTran
 
   // If there is no Cel
   if (m_cel == NULL) {
-    // Create the image
-    m_celImage = Image::create(m_sprite->getPixelFormat(), m_sprite->getWidth(),
-                               m_sprite->getHeight());
-    clear_image(m_celImage, m_sprite->getTransparentColor());
-
-    // Create the cel
+    // Create the cel (its image will be created in commit() with
+    // the content of the destination canvas)
     m_cel = new Cel(location.frame(), 0);
     static_cast<LayerImage*>(m_layer)->addCel(m_cel);
 
@@ -106,27 +120,33 @@ ExpandCelCanvas::ExpandCelCanvas(Context* context, TiledMode tiledMode, UndoTran
   // Region to draw
   int x1, y1, x2, y2;
 
-  if (tiledMode == TILED_NONE) { // Non-tiled
+  if (tiledMode == TILED_NONE && m_celImage) { // Non-tiled
     x1 = MIN(m_cel->getX(), 0);
     y1 = MIN(m_cel->getY(), 0);
     x2 = MAX(m_cel->getX()+m_celImage->getWidth(), m_sprite->getWidth());
     y2 = MAX(m_cel->getY()+m_celImage->getHeight(), m_sprite->getHeight());
   }
-  else {                        // Tiled
+  else {                        // Tiled (or a new cel)
     x1 = 0;
     y1 = 0;
     x2 = m_sprite->getWidth();
     y2 = m_sprite->getHeight();
   }
 
-  // create two copies of the image region which we'll modify with the tool
-  m_srcImage = crop_image(m_celImage,
-    x1-m_cel->getX(),
-    y1-m_cel->getY(), x2-x1, y2-y1,
-    m_sprite->getTransparentColor(),
-    src_buffer);
+  m_bounds = gfx::Rect(x1, y1, x2-x1, y2-y1);
+
+  // Create two canvases of the image region which we'll modify with
+  // the tool. They are empty, the cel pixels are copied on demand
+  // (see validateSourceCanvas() and validateDestCanvas()).
+  m_srcImage = Image::create(m_sprite->getPixelFormat(),
+                             m_bounds.w, m_bounds.h, src_buffer);
+  m_dstImage = Image::create(m_sprite->getPixelFormat(),
+                             m_bounds.w, m_bounds.h, dst_buffer);
 
-  m_dstImage = Image::createCopy(m_srcImage, dst_buffer);
+  if (m_celImage) {
+    m_srcImage->setMaskColor(m_celImage->getMaskColor());
+    m_dstImage->setMaskColor(m_celImage->getMaskColor());
+  }
 
   // We have to adjust the cel position to match the m_dstImage
   // position (the new m_dstImage will be used in RenderEngine to
@@ -152,47 +172,59 @@ void ExpandCelCanvas::commit(const gfx::Rect& bounds)
   ASSERT(!m_closed);
   ASSERT(!m_committed);
 
+  // Was the cel created in the start of the tool-loop?.
+  if (m_celCreated) {
+    ASSERT(m_celImage == NULL);
+
+    // Create the m_celImage with the pixels of the destination
+    // canvas (pixels outside the valid region are transparent).
+    m_celImage = Image::create(m_sprite->getPixelFormat(),
+                               m_bounds.w, m_bounds.h);
+    clear_image(m_celImage, m_sprite->getTransparentColor());
+    copyValidDestToCel(m_celImage, m_celImage->getBounds());
+
+    // Add the m_celImage in the images stock of the sprite.
+    m_cel->setImage(m_sprite->getStock()->addImage(m_celImage));
+
+    // Is the undo enabled?.
+    if (m_undo.isEnabled()) {
+      // We can temporary remove the cel.
+      static_cast<LayerImage*>(m_layer)->removeCel(m_cel);
+
+      // We create the undo information (for the new m_celImage
+      // in the stock and the new cel in the layer)...
+      m_undo.pushUndoer(new undoers::AddImage(m_undo.getObjects(),
+                                              m_sprite->getStock(), m_cel->getImage()));
+      m_undo.pushUndoer(new undoers::AddCel(m_undo.getObjects(),
+                                            m_layer, m_cel));
+
+      // And finally we add the cel again in the layer.
+      static_cast<LayerImage*>(m_layer)->addCel(m_cel);
+    }
+  }
   // If the size of each image is the same, we can create an undo
   // with only the differences between both images.
-  if (m_cel->getX() == m_originalCelX &&
-      m_cel->getY() == m_originalCelY &&
-      m_celImage->getWidth() == m_dstImage->getWidth() &&
-      m_celImage->getHeight() == m_dstImage->getHeight()) {
-    // Was m_celImage created in the start of the tool-loop?.
-    if (m_celCreated) {
-      // We can keep the m_celImage
-
-      // We copy the destination image to the m_celImage
-      copy_image(m_celImage, m_dstImage, 0, 0);
-
-      // Add the m_celImage in the images stock of the sprite.
-      m_cel->setImage(m_sprite->getStock()->addImage(m_celImage));
-
-      // Is the undo enabled?.
-      if (m_undo.isEnabled()) {
-        // We can temporary remove the cel.
-        static_cast<LayerImage*>(m_layer)->removeCel(m_cel);
-
-        // We create the undo information (for the new m_celImage
-        // in the stock and the new cel in the layer)...
-        m_undo.pushUndoer(new undoers::AddImage(m_undo.getObjects(),
-                                                m_sprite->getStock(), m_cel->getImage()));
-        m_undo.pushUndoer(new undoers::AddCel(m_undo.getObjects(),
-                                              m_layer, m_cel));
-
-        // And finally we add the cel again in the layer.
-        static_cast<LayerImage*>(m_layer)->addCel(m_cel);
-      }
-    }
-    // If the m_celImage was already created before the whole process...
-    else {
-      // Add to the undo history the differences between m_celImage and m_dstImage
-      if (m_undo.isEnabled()) {
-        gfx::Rect dirtyBounds;
-        if (bounds.isEmpty())
-          dirtyBounds = m_celImage->getBounds();
-        else
-          dirtyBounds = m_celImage->getBounds().createIntersect(bounds);
+  else if (m_cel->getX() == m_originalCelX &&
+           m_cel->getY() == m_originalCelY &&
+           m_celImage->getWidth() == m_dstImage->getWidth() &&
+           m_celImage->getHeight() == m_dstImage->getHeight()) {
+    // Only the valid region of the destination canvas can be
+    // different from the m_celImage.
+    gfx::Rect validBounds = m_validDstRegion.getBounds();
+
+    // Add to the undo history the differences between m_celImage and m_dstImage
+    if (m_undo.isEnabled() && !validBounds.isEmpty()) {
+      gfx::Rect dirtyBounds;
+      if (bounds.isEmpty())
+        dirtyBounds = m_celImage->getBounds();
+      else
+        dirtyBounds = m_celImage->getBounds().createIntersect(bounds);
+
+      dirtyBounds = dirtyBounds.createIntersect(validBounds);
+
+      if (!dirtyBounds.isEmpty()) {
+        // Dirty compares all pixels inside dirtyBounds
+        validateDestCanvas(gfx::Region(dirtyBounds));
 
         base::UniquePtr<Dirty> dirty(new Dirty(m_celImage, m_dstImage, dirtyBounds));
 
@@ -200,10 +232,10 @@ void ExpandCelCanvas::commit(const gfx::Rect& bounds)
         if (dirty != NULL)
           m_undo.pushUndoer(new undoers::DirtyArea(m_undo.getObjects(), m_celImage, dirty));
       }
-
-      // Copy the destination to the cel image.
-      copy_image(m_celImage, m_dstImage, 0, 0);
     }
+
+    // Copy the destination to the cel image.
+    copyValidDestToCel(m_celImage, m_celImage->getBounds());
   }
   // If the size of both images are different, we have to
   // replace the entire image.
@@ -224,6 +256,9 @@ void ExpandCelCanvas::commit(const gfx::Rect& bounds)
           m_sprite->getStock(), m_cel->getImage()));
     }
 
+    // The whole destination canvas is needed to replace the image.
+    validateDestCanvas(gfx::Region(m_dstImage->getBounds()));
+
     // Replace the image in the stock. We need to create a copy of
     // image because m_dstImage's ImageBuffer cannot be shared.
     m_sprite->getStock()->replaceImage(m_cel->getImage(),
@@ -253,4 +288,118 @@ void ExpandCelCanvas::rollback()
   m_closed = true;
 }
 
+void ExpandCelCanvas::validateSourceCanvas(const gfx::Region& rgn)
+{
+  gfx::Region rgnToValidate;
+  getTilesRegion(rgn, rgnToValidate);
+  rgnToValidate.createSubtraction(rgnToValidate, m_validSrcRegion);
+  if (rgnToValidate.isEmpty())
+    return;
+
+  // Bounds of the original cel image in canvas coordinates (empty if
+  // the cel was created by us).
+  gfx::Rect celBounds;
+  if (m_celImage && !m_celCreated)
+    celBounds = gfx::Rect(m_originalCelX - m_bounds.x,
+                          m_originalCelY - m_bounds.y,
+                          m_celImage->getWidth(),
+                          m_celImage->getHeight());
+
+  for (gfx::Region::const_iterator
+         it=rgnToValidate.begin(), end=rgnToValidate.end(); it!=end; ++it) {
+    const gfx::Rect& rc = *it;
+    gfx::Rect inside = rc.createIntersect(celBounds);
+
+    // Pixels outside the cel image are transparent
+    if (inside != rc)
+      fill_rect(m_srcImage, rc.x, rc.y, rc.x+rc.w-1, rc.y+rc.h-1,
+                m_sprite->getTransparentColor());
+
+    if (!inside.isEmpty())
+      copy_rect(m_srcImage, m_celImage, inside.x, inside.y,
+                gfx::Rect(inside).offset(-celBounds.x, -celBounds.y));
+  }
+
+  m_validSrcRegion.createUnion(m_validSrcRegion, rgnToValidate);
+}
+
+void ExpandCelCanvas::validateDestCanvas(const gfx::Region& rgn)
+{
+  gfx::Region rgnToValidate;
+  getTilesRegion(rgn, rgnToValidate);
+  rgnToValidate.createSubtraction(rgnToValidate, m_validDstRegion);
+  if (rgnToValidate.isEmpty())
+    return;
+
+  validateSourceCanvas(rgnToValidate);
+
+  for (gfx::Region::const_iterator
+         it=rgnToValidate.begin(), end=rgnToValidate.end(); it!=end; ++it) {
+    const gfx::Rect& rc = *it;
+    copy_rect(m_dstImage, m_srcImage, rc.x, rc.y, rc);
+  }
+
+  m_validDstRegion.createUnion(m_validDstRegion, rgnToValidate);
+}
+
+void ExpandCelCanvas::invalidateDestCanvas(const gfx::Region& rgn)
+{
+  m_validDstRegion.createSubtraction(m_validDstRegion, rgn);
+}
+
+void ExpandCelCanvas::copyValidDestToSourceCanvas(const gfx::Region& rgn)
+{
+  gfx::Region rgnToCopy;
+  rgnToCopy.createIntersection(rgn, m_validDstRegion);
+
+  for (gfx::Region::const_iterator
+         it=rgnToCopy.begin(), end=rgnToCopy.end(); it!=end; ++it) {
+    const gfx::Rect& rc = *it;
+    copy_rect(m_srcImage, m_dstImage, rc.x, rc.y, rc);
+  }
+
+  m_validSrcRegion.createUnion(m_validSrcRegion, rgnToCopy);
+}
+
+// Converts the given region (in canvas coordinates) to a region of
+// full tiles clipped to the canvas bounds.
+void ExpandCelCanvas::getTilesRegion(const gfx::Region& rgn, gfx::Region& tiles) const
+{
+  gfx::Rect canvasBounds(0, 0, m_bounds.w, m_bounds.h);
+
+  tiles.clear();
+
+  for (gfx::Region::const_iterator
+         it=rgn.begin(), end=rgn.end(); it!=end; ++it) {
+    gfx::Rect rc = (*it).createIntersect(canvasBounds);
+    if (rc.isEmpty())
+      continue;
+
+    int x1 = rc.x / kTileSize * kTileSize;
+    int y1 = rc.y / kTileSize * kTileSize;
+    int x2 = (rc.x+rc.w+kTileSize-1) / kTileSize * kTileSize;
+    int y2 = (rc.y+rc.h+kTileSize-1) / kTileSize * kTileSize;
+
+    tiles.createUnion(tiles, gfx::Region(gfx::Rect(x1, y1, x2-x1, y2-y1)
+                                         .createIntersect(canvasBounds)));
+  }
+}
+
+// Copies the valid pixels of the destination canvas inside "bounds"
+// to the cel image (which must be of the same size of the canvas).
+void ExpandCelCanvas::copyValidDestToCel(Image* celImage, const gfx::Rect& bounds)
+{
+  ASSERT(celImage->getWidth() == m_dstImage->getWidth());
+  ASSERT(celImage->getHeight() == m_dstImage->getHeight());
+
+  gfx::Region rgnToCopy;
+  rgnToCopy.createIntersection(m_validDstRegion, gfx::Region(bounds));
+
+  for (gfx::Region::const_iterator
+         it=rgnToCopy.begin(), end=rgnToCopy.end(); it!=end; ++it) {
+    const gfx::Rect& rc = *it;
+    copy_rect(celImage, m_dstImage, rc.x, rc.y, rc);
+  }
+}
+
 } // namespace app
@@ -22,6 +22,7 @@
 
 #include "filters/tiled_mode.h"
 #include "gfx/rect.h"
+#include "gfx/region.h"
 
 namespace raster {
   class Cel;
@@ -44,6 +45,12 @@ namespace app {
   // state.  If all changes are committed, some undo information is
   // stored in the document's UndoHistory to go back to the original
   // state using "Undo" command.
+  //
+  // The source and destination canvases are filled lazily: pixels
+  // from the original cel are copied to them (in tiles) only when
+  // they are validated with validateSourceCanvas() or
+  // validateDestCanvas(). So before reading or writing pixels in a
+  // canvas you have to validate the area you are going to use.
   class ExpandCelCanvas {
   public:
     ExpandCelCanvas(Context* context, TiledMode tiledMode, UndoTransaction& undo);
@@ -68,11 +75,33 @@ namespace app {
       return m_dstImage;
     }
 
+    // Copies the original cel pixels to the given region of the
+    // source canvas (the region is in canvas coordinates). Only the
+    // tiles that weren't validated before are copied.
+    void validateSourceCanvas(const gfx::Region& rgn);
+
+    // Copies the pixels of the source canvas to the given region of
+    // the destination canvas (validating the source canvas in that
+    // region first).
+    void validateDestCanvas(const gfx::Region& rgn);
+
+    // Marks the given region of the destination canvas as invalid,
+    // so the next validateDestCanvas() will copy the source pixels
+    // there again (discarding what was painted).
+    void invalidateDestCanvas(const gfx::Region& rgn);
+
+    // Copies the valid destination pixels inside the given region to
+    // the source canvas.
+    void copyValidDestToSourceCanvas(const gfx::Region& rgn);
+
     const Cel* getCel() const {
       return m_cel;
     }
 
   private:
+    void getTilesRegion(const gfx::Region& rgn, gfx::Region& tiles) const;
+    void copyValidDestToCel(Image* celImage, const gfx::Rect& bounds);
+
     Document* m_document;
     Sprite* m_sprite;
     Layer* m_layer;
@@ -81,8 +110,11 @@ namespace app {
     bool m_celCreated;
     int m_originalCelX;
     int m_originalCelY;
+    gfx::Rect m_bounds;
     Image* m_srcImage;
     Image* m_dstImage;
+    gfx::Region m_validSrcRegion;
+    gfx::Region m_validDstRegion;
     bool m_closed;
     bool m_committed;
     UndoTransaction& m_undo;
@@ -285,6 +285,7 @@ static app::Color checked_bg_color2;
 static int global_opacity = 255;
 static const Layer* selected_layer = NULL;
 static Image* rastering_image = NULL;
+static RenderEngine::PreviewImageValidator* rastering_image_validator = NULL;
 
 // static
 void RenderEngine::loadConfig()
@@ -362,10 +363,12 @@ RenderEngine::RenderEngine(const Document* document,
 }
 
 // static
-void RenderEngine::setPreviewImage(const Layer* layer, Image* image)
+void RenderEngine::setPreviewImage(const Layer* layer, Image* image,
+                                   PreviewImageValidator* validator)
 {
   selected_layer = layer;
   rastering_image = image;
+  rastering_image_validator = validator;
 }
 
 /**
@@ -588,6 +591,18 @@ void RenderEngine::renderLayer(const Layer* layer,
             (selected_layer == layer) &&
             (rastering_image != NULL)) {
           src_image = rastering_image;
+
+          // Fill the visible area of the preview image (the area is
+          // converted from zoomed sprite coordinates to image
+          // coordinates).
+          if (rastering_image_validator != NULL) {
+            gfx::Rect bounds((source_x >> zoom) - cel->getX(),
+                             (source_y >> zoom) - cel->getY(),
+                             (image->getWidth() >> zoom) + 2,
+                             (image->getHeight() >> zoom) + 2);
+
+            rastering_image_validator->validatePreviewImage(bounds);
+          }
         }
         // If not, we use the original cel-image from the images' stock
         else if ((cel->getImage() >= 0) &&
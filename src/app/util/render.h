@@ -21,6 +21,7 @@
 #pragma once
 
 #include "app/color.h"
+#include "gfx/rect.h"
 #include "raster/frame_number.h"
 
 namespace raster {
@@ -63,7 +64,19 @@ namespace app {
     //////////////////////////////////////////////////////////////////////
     // Preview image
 
-    static void setPreviewImage(const Layer* layer, Image* drawable);
+    // Used to fill on demand the pixels of a preview image before
+    // they are rendered (e.g. the canvas of a tool-loop is filled
+    // lazily with the pixels of the cel).
+    class PreviewImageValidator {
+    public:
+      virtual ~PreviewImageValidator() { }
+
+      // The bounds are in preview image coordinates.
+      virtual void validatePreviewImage(const gfx::Rect& bounds) = 0;
+    };
+
+    static void setPreviewImage(const Layer* layer, Image* drawable,
+                                PreviewImageValidator* validator = NULL);
 
     //////////////////////////////////////////////////////////////////////
     // Main function used by sprite-editors to render the sprite
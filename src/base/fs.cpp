@@ -15,3 +15,15 @@
 #else
   #include "base/fs_unix.h"
 #endif
+
+namespace base {
+
+bool is_same_file(const string& path1, const string& path2)
+{
+  FileStatus status1, status2;
+  return (get_file_status(path1, status1) &&
+          get_file_status(path2, status2) &&
+          status1.isSameFile(status2));
+}
+
+}
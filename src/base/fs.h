@@ -10,13 +10,56 @@
 
 #include "base/string.h"
 
+#include <stdint.h>
+
 namespace base {
 
+  // Identifies a file (two paths can be the same file, e.g. hard
+  // links or different spellings of the same path) and the version
+  // of its content.
+  struct FileStatus {
+    uint64_t device;
+    uint64_t index;             // Inode or file index in the device
+    uint64_t size;
+    uint64_t modified;          // Last write time
+
+    FileStatus() : device(0), index(0), size(0), modified(0) { }
+
+    bool isSameFile(const FileStatus& other) const {
+      return (device == other.device && index == other.index);
+    }
+
+    bool isSameVersion(const FileStatus& other) const {
+      return (isSameFile(other) &&
+              size == other.size &&
+              modified == other.modified);
+    }
+  };
+
   bool is_file(const string& path);
   bool is_directory(const string& path);
 
+  // Returns false if the file cannot be accessed.
+  bool get_file_status(const string& path, FileStatus& status);
+  bool is_same_file(const string& path1, const string& path2);
+
   void delete_file(const string& path);
 
+  // Renames "src" as "dst", replacing "dst" if it already exists.
+  void move_file(const string& src, const string& dst);
+
+  // Creates a new empty file named "path" plus a unique suffix (an
+  // existing file is never replaced), and returns its name.
+  string create_unique_file(const string& path);
+
+  // Gives to "dst" the same permissions (or attributes) of "src".
+  void copy_file_permissions(const string& src, const string& dst);
+
+  // Returns the absolute path of an existing file (with all symbolic
+  // links resolved on Unix-like systems), or "path" if it cannot be
+  // resolved.
+  string get_canonical_path(const string& path);
+
   bool has_readonly_attr(const string& path);
   void remove_readonly_attr(const string& path);
 
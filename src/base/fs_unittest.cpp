@@ -0,0 +1,114 @@
+// Aseprite Base Library
+// Copyright (c) 2001-2013 David Capello
+//
+// This file is released under the terms of the MIT license.
+// Read LICENSE.txt for more information.
+
+#include <gtest/gtest.h>
+
+#include "base/file_handle.h"
+#include "base/fs.h"
+
+#include <stdio.h>
+
+#ifndef _WIN32
+  #include <sys/stat.h>
+  #include <unistd.h>
+#endif
+
+using namespace base;
+
+static void write_file(const char* fn, const char* text)
+{
+  FileHandle f(open_file_with_exception(fn, "wb"));
+  fputs(text, f);
+}
+
+TEST(FS, FileStatus)
+{
+  const char* fn = "test1.txt";
+  const char* fn2 = "test2.txt";
+
+  write_file(fn, "hello");
+  write_file(fn2, "hello");
+
+  FileStatus status, status2;
+  ASSERT_TRUE(get_file_status(fn, status));
+  ASSERT_TRUE(get_file_status(fn2, status2));
+  EXPECT_EQ(5u, status.size);
+  EXPECT_TRUE(status.isSameVersion(status));
+  EXPECT_FALSE(status.isSameFile(status2));
+
+  // Different spellings of the same path
+  EXPECT_TRUE(is_same_file(fn, std::string("./") + fn));
+  EXPECT_FALSE(is_same_file(fn, fn2));
+
+  // The size is part of the version of the file
+  write_file(fn, "hello world");
+  FileStatus status3;
+  ASSERT_TRUE(get_file_status(fn, status3));
+  EXPECT_TRUE(status.isSameFile(status3));
+  EXPECT_FALSE(status.isSameVersion(status3));
+
+  delete_file(fn);
+  delete_file(fn2);
+  EXPECT_FALSE(get_file_status(fn, status));
+  EXPECT_FALSE(is_same_file(fn, fn));
+}
+
+TEST(FS, CreateUniqueFile)
+{
+  const char* fn = "test3.txt";
+  write_file(fn, "hello");
+
+  // The existing file is never replaced
+  std::string tmp1 = create_unique_file(fn);
+  std::string tmp2 = create_unique_file(fn);
+  EXPECT_NE(tmp1, tmp2);
+  EXPECT_NE(std::string(fn), tmp1);
+  EXPECT_TRUE(is_file(tmp1));
+  EXPECT_TRUE(is_file(tmp2));
+
+  FileStatus status;
+  ASSERT_TRUE(get_file_status(fn, status));
+  EXPECT_EQ(5u, status.size);
+
+  delete_file(tmp1);
+  delete_file(tmp2);
+  delete_file(fn);
+}
+
+#ifndef _WIN32
+
+TEST(FS, FilePermissionsAndLinks)
+{
+  const char* fn = "test4.txt";
+  const char* link = "test4-link.txt";
+  write_file(fn, "hello");
+  chmod(fn, 0640);
+
+  std::string tmp = create_unique_file(fn);
+  copy_file_permissions(fn, tmp);
+
+  struct stat sts;
+  ASSERT_EQ(0, stat(tmp.c_str(), &sts));
+  EXPECT_EQ(0640, sts.st_mode & 07777);
+
+  // The canonical path of a symbolic link is the real file
+  ASSERT_EQ(0, symlink(fn, link));
+  EXPECT_EQ(get_canonical_path(fn), get_canonical_path(link));
+  EXPECT_NE(std::string(link), get_canonical_path(link));
+  EXPECT_EQ(std::string("no-file.txt"), get_canonical_path("no-file.txt"));
+
+  delete_file(link);
+  delete_file(tmp);
+  delete_file(fn);
+}
+
+#endif
+
+int main(int argc, char** argv)
+{
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -6,7 +6,10 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <unistd.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <stdexcept>
 #include <vector>
@@ -33,6 +36,23 @@ bool is_directory(const string& path)
   return (stat(path.c_str(), &sts) == 0 && S_ISDIR(sts.st_mode)) ? true: false;
 }
 
+bool get_file_status(const string& path, FileStatus& status)
+{
+  struct stat sts;
+  if (stat(path.c_str(), &sts) != 0)
+    return false;
+
+  status.device = sts.st_dev;
+  status.index = sts.st_ino;
+  status.size = sts.st_size;
+#if __APPLE__
+  status.modified = uint64_t(sts.st_mtimespec.tv_sec)*1000000000 + sts.st_mtimespec.tv_nsec;
+#else
+  status.modified = uint64_t(sts.st_mtim.tv_sec)*1000000000 + sts.st_mtim.tv_nsec;
+#endif
+  return true;
+}
+
 void make_directory(const string& path)
 {
   int result = mkdir(path.c_str(), 0777);
@@ -50,6 +70,47 @@ void delete_file(const string& path)
     throw std::runtime_error("Error deleting file");
 }
 
+void move_file(const string& src, const string& dst)
+{
+  int result = rename(src.c_str(), dst.c_str());
+  if (result != 0)
+    // TODO add errno into the exception
+    throw std::runtime_error("Error moving file");
+}
+
+string create_unique_file(const string& path)
+{
+  std::string name = path + ".XXXXXX";
+  std::vector<char> buf(name.begin(), name.end());
+  buf.push_back(0);
+
+  int fd = mkstemp(&buf[0]);
+  if (fd < 0)
+    // TODO add errno into the exception
+    throw std::runtime_error("Error creating temporary file");
+
+  close(fd);
+  return string(&buf[0]);
+}
+
+void copy_file_permissions(const string& src, const string& dst)
+{
+  struct stat sts;
+  if (stat(src.c_str(), &sts) != 0 ||
+      chmod(dst.c_str(), sts.st_mode & 07777) != 0)
+    // TODO add errno into the exception
+    throw std::runtime_error("Error copying file permissions");
+}
+
+string get_canonical_path(const string& path)
+{
+  char buf[PATH_MAX];
+  if (realpath(path.c_str(), buf))
+    return string(buf);
+  else
+    return path;
+}
+
 bool has_readonly_attr(const string& path)
 {
   struct stat sts;
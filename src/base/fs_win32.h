@@ -5,6 +5,8 @@
 // Read LICENSE.txt for more information.
 
 #include <stdexcept>
+#include <stdio.h>
+#include <vector>
 #include <windows.h>
 
 #include "base/string.h"
@@ -30,6 +32,28 @@ bool is_directory(const string& path)
           ((attr & FILE_ATTRIBUTE_DIRECTORY) == FILE_ATTRIBUTE_DIRECTORY));
 }
 
+bool get_file_status(const string& path, FileStatus& status)
+{
+  HANDLE handle = ::CreateFile(from_utf8(path).c_str(), 0,
+                               FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                               NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, NULL);
+  if (handle == INVALID_HANDLE_VALUE)
+    return false;
+
+  BY_HANDLE_FILE_INFORMATION info;
+  BOOL result = ::GetFileInformationByHandle(handle, &info);
+  ::CloseHandle(handle);
+  if (result == 0)
+    return false;
+
+  status.device = info.dwVolumeSerialNumber;
+  status.index = (uint64_t(info.nFileIndexHigh) << 32) | info.nFileIndexLow;
+  status.size = (uint64_t(info.nFileSizeHigh) << 32) | info.nFileSizeLow;
+  status.modified =
+    (uint64_t(info.ftLastWriteTime.dwHighDateTime) << 32) | info.ftLastWriteTime.dwLowDateTime;
+  return true;
+}
+
 void delete_file(const string& path)
 {
   BOOL result = ::DeleteFile(from_utf8(path).c_str());
@@ -37,6 +61,58 @@ void delete_file(const string& path)
     throw Win32Exception("Error deleting file");
 }
 
+void move_file(const string& src, const string& dst)
+{
+  BOOL result = ::MoveFileEx(from_utf8(src).c_str(),
+                             from_utf8(dst).c_str(),
+                             MOVEFILE_REPLACE_EXISTING | MOVEFILE_COPY_ALLOWED);
+  if (result == 0)
+    throw Win32Exception("Error moving file");
+}
+
+string create_unique_file(const string& path)
+{
+  for (int i=0; ; ++i) {
+    char suffix[32];
+    sprintf(suffix, ".%08x%d", ::GetTickCount(), i);
+
+    string name = path + suffix;
+    HANDLE handle = ::CreateFile(from_utf8(name).c_str(), GENERIC_WRITE, 0,
+                                 NULL, CREATE_NEW, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (handle != INVALID_HANDLE_VALUE) {
+      ::CloseHandle(handle);
+      return name;
+    }
+    else if (::GetLastError() != ERROR_FILE_EXISTS)
+      throw Win32Exception("Error creating temporary file");
+  }
+}
+
+void copy_file_permissions(const string& src, const string& dst)
+{
+  // The read-only attribute isn't copied, so "dst" can replace "src"
+  DWORD attr = ::GetFileAttributes(from_utf8(src).c_str());
+  if (attr == INVALID_FILE_ATTRIBUTES ||
+      !::SetFileAttributes(from_utf8(dst).c_str(), attr & ~FILE_ATTRIBUTE_READONLY))
+    throw Win32Exception("Error copying file attributes");
+}
+
+string get_canonical_path(const string& path)
+{
+  std::wstring fn = from_utf8(path);
+  std::vector<wchar_t> buf(MAX_PATH);
+
+  DWORD len = ::GetFullPathName(fn.c_str(), buf.size(), &buf[0], NULL);
+  if (len > buf.size()) {
+    buf.resize(len);
+    len = ::GetFullPathName(fn.c_str(), buf.size(), &buf[0], NULL);
+  }
+  if (len == 0 || len > buf.size())
+    return path;
+
+  return to_utf8(std::wstring(&buf[0], len));
+}
+
 bool has_readonly_attr(const string& path)
 {
   std::wstring fn = from_utf8(path);
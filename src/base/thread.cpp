@@ -89,6 +89,26 @@ base::thread::native_handle_type base::thread::native_handle()
   return m_native_handle;
 }
 
+unsigned int base::thread::hardware_concurrency()
+{
+#ifdef WIN32
+
+  SYSTEM_INFO info;
+  ::GetSystemInfo(&info);
+  return (info.dwNumberOfProcessors > 0 ? info.dwNumberOfProcessors: 1);
+
+#elif defined(_SC_NPROCESSORS_ONLN)
+
+  long n = ::sysconf(_SC_NPROCESSORS_ONLN);
+  return (n > 0 ? (unsigned int)n: 1);
+
+#else
+
+  return 1;
+
+#endif
+}
+
 void base::thread::launch_thread(func_wrapper* f)
 {
   m_native_handle = (native_handle_type)0;
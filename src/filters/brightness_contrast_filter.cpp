@@ -0,0 +1,66 @@
+/* Aseprite
+ * Copyright (C) 2001-2013  David Capello
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "filters/brightness_contrast_filter.h"
+
+namespace filters {
+
+BrightnessContrastFilter::BrightnessContrastFilter()
+  : m_brightness(0)
+  , m_contrast(0)
+{
+  updateLuts();
+}
+
+void BrightnessContrastFilter::setBrightness(int brightness)
+{
+  m_brightness = MID(-100, brightness, 100);
+  updateLuts();
+}
+
+void BrightnessContrastFilter::setContrast(int contrast)
+{
+  m_contrast = MID(-100, contrast, 100);
+  updateLuts();
+}
+
+const char* BrightnessContrastFilter::getName()
+{
+  return "Brightness/Contrast";
+}
+
+int BrightnessContrastFilter::mapChannel(Channel channel, int value)
+{
+  // The alpha channel and palette indexes are not colors.
+  if (channel == AlphaChannel || channel == IndexChannel)
+    return value;
+
+  // Contrast scales the distance to the middle gray (from 0 to 2x,
+  // or much more for contrast values near +100).
+  double contrast = MIN(m_contrast, 99) / 100.0;
+  double factor = (contrast >= 0.0 ? 1.0 / (1.0 - contrast): 1.0 + contrast);
+  double v = (value - 128) * factor + 128 + m_brightness * 255 / 100;
+
+  return (int)(v + (v < 0.0 ? -0.5: 0.5));
+}
+
+} // namespace filters
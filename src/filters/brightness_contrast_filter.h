@@ -0,0 +1,52 @@
+/* Aseprite
+ * Copyright (C) 2001-2013  David Capello
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef FILTERS_BRIGHTNESS_CONTRAST_FILTER_H_INCLUDED
+#define FILTERS_BRIGHTNESS_CONTRAST_FILTER_H_INCLUDED
+#pragma once
+
+#include "filters/point_filter.h"
+
+namespace filters {
+
+  class BrightnessContrastFilter : public PointFilter {
+  public:
+    BrightnessContrastFilter();
+
+    // Both values go from -100 to +100 (0 doesn't modify the image).
+    void setBrightness(int brightness);
+    void setContrast(int contrast);
+
+    int getBrightness() const { return m_brightness; }
+    int getContrast() const { return m_contrast; }
+
+    // Filter implementation
+    const char* getName();
+
+  protected:
+    // PointFilter implementation
+    int mapChannel(Channel channel, int value);
+
+  private:
+    int m_brightness;
+    int m_contrast;
+  };
+
+} // namespace filters
+
+#endif
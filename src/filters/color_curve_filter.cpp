@@ -25,17 +25,9 @@
 #include <vector>
 
 #include "filters/color_curve.h"
-#include "filters/filter_indexed_data.h"
-#include "filters/filter_manager.h"
-#include "raster/image.h"
-#include "raster/palette.h"
-#include "raster/rgbmap.h"
-#include "raster/sprite.h"
 
 namespace filters {
 
-using namespace raster;
-
 ColorCurveFilter::ColorCurveFilter()
   : m_curve(NULL)
   , m_cmap(256)
@@ -52,6 +44,8 @@ void ColorCurveFilter::setCurve(ColorCurve* curve)
   m_curve->getValues(0, 255, m_cmap);
   for (int c=0; c<256; c++)
     m_cmap[c] = MID(0, m_cmap[c], 255);
+
+  updateLuts();
 }
 
 const char* ColorCurveFilter::getName()
@@ -59,100 +53,9 @@ const char* ColorCurveFilter::getName()
   return "Color Curve";
 }
 
-void ColorCurveFilter::applyToRgba(FilterManager* filterMgr)
-{
-  const uint32_t* src_address = (uint32_t*)filterMgr->getSourceAddress();
-  uint32_t* dst_address = (uint32_t*)filterMgr->getDestinationAddress();
-  int w = filterMgr->getWidth();
-  Target target = filterMgr->getTarget();
-  int x, c, r, g, b, a;
-
-  for (x=0; x<w; x++) {
-    if (filterMgr->skipPixel()) {
-      ++src_address;
-      ++dst_address;
-      continue;
-    }
-
-    c = *(src_address++);
-
-    r = rgba_getr(c);
-    g = rgba_getg(c);
-    b = rgba_getb(c);
-    a = rgba_geta(c);
-
-    if (target & TARGET_RED_CHANNEL) r = m_cmap[r];
-    if (target & TARGET_GREEN_CHANNEL) g = m_cmap[g];
-    if (target & TARGET_BLUE_CHANNEL) b = m_cmap[b];
-    if (target & TARGET_ALPHA_CHANNEL) a = m_cmap[a];
-
-    *(dst_address++) = rgba(r, g, b, a);
-  }
-}
-
-void ColorCurveFilter::applyToGrayscale(FilterManager* filterMgr)
-{
-  const uint16_t* src_address = (uint16_t*)filterMgr->getSourceAddress();
-  uint16_t* dst_address = (uint16_t*)filterMgr->getDestinationAddress();
-  int w = filterMgr->getWidth();
-  Target target = filterMgr->getTarget();
-  int x, c, k, a;
-
-  for (x=0; x<w; x++) {
-    if (filterMgr->skipPixel()) {
-      ++src_address;
-      ++dst_address;
-      continue;
-    }
-
-    c = *(src_address++);
-
-    k = graya_getv(c);
-    a = graya_geta(c);
-
-    if (target & TARGET_GRAY_CHANNEL) k = m_cmap[k];
-    if (target & TARGET_ALPHA_CHANNEL) a = m_cmap[a];
-
-    *(dst_address++) = graya(k, a);
-  }
-}
-
-void ColorCurveFilter::applyToIndexed(FilterManager* filterMgr)
+int ColorCurveFilter::mapChannel(Channel channel, int value)
 {
-  const uint8_t* src_address = (uint8_t*)filterMgr->getSourceAddress();
-  uint8_t* dst_address = (uint8_t*)filterMgr->getDestinationAddress();
-  int w = filterMgr->getWidth();
-  Target target = filterMgr->getTarget();
-  const Palette* pal = filterMgr->getIndexedData()->getPalette();
-  const RgbMap* rgbmap = filterMgr->getIndexedData()->getRgbMap();
-  int x, c, r, g, b;
-
-  for (x=0; x<w; x++) {
-    if (filterMgr->skipPixel()) {
-      ++src_address;
-      ++dst_address;
-      continue;
-    }
-
-    c = *(src_address++);
-
-    if (target & TARGET_INDEX_CHANNEL) {
-      c = m_cmap[c];
-    }
-    else {
-      r = rgba_getr(pal->getEntry(c));
-      g = rgba_getg(pal->getEntry(c));
-      b = rgba_getb(pal->getEntry(c));
-
-      if (target & TARGET_RED_CHANNEL) r = m_cmap[r];
-      if (target & TARGET_GREEN_CHANNEL) g = m_cmap[g];
-      if (target & TARGET_BLUE_CHANNEL) b = m_cmap[b];
-
-      c = rgbmap->mapColor(r, g, b);
-    }
-
-    *(dst_address++) = MID(0, c, pal->size()-1);
-  }
+  return m_cmap[value];
 }
 
 } // namespace filters
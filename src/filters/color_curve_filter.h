@@ -22,13 +22,13 @@
 
 #include <vector>
 
-#include "filters/filter.h"
+#include "filters/point_filter.h"
 
 namespace filters {
 
   class ColorCurve;
 
-  class ColorCurveFilter : public Filter
+  class ColorCurveFilter : public PointFilter
   {
   public:
     ColorCurveFilter();
@@ -38,9 +38,10 @@ namespace filters {
 
     // Filter implementation
     const char* getName();
-    void applyToRgba(FilterManager* filterMgr);
-    void applyToGrayscale(FilterManager* filterMgr);
-    void applyToIndexed(FilterManager* filterMgr);
+
+  protected:
+    // PointFilter implementation
+    int mapChannel(Channel channel, int value);
 
   private:
     ColorCurve* m_curve;
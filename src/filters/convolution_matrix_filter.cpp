@@ -31,6 +31,8 @@
 #include "raster/primitives_fast.h"
 #include "raster/rgbmap.h"
 
+#include <vector>
+
 namespace filters {
 
 using namespace raster;
@@ -121,6 +123,71 @@ namespace {
 
   };
 
+  // Values to be accumulated for each pixel when the matrix is
+  // applied with separable terms. They are the same sums of
+  // GetPixelsDelegate, the last value of RGBA/grayscale is the
+  // weight of transparent pixels (which is discounted from "div").
+
+  struct GetChannelsRgba {
+    enum { N = 5 };
+
+    void operator()(RgbTraits::pixel_t color, int values[])
+    {
+      if (rgba_geta(color) == 0) {
+        values[0] = values[1] = values[2] = values[3] = 0;
+        values[4] = 1;
+      }
+      else {
+        values[0] = rgba_getr(color);
+        values[1] = rgba_getg(color);
+        values[2] = rgba_getb(color);
+        values[3] = rgba_geta(color);
+        values[4] = 0;
+      }
+    }
+  };
+
+  struct GetChannelsGrayscale {
+    enum { N = 3 };
+
+    void operator()(GrayscaleTraits::pixel_t color, int values[])
+    {
+      if (graya_geta(color) == 0) {
+        values[0] = values[1] = 0;
+        values[2] = 1;
+      }
+      else {
+        values[0] = graya_getv(color);
+        values[1] = graya_geta(color);
+        values[2] = 0;
+      }
+    }
+  };
+
+  struct GetChannelsIndexed {
+    enum { N = 4 };
+    const Palette* pal;
+
+    GetChannelsIndexed(const Palette* pal) : pal(pal) { }
+
+    void operator()(IndexedTraits::pixel_t color, int values[])
+    {
+      values[0] = rgba_getr(pal->getEntry(color));
+      values[1] = rgba_getg(pal->getEntry(color));
+      values[2] = rgba_getb(pal->getEntry(color));
+      values[3] = color;
+    }
+  };
+
+  // Returns true if all values of the vector are equal.
+  bool is_uniform(const std::vector<int>& values)
+  {
+    for (size_t i=1; i<values.size(); ++i)
+      if (values[i] != values[0])
+        return false;
+    return true;
+  }
+
 }
 
 ConvolutionMatrixFilter::ConvolutionMatrixFilter()
@@ -132,7 +199,7 @@ ConvolutionMatrixFilter::ConvolutionMatrixFilter()
 void ConvolutionMatrixFilter::setMatrix(const SharedPtr<ConvolutionMatrix>& matrix)
 {
   m_matrix = matrix;
-  m_lines.resize(matrix->getHeight());
+  calculateSeparableTerms();
 }
 
 void ConvolutionMatrixFilter::setTiledMode(TiledMode tiledMode)
@@ -140,6 +207,182 @@ void ConvolutionMatrixFilter::setTiledMode(TiledMode tiledMode)
   m_tiledMode = tiledMode;
 }
 
+// Tries to decompose the matrix as a sum of rank-1 terms. Two cases
+// are detected: rank-1 matrices (M[y][x] = v[y]*h[x], e.g. boxes or
+// the 3x3 blur), and additive matrices (M[y][x] = a[y]+b[x], e.g.
+// the pyramidal blurs). As all the arithmetic is with integers, the
+// result is exactly the same as applying the full matrix.
+void ConvolutionMatrixFilter::calculateSeparableTerms()
+{
+  m_terms.clear();
+  if (!m_matrix)
+    return;
+
+  const ConvolutionMatrix* matrix = m_matrix;
+  int w = matrix->getWidth();
+  int h = matrix->getHeight();
+  int x, y;
+
+  // Look for a non-zero value as pivot
+  int px = -1, py = -1;
+  for (y=0; y<h && py < 0; ++y)
+    for (x=0; x<w; ++x)
+      if (matrix->value(x, y) != 0) {
+        px = x;
+        py = y;
+        break;
+      }
+  if (py < 0)
+    return;
+
+  // Rank-1: use the pivot's row (divided by its GCD) as column weights
+  SeparableTerm term;
+  int gcd = 0;
+  for (x=0; x<w; ++x) {
+    int a = ABS(matrix->value(x, py)), b = gcd;
+    while (b) { int t = a % b; a = b; b = t; }
+    gcd = a;
+  }
+
+  bool rank1 = true;
+  term.colWeights.resize(w);
+  term.rowWeights.resize(h);
+  for (x=0; x<w; ++x)
+    term.colWeights[x] = matrix->value(x, py) / gcd;
+  for (y=0; y<h && rank1; ++y) {
+    if (matrix->value(px, y) % term.colWeights[px] != 0)
+      rank1 = false;
+    else {
+      term.rowWeights[y] = matrix->value(px, y) / term.colWeights[px];
+      for (x=0; x<w; ++x)
+        if (matrix->value(x, y) != term.rowWeights[y] * term.colWeights[x]) {
+          rank1 = false;
+          break;
+        }
+    }
+  }
+
+  if (rank1) {
+    term.uniformCols = is_uniform(term.colWeights);
+    m_terms.push_back(term);
+  }
+  else {
+    // Additive: M[y][x] = M[y][0] + (M[0][x] - M[0][0])
+    for (y=0; y<h; ++y)
+      for (x=0; x<w; ++x)
+        if (matrix->value(x, y) != matrix->value(0, y) + matrix->value(x, 0) - matrix->value(0, 0))
+          return;
+
+    SeparableTerm rows, cols;
+    rows.rowWeights.resize(h);
+    rows.colWeights.resize(w, 1);
+    rows.uniformCols = true;
+    cols.rowWeights.resize(h, 1);
+    cols.colWeights.resize(w);
+    for (y=0; y<h; ++y)
+      rows.rowWeights[y] = matrix->value(0, y);
+    for (x=0; x<w; ++x)
+      cols.colWeights[x] = matrix->value(x, 0) - matrix->value(0, 0);
+    cols.uniformCols = is_uniform(cols.colWeights);
+
+    m_terms.push_back(rows);
+    m_terms.push_back(cols);
+  }
+
+  // Use the terms only if they need less operations than the full matrix
+  if ((int)m_terms.size()*(w+h) >= w*h)
+    m_terms.clear();
+}
+
+// Calculates the GetChannels sums of the matrix for each pixel of
+// the [x,x+width) span of the "y" row using the separable terms. For
+// each term, the source columns are accumulated vertically with the
+// row weights, and then the column sums are convolved horizontally
+// (using running sums when all column weights are equal).
+template<typename Traits, typename GetChannels>
+void ConvolutionMatrixFilter::calculateSeparableSums(const Image* src, int x, int y, int width,
+                                                     GetChannels& getChannels,
+                                                     std::vector<int>* sums) const
+{
+  const int N = GetChannels::N;
+  int mw = m_matrix->getWidth();
+  int mh = m_matrix->getHeight();
+  int ncols = width + mw - 1;
+  bool tiledX = (m_tiledMode & TILED_X_AXIS) ? true: false;
+  bool tiledY = (m_tiledMode & TILED_Y_AXIS) ? true: false;
+  int values[N];
+  int c, i, u, v;
+
+  // Source column/row of each column/row of the window
+  std::vector<int> srcX(ncols);
+  for (i=0; i<ncols; ++i)
+    srcX[i] = get_neighboring_coord(x - m_matrix->getCenterX() + i, src->getWidth(), tiledX);
+
+  std::vector<typename Traits::const_address_t> srcRows(mh);
+  for (v=0; v<mh; ++v)
+    srcRows[v] = reinterpret_cast<typename Traits::const_address_t>
+      (src->getPixelAddress(0, get_neighboring_coord(y - m_matrix->getCenterY() + v,
+                                                     src->getHeight(), tiledY)));
+
+  // Vertical pass: column sums of each term (N values per column)
+  std::vector<std::vector<int> > columns(m_terms.size(), std::vector<int>(N*ncols, 0));
+  for (v=0; v<mh; ++v) {
+    for (i=0; i<ncols; ++i) {
+      getChannels(srcRows[v][srcX[i]], values);
+
+      for (size_t t=0; t<m_terms.size(); ++t) {
+        int weight = m_terms[t].rowWeights[v];
+        if (weight != 0) {
+          int* column = &columns[t][i*N];
+          for (c=0; c<N; ++c)
+            column[c] += weight * values[c];
+        }
+      }
+    }
+  }
+
+  // Horizontal pass
+  std::vector<int> sum(N*width, 0);
+  for (size_t t=0; t<m_terms.size(); ++t) {
+    const SeparableTerm& term = m_terms[t];
+    const int* column = &columns[t][0];
+
+    if (term.uniformCols) {
+      int weight = term.colWeights[0];
+      int running[N];
+      for (c=0; c<N; ++c) {
+        running[c] = 0;
+        for (u=0; u<mw-1; ++u)
+          running[c] += column[u*N+c];
+      }
+      for (i=0; i<width; ++i) {
+        for (c=0; c<N; ++c) {
+          running[c] += column[(i+mw-1)*N+c];
+          sum[i*N+c] += weight * running[c];
+          running[c] -= column[i*N+c];
+        }
+      }
+    }
+    else {
+      for (u=0; u<mw; ++u) {
+        int weight = term.colWeights[u];
+        if (weight == 0)
+          continue;
+
+        const int* shifted = &column[u*N];
+        for (i=0; i<N*width; ++i)
+          sum[i] += weight * shifted[i];
+      }
+    }
+  }
+
+  for (c=0; c<N; ++c) {
+    sums[c].resize(width);
+    for (i=0; i<width; ++i)
+      sums[c][i] = sum[i*N+c];
+  }
+}
+
 const char* ConvolutionMatrixFilter::getName()
 {
   return "Convolution Matrix";
@@ -158,8 +401,15 @@ void ConvolutionMatrixFilter::applyToRgba(FilterManager* filterMgr)
   int x = filterMgr->getX();
   int x2 = x+filterMgr->getWidth();
   int y = filterMgr->getY();
+  std::vector<int> sums[GetChannelsRgba::N];
+  bool separable = !m_terms.empty();
+
+  if (separable) {
+    GetChannelsRgba getChannels;
+    calculateSeparableSums<RgbTraits>(src, x, y, x2-x, getChannels, sums);
+  }
 
-  for (; x<x2; ++x) {
+  for (int i=0; x<x2; ++x, ++i) {
     // Avoid the non-selected region
     if (filterMgr->skipPixel()) {
       ++dst_address;
@@ -167,12 +417,20 @@ void ConvolutionMatrixFilter::applyToRgba(FilterManager* filterMgr)
     }
 
     delegate.reset(m_matrix);
-    get_neighboring_pixels<RgbTraits>(src, x, y,
-                                      m_matrix->getWidth(),
-                                      m_matrix->getHeight(),
-                                      m_matrix->getCenterX(),
-                                      m_matrix->getCenterY(),
-                                      m_tiledMode, delegate);
+    if (separable) {
+      delegate.r = sums[0][i];
+      delegate.g = sums[1][i];
+      delegate.b = sums[2][i];
+      delegate.a = sums[3][i];
+      delegate.div -= sums[4][i];
+    }
+    else
+      get_neighboring_pixels<RgbTraits>(src, x, y,
+                                        m_matrix->getWidth(),
+                                        m_matrix->getHeight(),
+                                        m_matrix->getCenterX(),
+                                        m_matrix->getCenterY(),
+                                        m_tiledMode, delegate);
 
     color = get_pixel_fast<RgbTraits>(src, x, y);
     if (delegate.div == 0) {
@@ -225,8 +483,15 @@ void ConvolutionMatrixFilter::applyToGrayscale(FilterManager* filterMgr)
   int x = filterMgr->getX();
   int x2 = x+filterMgr->getWidth();
   int y = filterMgr->getY();
+  std::vector<int> sums[GetChannelsGrayscale::N];
+  bool separable = !m_terms.empty();
 
-  for (; x<x2; ++x) {
+  if (separable) {
+    GetChannelsGrayscale getChannels;
+    calculateSeparableSums<GrayscaleTraits>(src, x, y, x2-x, getChannels, sums);
+  }
+
+  for (int i=0; x<x2; ++x, ++i) {
     // Avoid the non-selected region
     if (filterMgr->skipPixel()) {
       ++dst_address;
@@ -234,12 +499,18 @@ void ConvolutionMatrixFilter::applyToGrayscale(FilterManager* filterMgr)
     }
 
     delegate.reset(m_matrix);
-    get_neighboring_pixels<GrayscaleTraits>(src, x, y,
-                                            m_matrix->getWidth(),
-                                            m_matrix->getHeight(),
-                                            m_matrix->getCenterX(),
-                                            m_matrix->getCenterY(),
-                                            m_tiledMode, delegate);
+    if (separable) {
+      delegate.v = sums[0][i];
+      delegate.a = sums[1][i];
+      delegate.div -= sums[2][i];
+    }
+    else
+      get_neighboring_pixels<GrayscaleTraits>(src, x, y,
+                                              m_matrix->getWidth(),
+                                              m_matrix->getHeight(),
+                                              m_matrix->getCenterX(),
+                                              m_matrix->getCenterY(),
+                                              m_tiledMode, delegate);
 
     color = get_pixel_fast<GrayscaleTraits>(src, x, y);
     if (delegate.div == 0) {
@@ -280,8 +551,15 @@ void ConvolutionMatrixFilter::applyToIndexed(FilterManager* filterMgr)
   int x = filterMgr->getX();
   int x2 = x+filterMgr->getWidth();
   int y = filterMgr->getY();
+  std::vector<int> sums[GetChannelsIndexed::N];
+  bool separable = !m_terms.empty();
+
+  if (separable) {
+    GetChannelsIndexed getChannels(pal);
+    calculateSeparableSums<IndexedTraits>(src, x, y, x2-x, getChannels, sums);
+  }
 
-  for (; x<x2; ++x) {
+  for (int i=0; x<x2; ++x, ++i) {
     // Avoid the non-selected region
     if (filterMgr->skipPixel()) {
       ++dst_address;
@@ -289,12 +567,19 @@ void ConvolutionMatrixFilter::applyToIndexed(FilterManager* filterMgr)
     }
 
     delegate.reset(m_matrix);
-    get_neighboring_pixels<IndexedTraits>(src, x, y,
-                                          m_matrix->getWidth(),
-                                          m_matrix->getHeight(),
-                                          m_matrix->getCenterX(),
-                                          m_matrix->getCenterY(),
-                                          m_tiledMode, delegate);
+    if (separable) {
+      delegate.r = sums[0][i];
+      delegate.g = sums[1][i];
+      delegate.b = sums[2][i];
+      delegate.index = sums[3][i];
+    }
+    else
+      get_neighboring_pixels<IndexedTraits>(src, x, y,
+                                            m_matrix->getWidth(),
+                                            m_matrix->getHeight(),
+                                            m_matrix->getCenterX(),
+                                            m_matrix->getCenterY(),
+                                            m_tiledMode, delegate);
 
     color = get_pixel_fast<IndexedTraits>(src, x, y);
     if (delegate.div == 0) {
@@ -26,6 +26,10 @@
 #include "filters/filter.h"
 #include "filters/tiled_mode.h"
 
+namespace raster {
+  class Image;
+}
+
 namespace filters {
 
   class ConvolutionMatrix;
@@ -45,11 +49,28 @@ namespace filters {
     void applyToRgba(FilterManager* filterMgr);
     void applyToGrayscale(FilterManager* filterMgr);
     void applyToIndexed(FilterManager* filterMgr);
+    bool isThreadSafe() { return true; }
 
   private:
+    // A rank-1 matrix (rowWeights * colWeights^T). The matrix is
+    // applied as the sum of these terms (when it's possible to
+    // decompose it), each one as a vertical and a horizontal 1D pass.
+    struct SeparableTerm {
+      std::vector<int> rowWeights;
+      std::vector<int> colWeights;
+      bool uniformCols;         // All colWeights are equal (box sums)
+    };
+
+    void calculateSeparableTerms();
+
+    template<typename Traits, typename GetChannels>
+    void calculateSeparableSums(const raster::Image* src, int x, int y, int width,
+                                GetChannels& getChannels,
+                                std::vector<int>* sums) const;
+
     SharedPtr<ConvolutionMatrix> m_matrix;
     TiledMode m_tiledMode;
-    std::vector<uint8_t*> m_lines;
+    std::vector<SeparableTerm> m_terms;
   };
 
 } // namespace filters
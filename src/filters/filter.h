@@ -49,6 +49,12 @@ namespace filters {
     // each pixel.
     virtual void applyToIndexed(FilterManager* filterMgr) = 0;
 
+    // Returns true if the applyTo...() member functions can be called
+    // from different threads at the same time (each thread with its
+    // own FilterManager to process different rows). In this case the
+    // filter must not modify its own state while it is applied.
+    virtual bool isThreadSafe() { return false; }
+
   };
 
 } // namespace filters
@@ -20,17 +20,20 @@
 #define FILTERS_INVERT_COLOR_FILTER_H_INCLUDED
 #pragma once
 
-#include "filters/filter.h"
+#include "filters/point_filter.h"
 
 namespace filters {
 
-  class InvertColorFilter : public Filter {
+  class InvertColorFilter : public PointFilter {
   public:
+    InvertColorFilter();
+
     // Filter implementation
     const char* getName();
-    void applyToRgba(FilterManager* filterMgr);
-    void applyToGrayscale(FilterManager* filterMgr);
-    void applyToIndexed(FilterManager* filterMgr);
+
+  protected:
+    // PointFilter implementation
+    int mapChannel(Channel channel, int value);
   };
 
 } // namespace filters
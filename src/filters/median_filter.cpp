@@ -39,72 +39,177 @@ namespace filters {
 using namespace raster;
 
 namespace {
-  struct GetPixelsDelegateRgba {
-    std::vector<std::vector<uint8_t> >& channel;
-    int c;
 
-    GetPixelsDelegateRgba(std::vector<std::vector<uint8_t> >& channel) : channel(channel) { }
+  // Histogram of the values of one 8-bit channel inside the window.
+  // The median is tracked incrementally (Huang's algorithm): we keep
+  // the current median and the number of values below it, so after
+  // adding/removing a column of the window the median moves only a
+  // few positions.
+  class ChannelHistogram {
+  public:
+    void reset(int rank) {
+      std::fill(m_hist, m_hist+256, 0);
+      m_rank = rank;
+      m_median = 0;
+      m_lessThanMedian = 0;
+    }
 
-    void reset() { c = 0; }
+    void add(int value) {
+      ++m_hist[value];
+      if (value < m_median)
+        ++m_lessThanMedian;
+    }
 
-    void operator()(RgbTraits::pixel_t color)
-    {
-      channel[0][c] = rgba_getr(color);
-      channel[1][c] = rgba_getg(color);
-      channel[2][c] = rgba_getb(color);
-      channel[3][c] = rgba_geta(color);
-      c++;
+    void remove(int value) {
+      --m_hist[value];
+      if (value < m_median)
+        --m_lessThanMedian;
+    }
+
+    // Returns the "rank"-th value of the sorted window.
+    int median() {
+      while (m_lessThanMedian > m_rank) {
+        --m_median;
+        m_lessThanMedian -= m_hist[m_median];
+      }
+      while (m_lessThanMedian + m_hist[m_median] <= m_rank) {
+        m_lessThanMedian += m_hist[m_median];
+        ++m_median;
+      }
+      return m_median;
     }
+
+  private:
+    int m_hist[256];
+    int m_rank;
+    int m_median;
+    int m_lessThanMedian;
   };
 
-  struct GetPixelsDelegateGrayscale {
-    std::vector<std::vector<uint8_t> >& channel;
-    int c;
+  // Window of width*height pixels which slides through a row of the
+  // image, keeping one histogram per channel. When the window moves
+  // one pixel to the right, the leaving column is removed from the
+  // histograms and the entering column is added, so each pixel costs
+  // O(height) histogram updates instead of sorting width*height
+  // values.
+  //
+  // GetChannels must have a "void operator()(pixel_t color, int values[])"
+  // member function which fills the channel values of the pixel.
+  template<typename Traits, typename GetChannels>
+  class MedianWindow {
+  public:
+    enum { kMaxChannels = 4 };
+
+    MedianWindow(const Image* src, int x, int y,
+                 int width, int height, TiledMode tiledMode,
+                 const bool* channels, GetChannels& getChannels)
+      : m_src(src)
+      , m_width(width)
+      , m_x(x - width/2)
+      , m_tiledX((tiledMode & TILED_X_AXIS) ? true: false)
+      , m_channels(channels)
+      , m_getChannels(getChannels)
+      , m_rows(height)
+    {
+      bool tiledY = (tiledMode & TILED_Y_AXIS) ? true: false;
+
+      for (int v=0; v<height; ++v)
+        m_rows[v] = reinterpret_cast<typename Traits::const_address_t>
+          (src->getPixelAddress(0, get_neighboring_coord(y - height/2 + v,
+                                                         src->getHeight(), tiledY)));
+
+      for (int c=0; c<kMaxChannels; ++c)
+        m_hist[c].reset(width*height/2);
+
+      for (int u=0; u<width; ++u)
+        updateColumn(m_x+u, 1);
+    }
+
+    int median(int channel) {
+      return m_hist[channel].median();
+    }
+
+    // Moves the window one pixel to the right.
+    void next() {
+      updateColumn(m_x, -1);
+      updateColumn(m_x+m_width, 1);
+      ++m_x;
+    }
 
-    GetPixelsDelegateGrayscale(std::vector<std::vector<uint8_t> >& channel) : channel(channel) { }
+  private:
+    void updateColumn(int u, int delta) {
+      int values[kMaxChannels];
 
-    void reset() { c = 0; }
+      u = get_neighboring_coord(u, m_src->getWidth(), m_tiledX);
+
+      for (size_t v=0; v<m_rows.size(); ++v) {
+        m_getChannels(m_rows[v][u], values);
+
+        for (int c=0; c<kMaxChannels; ++c) {
+          if (m_channels[c]) {
+            if (delta > 0)
+              m_hist[c].add(values[c]);
+            else
+              m_hist[c].remove(values[c]);
+          }
+        }
+      }
+    }
+
+    const Image* m_src;
+    int m_width;
+    int m_x;                    // Left column of the window
+    bool m_tiledX;
+    const bool* m_channels;     // Channels to be calculated
+    GetChannels& m_getChannels;
+    std::vector<typename Traits::const_address_t> m_rows;
+    ChannelHistogram m_hist[kMaxChannels];
+  };
+
+  struct GetChannelsRgba {
+    void operator()(RgbTraits::pixel_t color, int values[])
+    {
+      values[0] = rgba_getr(color);
+      values[1] = rgba_getg(color);
+      values[2] = rgba_getb(color);
+      values[3] = rgba_geta(color);
+    }
+  };
 
-    void operator()(GrayscaleTraits::pixel_t color)
+  struct GetChannelsGrayscale {
+    void operator()(GrayscaleTraits::pixel_t color, int values[])
     {
-      channel[0][c] = graya_getv(color);
-      channel[1][c] = graya_geta(color);
-      c++;
+      values[0] = graya_getv(color);
+      values[1] = graya_geta(color);
     }
   };
 
-  struct GetPixelsDelegateIndexed {
+  struct GetChannelsIndexed {
     const Palette* pal;
-    std::vector<std::vector<uint8_t> >& channel;
     Target target;
-    int c;
-
-    GetPixelsDelegateIndexed(const Palette* pal, std::vector<std::vector<uint8_t> >& channel, Target target)
-      : pal(pal), channel(channel), target(target) { }
 
-    void reset() { c = 0; }
+    GetChannelsIndexed(const Palette* pal, Target target)
+      : pal(pal), target(target) { }
 
-    void operator()(IndexedTraits::pixel_t color)
+    void operator()(IndexedTraits::pixel_t color, int values[])
     {
       if (target & TARGET_INDEX_CHANNEL) {
-        channel[0][c] = color;
+        values[0] = color;
       }
       else {
-        channel[0][c] = rgba_getr(pal->getEntry(color));
-        channel[1][c] = rgba_getg(pal->getEntry(color));
-        channel[2][c] = rgba_getb(pal->getEntry(color));
+        values[0] = rgba_getr(pal->getEntry(color));
+        values[1] = rgba_getg(pal->getEntry(color));
+        values[2] = rgba_getb(pal->getEntry(color));
       }
-      c++;
     }
   };
-};
+
+} // anonymous namespace
 
 MedianFilter::MedianFilter()
   : m_tiledMode(TILED_NONE)
   , m_width(0)
   , m_height(0)
-  , m_ncolors(0)
-  , m_channel(4)
 {
 }
 
@@ -117,10 +222,6 @@ void MedianFilter::setSize(int width, int height)
 {
   m_width = width;
   m_height = height;
-  m_ncolors = width*height;
-
-  for (int c = 0; c < 4; ++c)
-    m_channel[c].resize(m_ncolors);
 }
 
 const char* MedianFilter::getName()
@@ -135,51 +236,31 @@ void MedianFilter::applyToRgba(FilterManager* filterMgr)
   Target target = filterMgr->getTarget();
   int color;
   int r, g, b, a;
-  GetPixelsDelegateRgba delegate(m_channel);
   int x = filterMgr->getX();
   int x2 = x+filterMgr->getWidth();
   int y = filterMgr->getY();
-
-  for (; x<x2; ++x) {
+  bool channels[4] = {
+    (target & TARGET_RED_CHANNEL) ? true: false,
+    (target & TARGET_GREEN_CHANNEL) ? true: false,
+    (target & TARGET_BLUE_CHANNEL) ? true: false,
+    (target & TARGET_ALPHA_CHANNEL) ? true: false };
+  GetChannelsRgba getChannels;
+  MedianWindow<RgbTraits, GetChannelsRgba> window(src, x, y, m_width, m_height,
+                                                   m_tiledMode, channels, getChannels);
+
+  for (; x<x2; ++x, window.next()) {
     // Avoid the non-selected region
     if (filterMgr->skipPixel()) {
       ++dst_address;
       continue;
     }
 
-    delegate.reset();
-    get_neighboring_pixels<RgbTraits>(src, x, y, m_width, m_height, m_width/2, m_height/2,
-                                      m_tiledMode, delegate);
-
     color = get_pixel_fast<RgbTraits>(src, x, y);
 
-    if (target & TARGET_RED_CHANNEL) {
-      std::sort(m_channel[0].begin(), m_channel[0].end());
-      r = m_channel[0][m_ncolors/2];
-    }
-    else
-      r = rgba_getr(color);
-
-    if (target & TARGET_GREEN_CHANNEL) {
-      std::sort(m_channel[1].begin(), m_channel[1].end());
-      g = m_channel[1][m_ncolors/2];
-    }
-    else
-      g = rgba_getg(color);
-
-    if (target & TARGET_BLUE_CHANNEL) {
-      std::sort(m_channel[2].begin(), m_channel[2].end());
-      b = m_channel[2][m_ncolors/2];
-    }
-    else
-      b = rgba_getb(color);
-
-    if (target & TARGET_ALPHA_CHANNEL) {
-      std::sort(m_channel[3].begin(), m_channel[3].end());
-      a = m_channel[3][m_ncolors/2];
-    }
-    else
-      a = rgba_geta(color);
+    r = (channels[0] ? window.median(0): rgba_getr(color));
+    g = (channels[1] ? window.median(1): rgba_getg(color));
+    b = (channels[2] ? window.median(2): rgba_getb(color));
+    a = (channels[3] ? window.median(3): rgba_geta(color));
 
     *(dst_address++) = rgba(r, g, b, a);
   }
@@ -191,37 +272,28 @@ void MedianFilter::applyToGrayscale(FilterManager* filterMgr)
   uint16_t* dst_address = (uint16_t*)filterMgr->getDestinationAddress();
   Target target = filterMgr->getTarget();
   int color, k, a;
-  GetPixelsDelegateGrayscale delegate(m_channel);
   int x = filterMgr->getX();
   int x2 = x+filterMgr->getWidth();
   int y = filterMgr->getY();
-
-  for (; x<x2; ++x) {
+  bool channels[4] = {
+    (target & TARGET_GRAY_CHANNEL) ? true: false,
+    (target & TARGET_ALPHA_CHANNEL) ? true: false,
+    false, false };
+  GetChannelsGrayscale getChannels;
+  MedianWindow<GrayscaleTraits, GetChannelsGrayscale> window(src, x, y, m_width, m_height,
+                                                             m_tiledMode, channels, getChannels);
+
+  for (; x<x2; ++x, window.next()) {
     // Avoid the non-selected region
     if (filterMgr->skipPixel()) {
       ++dst_address;
       continue;
     }
 
-    delegate.reset();
-    get_neighboring_pixels<GrayscaleTraits>(src, x, y, m_width, m_height, m_width/2, m_height/2,
-                                            m_tiledMode, delegate);
-
     color = get_pixel_fast<GrayscaleTraits>(src, x, y);
 
-    if (target & TARGET_GRAY_CHANNEL) {
-      std::sort(m_channel[0].begin(), m_channel[0].end());
-      k = m_channel[0][m_ncolors/2];
-    }
-    else
-      k = graya_getv(color);
-
-    if (target & TARGET_ALPHA_CHANNEL) {
-      std::sort(m_channel[1].begin(), m_channel[1].end());
-      a = m_channel[1][m_ncolors/2];
-    }
-    else
-      a = graya_geta(color);
+    k = (channels[0] ? window.median(0): graya_getv(color));
+    a = (channels[1] ? window.median(1): graya_geta(color));
 
     *(dst_address++) = graya(k, a);
   }
@@ -235,49 +307,40 @@ void MedianFilter::applyToIndexed(FilterManager* filterMgr)
   const RgbMap* rgbmap = filterMgr->getIndexedData()->getRgbMap();
   Target target = filterMgr->getTarget();
   int color, r, g, b;
-  GetPixelsDelegateIndexed delegate(pal, m_channel, target);
   int x = filterMgr->getX();
   int x2 = x+filterMgr->getWidth();
   int y = filterMgr->getY();
+  bool channels[4];
+  if (target & TARGET_INDEX_CHANNEL) {
+    channels[0] = true;
+    channels[1] = channels[2] = false;
+  }
+  else {
+    channels[0] = (target & TARGET_RED_CHANNEL) ? true: false;
+    channels[1] = (target & TARGET_GREEN_CHANNEL) ? true: false;
+    channels[2] = (target & TARGET_BLUE_CHANNEL) ? true: false;
+  }
+  channels[3] = false;
+  GetChannelsIndexed getChannels(pal, target);
+  MedianWindow<IndexedTraits, GetChannelsIndexed> window(src, x, y, m_width, m_height,
+                                                         m_tiledMode, channels, getChannels);
 
-  for (; x<x2; ++x) {
+  for (; x<x2; ++x, window.next()) {
     // Avoid the non-selected region
     if (filterMgr->skipPixel()) {
       ++dst_address;
       continue;
     }
 
-    delegate.reset();
-    get_neighboring_pixels<IndexedTraits>(src, x, y, m_width, m_height, m_width/2, m_height/2,
-                                          m_tiledMode, delegate);
-
     if (target & TARGET_INDEX_CHANNEL) {
-      std::sort(m_channel[0].begin(), m_channel[0].end());
-      *(dst_address++) = m_channel[0][m_ncolors/2];
+      *(dst_address++) = window.median(0);
     }
     else {
       color = get_pixel_fast<IndexedTraits>(src, x, y);
 
-      if (target & TARGET_RED_CHANNEL) {
-        std::sort(m_channel[0].begin(), m_channel[0].end());
-        r = m_channel[0][m_ncolors/2];
-      }
-      else
-        r = rgba_getr(pal->getEntry(color));
-
-      if (target & TARGET_GREEN_CHANNEL) {
-        std::sort(m_channel[1].begin(), m_channel[1].end());
-        g = m_channel[1][m_ncolors/2];
-      }
-      else
-        g = rgba_getg(pal->getEntry(color));
-
-      if (target & TARGET_BLUE_CHANNEL) {
-        std::sort(m_channel[2].begin(), m_channel[2].end());
-        b = m_channel[2][m_ncolors/2];
-      }
-      else
-        b = rgba_getb(pal->getEntry(color));
+      r = (channels[0] ? window.median(0): rgba_getr(pal->getEntry(color)));
+      g = (channels[1] ? window.median(1): rgba_getg(pal->getEntry(color)));
+      b = (channels[2] ? window.median(2): rgba_getb(pal->getEntry(color)));
 
       *(dst_address++) = rgbmap->mapColor(r, g, b);
     }
@@ -29,6 +29,20 @@
 namespace filters {
   using namespace raster;
 
+  // Returns the coordinate of the pixel to be used as neighbor in the
+  // "u" position of an axis with "size" pixels. Coordinates outside
+  // the image are wrapped (in tiled mode) or clamped to the edge (in
+  // the same way as get_neighboring_pixels() does).
+  inline int get_neighboring_coord(int u, int size, bool tiled)
+  {
+    if (u < 0)
+      return (tiled ? size - (-(u+1) % size) - 1: 0);
+    else if (u >= size)
+      return (tiled ? u % size: size-1);
+    else
+      return u;
+  }
+
   // Calls the specified "delegate" for all neighboring pixels in a 2D
   // (width*height) matrix located in (x,y) where its center is the
   // (centerX,centerY) element of the matrix.
@@ -41,6 +55,23 @@ namespace filters {
   {
     int dx, dy;
 
+    // Fast path: all the matrix is inside the image (so we don't need
+    // to check the tiled mode or clamp coordinates for each pixel).
+    int x1 = x - centerX;
+    int y1 = y - centerY;
+    if (x1 >= 0 && y1 >= 0 &&
+        x1+width <= sourceImage->getWidth() &&
+        y1+height <= sourceImage->getHeight()) {
+      for (dy=0; dy<height; ++dy) {
+        typename Traits::const_address_t srcAddress =
+          reinterpret_cast<typename Traits::const_address_t>(sourceImage->getPixelAddress(x1, y1+dy));
+
+        for (dx=0; dx<width; ++dx)
+          delegate(*srcAddress++);
+      }
+      return;
+    }
+
     // Y position to get pixel.
     int getx, gety = y - centerY;
     int addx, addy = 0;
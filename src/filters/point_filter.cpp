@@ -0,0 +1,200 @@
+/* Aseprite
+ * Copyright (C) 2001-2013  David Capello
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "filters/point_filter.h"
+
+#include <cstring>
+
+#include "base/scoped_lock.h"
+#include "filters/filter_indexed_data.h"
+#include "filters/filter_manager.h"
+#include "raster/image.h"
+#include "raster/palette.h"
+#include "raster/rgbmap.h"
+
+namespace filters {
+
+using namespace raster;
+
+namespace {
+
+  // Table used for channels which aren't in the target.
+  class IdentityLut {
+  public:
+    IdentityLut() {
+      for (int c=0; c<256; ++c)
+        m_lut[c] = c;
+    }
+    operator const uint8_t*() const { return m_lut; }
+  private:
+    uint8_t m_lut[256];
+  };
+
+  const IdentityLut identity_lut;
+
+}
+
+PointFilter::PointFilter()
+  : m_indexMap(256)
+  , m_indexMapValid(false)
+  , m_indexMapPalette(NULL)
+  , m_indexMapModifications(0)
+  , m_indexMapRgbMap(NULL)
+  , m_indexMapTarget(0)
+{
+  for (int i=0; i<ChannelCount; ++i)
+    std::memcpy(m_lut[i], identity_lut, 256);
+}
+
+void PointFilter::updateLuts()
+{
+  for (int i=0; i<ChannelCount; ++i)
+    for (int c=0; c<256; ++c)
+      m_lut[i][c] = MID(0, mapChannel((Channel)i, c), 255);
+
+  base::scoped_lock hold(m_indexMapMutex);
+  m_indexMapValid = false;
+}
+
+void PointFilter::applyToRgba(FilterManager* filterMgr)
+{
+  const uint32_t* src_address = (uint32_t*)filterMgr->getSourceAddress();
+  uint32_t* dst_address = (uint32_t*)filterMgr->getDestinationAddress();
+  int w = filterMgr->getWidth();
+  Target target = filterMgr->getTarget();
+  const uint8_t* rmap = (target & TARGET_RED_CHANNEL ? m_lut[RedChannel]: identity_lut);
+  const uint8_t* gmap = (target & TARGET_GREEN_CHANNEL ? m_lut[GreenChannel]: identity_lut);
+  const uint8_t* bmap = (target & TARGET_BLUE_CHANNEL ? m_lut[BlueChannel]: identity_lut);
+  const uint8_t* amap = (target & TARGET_ALPHA_CHANNEL ? m_lut[AlphaChannel]: identity_lut);
+  int x, c;
+
+  for (x=0; x<w; x++) {
+    if (filterMgr->skipPixel()) {
+      ++src_address;
+      ++dst_address;
+      continue;
+    }
+
+    c = *(src_address++);
+
+    *(dst_address++) = rgba(rmap[rgba_getr(c)],
+                            gmap[rgba_getg(c)],
+                            bmap[rgba_getb(c)],
+                            amap[rgba_geta(c)]);
+  }
+}
+
+void PointFilter::applyToGrayscale(FilterManager* filterMgr)
+{
+  const uint16_t* src_address = (uint16_t*)filterMgr->getSourceAddress();
+  uint16_t* dst_address = (uint16_t*)filterMgr->getDestinationAddress();
+  int w = filterMgr->getWidth();
+  Target target = filterMgr->getTarget();
+  const uint8_t* kmap = (target & TARGET_GRAY_CHANNEL ? m_lut[GrayChannel]: identity_lut);
+  const uint8_t* amap = (target & TARGET_ALPHA_CHANNEL ? m_lut[AlphaChannel]: identity_lut);
+  int x, c;
+
+  for (x=0; x<w; x++) {
+    if (filterMgr->skipPixel()) {
+      ++src_address;
+      ++dst_address;
+      continue;
+    }
+
+    c = *(src_address++);
+
+    *(dst_address++) = graya(kmap[graya_getv(c)],
+                             amap[graya_geta(c)]);
+  }
+}
+
+void PointFilter::applyToIndexed(FilterManager* filterMgr)
+{
+  const uint8_t* src_address = (uint8_t*)filterMgr->getSourceAddress();
+  uint8_t* dst_address = (uint8_t*)filterMgr->getDestinationAddress();
+  int w = filterMgr->getWidth();
+  uint8_t map[256];
+  int x;
+
+  // Each index is converted to the index of its filtered palette entry.
+  getIndexMap(filterMgr->getIndexedData()->getPalette(),
+              filterMgr->getIndexedData()->getRgbMap(),
+              filterMgr->getTarget(), map);
+
+  for (x=0; x<w; x++) {
+    if (filterMgr->skipPixel()) {
+      ++src_address;
+      ++dst_address;
+      continue;
+    }
+
+    *(dst_address++) = map[*(src_address++)];
+  }
+}
+
+void PointFilter::getIndexMap(const Palette* pal, const RgbMap* rgbmap,
+                              Target target, uint8_t* map)
+{
+  base::scoped_lock hold(m_indexMapMutex);
+
+  if (!m_indexMapValid ||
+      m_indexMapPalette != pal ||
+      m_indexMapModifications != pal->getModifications() ||
+      m_indexMapRgbMap != rgbmap ||
+      m_indexMapTarget != target) {
+    int size = pal->size();
+
+    for (int c=0; c<256; ++c) {
+      int i = c;
+
+      if (target & TARGET_INDEX_CHANNEL) {
+        // The index is mapped directly (as the old invert and curve
+        // filters did), even if it's outside the palette.
+        i = m_lut[IndexChannel][c];
+      }
+      else if (c < size) {
+        color_t color = pal->getEntry(c);
+        int r = rgba_getr(color);
+        int g = rgba_getg(color);
+        int b = rgba_getb(color);
+
+        if (target & TARGET_RED_CHANNEL) r = m_lut[RedChannel][r];
+        if (target & TARGET_GREEN_CHANNEL) g = m_lut[GreenChannel][g];
+        if (target & TARGET_BLUE_CHANNEL) b = m_lut[BlueChannel][b];
+
+        i = rgbmap->mapColor(r, g, b);
+      }
+
+      m_indexMap[c] = i;
+    }
+
+    m_indexMapValid = true;
+    m_indexMapPalette = pal;
+    m_indexMapModifications = pal->getModifications();
+    m_indexMapRgbMap = rgbmap;
+    m_indexMapTarget = target;
+  }
+
+  std::memcpy(map, &m_indexMap[0], 256);
+}
+
+} // namespace filters
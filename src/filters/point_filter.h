@@ -0,0 +1,91 @@
+/* Aseprite
+ * Copyright (C) 2001-2013  David Capello
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef FILTERS_POINT_FILTER_H_INCLUDED
+#define FILTERS_POINT_FILTER_H_INCLUDED
+#pragma once
+
+#include <vector>
+
+#include "base/mutex.h"
+#include "filters/filter.h"
+#include "filters/target.h"
+
+namespace raster {
+  class Palette;
+  class RgbMap;
+}
+
+namespace filters {
+
+  // A filter which modifies each channel of a pixel independently
+  // of the other channels and pixels (e.g. curves or invert color).
+  // Derived classes only say how each 8-bit value is converted, and
+  // the filter is applied through one lookup table per channel.
+  class PointFilter : public Filter {
+  public:
+    enum Channel {
+      RedChannel,
+      GreenChannel,
+      BlueChannel,
+      AlphaChannel,
+      GrayChannel,
+      IndexChannel,
+      ChannelCount
+    };
+
+    PointFilter();
+
+    // Returns the lookup table (256 entries) of the given channel.
+    const uint8_t* getLut(Channel channel) const { return m_lut[channel]; }
+
+    // Regenerates the lookup tables. Derived classes must call this
+    // member function each time their parameters change.
+    void updateLuts();
+
+    // Filter implementation
+    void applyToRgba(FilterManager* filterMgr);
+    void applyToGrayscale(FilterManager* filterMgr);
+    void applyToIndexed(FilterManager* filterMgr);
+    bool isThreadSafe() { return true; }
+
+  protected:
+    // Returns the new value (0-255) of the given channel value.
+    virtual int mapChannel(Channel channel, int value) = 0;
+
+  private:
+    void getIndexMap(const raster::Palette* pal,
+                     const raster::RgbMap* rgbmap,
+                     Target target, uint8_t* map);
+
+    uint8_t m_lut[ChannelCount][256];
+
+    // Result of applying the filter to each palette entry, cached
+    // for indexed images.
+    base::mutex m_indexMapMutex;
+    std::vector<uint8_t> m_indexMap;
+    bool m_indexMapValid;
+    const raster::Palette* m_indexMapPalette;
+    int m_indexMapModifications;
+    const raster::RgbMap* m_indexMapRgbMap;
+    Target m_indexMapTarget;
+  };
+
+} // namespace filters
+
+#endif
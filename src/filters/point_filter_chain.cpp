@@ -0,0 +1,52 @@
+/* Aseprite
+ * Copyright (C) 2001-2013  David Capello
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "filters/point_filter_chain.h"
+
+namespace filters {
+
+void PointFilterChain::addFilter(PointFilter* filter)
+{
+  ASSERT(filter != NULL);
+
+  m_filters.push_back(filter);
+  updateLuts();
+}
+
+const char* PointFilterChain::getName()
+{
+  if (m_filters.size() == 1)
+    return m_filters[0]->getName();
+  else
+    return "Filters";
+}
+
+int PointFilterChain::mapChannel(Channel channel, int value)
+{
+  for (std::vector<PointFilter*>::iterator
+         it = m_filters.begin(), end = m_filters.end(); it != end; ++it)
+    value = (*it)->getLut(channel)[value];
+
+  return value;
+}
+
+} // namespace filters
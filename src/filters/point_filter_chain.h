@@ -0,0 +1,54 @@
+/* Aseprite
+ * Copyright (C) 2001-2013  David Capello
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef FILTERS_POINT_FILTER_CHAIN_H_INCLUDED
+#define FILTERS_POINT_FILTER_CHAIN_H_INCLUDED
+#pragma once
+
+#include <vector>
+
+#include "filters/point_filter.h"
+
+namespace filters {
+
+  // Applies several point filters (in the order they were added) as
+  // one filter. The lookup tables of all filters are combined, so the
+  // image is processed just one time.
+  class PointFilterChain : public PointFilter {
+  public:
+    // Adds a filter at the end of the chain. The filter is not owned
+    // by the chain. If you modify its parameters later, you have to
+    // call PointFilterChain::updateLuts() again.
+    void addFilter(PointFilter* filter);
+
+    bool empty() const { return m_filters.empty(); }
+
+    // Filter implementation
+    const char* getName();
+
+  protected:
+    // PointFilter implementation
+    int mapChannel(Channel channel, int value);
+
+  private:
+    std::vector<PointFilter*> m_filters;
+  };
+
+} // namespace filters
+
+#endif
@@ -25,6 +25,7 @@
 
 #include "raster/image.h"
 #include "raster/image_traits.h"
+#include "raster/kmeans.h"
 #include "raster/median_cut.h"
 #include "raster/palette.h"
 
@@ -86,11 +87,47 @@ namespace quantization {
       }
     }
 
+    // Adds all the samples of "other" histogram to this one. Merging
+    // histograms filled with consecutive ranges of samples, in the
+    // same order, gives the same result as adding all samples to
+    // just one histogram.
+    void addHistogram(const ColorHistogram& other)
+    {
+      for (size_t i=0; i<m_histogram.size(); ++i) {
+        if (m_histogram[i] < std::numeric_limits<size_t>::max()-other.m_histogram[i]) // Avoid overflow
+          m_histogram[i] += other.m_histogram[i];
+        else
+          m_histogram[i] = std::numeric_limits<size_t>::max();
+      }
+
+      if (m_useHighPrecision) {
+        if (!other.m_useHighPrecision) {
+          m_useHighPrecision = false;
+          return;
+        }
+
+        for (size_t i=0; i<other.m_highPrecision.size(); ++i) {
+          uint32_t color = other.m_highPrecision[i];
+
+          if (std::find(m_highPrecision.begin(), m_highPrecision.end(), color) == m_highPrecision.end()) {
+            if (m_highPrecision.size() < 256) {
+              m_highPrecision.push_back(color);
+            }
+            else {
+              m_useHighPrecision = false;
+              break;
+            }
+          }
+        }
+      }
+    }
+
     // Creates a set of entries for the given palette in the given range
     // with the more important colors in the histogram. Returns the
     // number of used entries in the palette (maybe the range [from,to]
-    // is more than necessary).
-    int createOptimizedPalette(Palette* palette, int from, int to)
+    // is more than necessary). If "refinementIterations" is greater
+    // than zero, the median-cut palette is refined with k-means.
+    int createOptimizedPalette(Palette* palette, int from, int to, int refinementIterations = 0)
     {
       // Can we use the high-precision table?
       if (m_useHighPrecision && int(m_highPrecision.size()) <= (to-from+1)) {
@@ -105,6 +142,9 @@ namespace quantization {
         std::vector<uint32_t> result;
         median_cut(*this, to-from+1, result);
 
+        if (refinementIterations > 0)
+          kmeans_refine(getSamples(), result, refinementIterations);
+
         for (int i=0; i<(int)result.size(); ++i)
           palette->setEntry(from+i, result[i]);
 
@@ -113,6 +153,26 @@ namespace quantization {
     }
 
   private:
+    // Returns the color of each non-empty entry of the histogram (the
+    // same color that median_cut() uses for the entry).
+    std::vector<ColorSample> getSamples() const
+    {
+      std::vector<ColorSample> samples;
+
+      for (int k=0; k<BElements; ++k)
+        for (int j=0; j<GElements; ++j)
+          for (int i=0; i<RElements; ++i) {
+            size_t count = at(i, j, k);
+            if (count > 0)
+              samples.push_back(ColorSample(rgba(255 * i / (RElements-1),
+                                                 255 * j / (GElements-1),
+                                                 255 * k / (BElements-1), 255),
+                                            count));
+          }
+
+      return samples;
+    }
+
     // Converts input color in a index for the histogram. It reduces
     // each 8-bit component to the resolution given in the template
     // parameters.
@@ -0,0 +1,91 @@
+/* Aseprite
+ * Copyright (C) 2001-2013  David Capello
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <gtest/gtest.h>
+
+#include "raster/color_histogram.h"
+#include "raster/kmeans.h"
+
+#include <cstdlib>
+
+using namespace raster;
+using namespace raster::quantization;
+
+typedef ColorHistogram<5, 6, 5> Histogram;
+
+TEST(ColorHistogram, AddHistogram)
+{
+  std::srand(1);
+
+  // Few colors (high-precision table) and a lot of colors.
+  for (int ncolors=100; ncolors<=1000; ncolors*=10) {
+    std::vector<uint32_t> colors(5000);
+    for (int i=0; i<(int)colors.size(); ++i)
+      colors[i] = rgba(std::rand()%ncolors, std::rand()%2, 0, 255);
+
+    Histogram whole, part1, part2;
+    for (int i=0; i<(int)colors.size(); ++i) {
+      whole.addSamples(colors[i]);
+      if (i < 2000)
+        part1.addSamples(colors[i]);
+      else
+        part2.addSamples(colors[i]);
+    }
+
+    Histogram merged;
+    merged.addHistogram(part1);
+    merged.addHistogram(part2);
+
+    Palette pal1(FrameNumber(0), 256), pal2(FrameNumber(0), 256);
+    int n1 = whole.createOptimizedPalette(&pal1, 0, 255);
+    int n2 = merged.createOptimizedPalette(&pal2, 0, 255);
+    ASSERT_EQ(n1, n2);
+    for (int i=0; i<n1; ++i)
+      EXPECT_EQ(pal1.getEntry(i), pal2.getEntry(i));
+  }
+}
+
+TEST(ColorHistogram, KMeansRefine)
+{
+  // Two clusters of colors around (10,10,10) and (200,100,50).
+  std::vector<ColorSample> samples;
+  samples.push_back(ColorSample(rgba(8, 10, 12, 255), 1));
+  samples.push_back(ColorSample(rgba(12, 10, 8, 255), 1));
+  samples.push_back(ColorSample(rgba(196, 100, 50, 255), 3));
+  samples.push_back(ColorSample(rgba(212, 100, 50, 255), 1));
+
+  // Bad initial centers.
+  std::vector<uint32_t> colors;
+  colors.push_back(rgba(0, 0, 0, 255));
+  colors.push_back(rgba(100, 100, 100, 255));
+
+  kmeans_refine(samples, colors, 10);
+
+  EXPECT_EQ(rgba(10, 10, 10, 255), colors[0]);
+  EXPECT_EQ(rgba(200, 100, 50, 255), colors[1]);
+}
+
+int main(int argc, char** argv)
+{
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
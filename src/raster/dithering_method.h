@@ -26,6 +26,9 @@ namespace raster {
   enum DitheringMethod {
     DITHERING_NONE,
     DITHERING_ORDERED,
+    DITHERING_FLOYD_STEINBERG,
+    DITHERING_SIERRA_LITE,
+    DITHERING_ATKINSON,
   };
 
 } // namespace raster
@@ -0,0 +1,218 @@
+/* Aseprite
+ * Copyright (C) 2001-2013  David Capello
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+
+#include "raster/kmeans.h"
+
+#include "base/thread.h"
+#include "raster/color.h"
+
+#include <algorithm>
+#include <climits>
+#include <vector>
+
+namespace raster {
+namespace quantization {
+
+namespace {
+
+// The number of centers is rounded up to a multiple of this value
+// so the compiler can vectorize the loop that calculates distances.
+const int kCentersAlignment = 8;
+
+// Channel value of padding centers, far enough from any color to
+// never be the nearest center.
+const int kFarChannel = 4096;
+
+// Minimum number of samples to be processed by each thread.
+const int kSamplesPerThread = 4096;
+
+// Sums of the samples assigned to each center.
+struct ClusterSums {
+  std::vector<uint64_t> r, g, b, count;
+
+  explicit ClusterSums(int n) : r(n, 0), g(n, 0), b(n, 0), count(n, 0) { }
+
+  void add(const ClusterSums& other) {
+    for (int i=0; i<(int)count.size(); ++i) {
+      r[i] += other.r[i];
+      g[i] += other.g[i];
+      b[i] += other.b[i];
+      count[i] += other.count[i];
+    }
+  }
+};
+
+class KMeans {
+public:
+  KMeans(const std::vector<ColorSample>& samples, int ncolors, int nthreads)
+    : m_samples(samples)
+    , m_ncolors(ncolors)
+    , m_ncenters((ncolors+kCentersAlignment-1) / kCentersAlignment * kCentersAlignment)
+    , m_nthreads(nthreads)
+    , m_r(m_ncenters, kFarChannel)
+    , m_g(m_ncenters, kFarChannel)
+    , m_b(m_ncenters, kFarChannel)
+    , m_sums(nthreads, ClusterSums(m_ncenters)) {
+  }
+
+  void setCenters(const std::vector<uint32_t>& colors) {
+    for (int i=0; i<m_ncolors; ++i) {
+      m_r[i] = rgba_getr(colors[i]);
+      m_g[i] = rgba_getg(colors[i]);
+      m_b[i] = rgba_getb(colors[i]);
+    }
+  }
+
+  void getCenters(std::vector<uint32_t>& colors) const {
+    for (int i=0; i<m_ncolors; ++i)
+      colors[i] = rgba(m_r[i], m_g[i], m_b[i], 255);
+  }
+
+  // Assigns each sample to its nearest center and moves each center
+  // to the mean of its samples. Returns false if no center moved.
+  bool iterate() {
+    std::vector<base::thread*> threads(m_nthreads-1);
+
+    for (int i=0; i<m_nthreads-1; ++i)
+      threads[i] = new base::thread(&KMeans::thread_proxy, this, i+1);
+
+    assignSamples(0);
+
+    for (int i=0; i<m_nthreads-1; ++i) {
+      threads[i]->join();
+      delete threads[i];
+    }
+
+    // Integer sums give the same result whatever the number of
+    // threads is.
+    ClusterSums& sums = m_sums[0];
+    for (int i=1; i<m_nthreads; ++i)
+      sums.add(m_sums[i]);
+
+    bool moved = false;
+    for (int i=0; i<m_ncolors; ++i) {
+      uint64_t n = sums.count[i];
+      if (n == 0)               // Keep centers without samples
+        continue;
+
+      int r = int((sums.r[i] + n/2) / n);
+      int g = int((sums.g[i] + n/2) / n);
+      int b = int((sums.b[i] + n/2) / n);
+
+      if (r != m_r[i] || g != m_g[i] || b != m_b[i]) {
+        m_r[i] = r;
+        m_g[i] = g;
+        m_b[i] = b;
+        moved = true;
+      }
+    }
+    return moved;
+  }
+
+private:
+  static void thread_proxy(KMeans* self, int thread) {
+    self->assignSamples(thread);
+  }
+
+  void assignSamples(int thread) {
+    ClusterSums& sums = m_sums[thread];
+    std::fill(sums.r.begin(), sums.r.end(), 0);
+    std::fill(sums.g.begin(), sums.g.end(), 0);
+    std::fill(sums.b.begin(), sums.b.end(), 0);
+    std::fill(sums.count.begin(), sums.count.end(), 0);
+
+    int nsamples = (int)m_samples.size();
+    int s1 = int((int64_t)nsamples * thread / m_nthreads);
+    int s2 = int((int64_t)nsamples * (thread+1) / m_nthreads);
+    std::vector<int> dist(m_ncenters);
+
+    for (int s=s1; s<s2; ++s) {
+      const ColorSample& sample = m_samples[s];
+      int r = rgba_getr(sample.color);
+      int g = rgba_getg(sample.color);
+      int b = rgba_getb(sample.color);
+      int i = nearestCenter(r, g, b, &dist[0]);
+
+      sums.r[i] += uint64_t(r) * sample.count;
+      sums.g[i] += uint64_t(g) * sample.count;
+      sums.b[i] += uint64_t(b) * sample.count;
+      sums.count[i] += sample.count;
+    }
+  }
+
+  // Returns the first center with the lowest distance to the given
+  // color. "dist" is a temporary buffer for m_ncenters distances.
+  int nearestCenter(int r, int g, int b, int* dist) const {
+    const int* cr = &m_r[0];
+    const int* cg = &m_g[0];
+    const int* cb = &m_b[0];
+    int lowest = INT_MAX;
+
+    for (int i=0; i<m_ncenters; ++i) {
+      int dr = cr[i] - r;
+      int dg = cg[i] - g;
+      int db = cb[i] - b;
+      dist[i] = dr*dr + dg*dg + db*db;
+      lowest = MIN(lowest, dist[i]);
+    }
+
+    int i = 0;
+    while (dist[i] != lowest)
+      ++i;
+    return i;
+  }
+
+  const std::vector<ColorSample>& m_samples;
+  int m_ncolors;
+  int m_ncenters;
+  int m_nthreads;
+  std::vector<int> m_r, m_g, m_b;       // Centers
+  std::vector<ClusterSums> m_sums;      // Sums of each thread
+};
+
+} // anonymous namespace
+
+void kmeans_refine(const std::vector<ColorSample>& samples,
+                   std::vector<uint32_t>& colors,
+                   int maxIterations)
+{
+  if (samples.empty() || colors.empty())
+    return;
+
+  int nthreads = MID(1,
+                     (int)base::thread::hardware_concurrency(),
+                     (int)samples.size() / kSamplesPerThread);
+
+  KMeans kmeans(samples, (int)colors.size(), nthreads);
+  kmeans.setCenters(colors);
+
+  for (int i=0; i<maxIterations; ++i) {
+    if (!kmeans.iterate())
+      break;
+  }
+
+  kmeans.getCenters(colors);
+}
+
+} // namespace quantization
+} // namespace raster
@@ -0,0 +1,50 @@
+/* Aseprite
+ * Copyright (C) 2001-2013  David Capello
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef RASTER_KMEANS_H_INCLUDED
+#define RASTER_KMEANS_H_INCLUDED
+#pragma once
+
+#include <cstddef>
+#include <stdint.h>
+#include <vector>
+
+namespace raster {
+namespace quantization {
+
+  // A color with the number of times it appears in the images.
+  struct ColorSample {
+    uint32_t color;
+    size_t count;
+
+    ColorSample(uint32_t color, size_t count) : color(color), count(count) { }
+  };
+
+  // Refines the given "colors" (e.g. generated with median_cut()) to
+  // reduce the quantization error of the samples, using the k-means
+  // algorithm (Lloyd's iterations) with "colors" as initial
+  // centers. It stops after "maxIterations" or when the centers don't
+  // change. The result doesn't depend on the number of threads used.
+  void kmeans_refine(const std::vector<ColorSample>& samples,
+                     std::vector<uint32_t>& colors,
+                     int maxIterations);
+
+} // namespace quantization
+} // namespace raster
+
+#endif
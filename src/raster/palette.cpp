@@ -46,8 +46,10 @@ Palette::Palette(FrameNumber frame, int ncolors)
   m_frame = frame;
   m_colors.resize(ncolors);
   m_modifications = 0;
+  m_modifiedEntriesBase = 0;
 
   std::fill(m_colors.begin(), m_colors.end(), rgba(0, 0, 0, 255));
+  updateBestfitTables();
 }
 
 Palette::Palette(const Palette& palette)
@@ -56,6 +58,8 @@ Palette::Palette(const Palette& palette)
   m_frame = palette.m_frame;
   m_colors = palette.m_colors;
   m_modifications = 0;
+  m_modifiedEntriesBase = 0;
+  updateBestfitTables();
 }
 
 Palette::~Palette()
@@ -84,7 +88,13 @@ void Palette::resize(int ncolors)
               rgba(0, 0, 0, 255));
   }
 
+  // Only the added/removed entries change in the findBestfit()
+  // tables (so addEntry() doesn't rebuild them completely).
+  for (int i=MIN(old_size, ncolors); i<MAX(old_size, ncolors); ++i)
+    updateBestfitEntry(i);
+
   ++m_modifications;
+  resetModifiedEntries();
 }
 
 void Palette::addEntry(color_t color)
@@ -105,13 +115,61 @@ void Palette::setEntry(int i, color_t color)
   ASSERT(i >= 0 && i < size());
 
   m_colors[i] = color;
-  ++m_modifications;
+  entryModified(i);
 }
 
 void Palette::copyColorsTo(Palette* dst) const
 {
-  dst->m_colors = m_colors;
-  ++dst->m_modifications;
+  // Only the entries that are different are modified, so the
+  // destination can keep track of the modified entries.
+  if (dst->size() == size()) {
+    for (int i=0; i<size(); ++i)
+      if (dst->m_colors[i] != m_colors[i])
+        dst->setEntry(i, m_colors[i]);
+  }
+  else {
+    dst->m_colors = m_colors;
+    dst->allEntriesModified();
+  }
+}
+
+bool Palette::getModifiedEntries(int modifications, std::vector<int>& entries) const
+{
+  if (modifications < m_modifiedEntriesBase ||
+      modifications > m_modifications)
+    return false;
+
+  entries.assign(m_modifiedEntries.begin() + (modifications - m_modifiedEntriesBase),
+                 m_modifiedEntries.end());
+  return true;
+}
+
+void Palette::entryModified(int i)
+{
+  ++m_modifications;
+
+  if ((int)m_modifiedEntries.size() < MaxColors)
+    m_modifiedEntries.push_back(i);
+  else
+    resetModifiedEntries();
+
+  updateBestfitEntry(i);
+}
+
+void Palette::allEntriesModified()
+{
+  ++m_modifications;
+  resetModifiedEntries();
+
+  updateBestfitTables();
+}
+
+// The modified entries since the current number of modifications are
+// unknown from now on.
+void Palette::resetModifiedEntries()
+{
+  m_modifiedEntries.clear();
+  m_modifiedEntriesBase = m_modifications;
 }
 
 int Palette::countDiff(const Palette* other, int* from, int* to) const
@@ -152,7 +210,7 @@ bool Palette::isBlack() const
 void Palette::makeBlack()
 {
   std::fill(m_colors.begin(), m_colors.end(), rgba(0, 0, 0, 255));
-  ++m_modifications;
+  allEntriesModified();
 }
 
 // Creates a linear ramp in the palette.
@@ -399,6 +457,8 @@ void Palette::sort(int from, int to, SortPalette* sort_palette, std::vector<int>
     m_colors[from+i] = temp[i].color;
     mapping[from+i] = temp[i].index;
   }
+
+  allEntriesModified();
 }
 
 // End of Sort stuff
@@ -474,64 +534,169 @@ bool Palette::save(const char *filename) const
 //////////////////////////////////////////////////////////////////////
 // Based on Allegro's bestfit_color
 
-static unsigned int col_diff[3*128];
+// Weights of each channel to calculate the distance between colors.
+static const int kRedWeight = 30 * 30;
+static const int kGreenWeight = 59 * 59;
+static const int kBlueWeight = 11 * 11;
 
-static void bestfit_init()
+// Value of the channels of unused entries in the findBestfit()
+// tables. It's far enough from any 5-bit value to never be the
+// nearest color, and its square still fits in 16 bits.
+static const int kUnusedEntry = 127;
+
+// Size of the hash table used to find exact matches.
+static const int kBestfitHashSize = 2*Palette::MaxColors;
+
+static inline int bestfit_hash(int key)
+{
+  return (key ^ (key >> 9)) & (kBestfitHashSize-1);
+}
+
+void Palette::updateBestfitTables()
 {
-  register int i, k;
+  int n = size();
+  int i;
+
+  // The entry 0 is not used (as in Allegro's bestfit_color).
+  m_bestfitR[0] = m_bestfitG[0] = m_bestfitB[0] = kUnusedEntry;
 
-  for (i=1; i<64; i++) {
-    k = i * i;
-    col_diff[0  +i] = col_diff[0  +128-i] = k * (59 * 59);
-    col_diff[128+i] = col_diff[128+128-i] = k * (30 * 30);
-    col_diff[256+i] = col_diff[256+128-i] = k * (11 * 11);
+  for (i=1; i<n; ++i) {
+    m_bestfitR[i] = rgba_getr(m_colors[i]) >> 3;
+    m_bestfitG[i] = rgba_getg(m_colors[i]) >> 3;
+    m_bestfitB[i] = rgba_getb(m_colors[i]) >> 3;
+  }
+  for (; i<MaxColors; ++i)
+    m_bestfitR[i] = m_bestfitG[i] = m_bestfitB[i] = kUnusedEntry;
+
+  // If there are repeated colors the first entry is kept.
+  std::fill(m_bestfitHash, m_bestfitHash+kBestfitHashSize, -1);
+
+  for (i=1; i<n; ++i) {
+    int h = findBestfitSlot(getBestfitKey(i));
+    if (m_bestfitHash[h] < 0)
+      m_bestfitHash[h] = i;
   }
 }
 
-int Palette::findBestfit(int r, int g, int b) const
+// Updates the findBestfit() tables after modifying (adding or
+// removing) the entry "i".
+void Palette::updateBestfitEntry(int i)
 {
-#ifdef __GNUC__
-  register int bestfit asm("%eax");
-#else
-  register int bestfit;
-#endif
-  int i, coldiff, lowest;
+  // The entry 0 is not used (as in Allegro's bestfit_color).
+  if (i == 0)
+    return;
+
+  // Remove the entry from the hash table. If it was the first entry
+  // with its old color, the next entry with that color (if any)
+  // takes its place.
+  int oldKey = getBestfitKey(i);
+  int slot = findBestfitSlot(oldKey);
+
+  if (m_bestfitHash[slot] == i) {
+    int j;
+    for (j=i+1; j<size(); ++j)
+      if (getBestfitKey(j) == oldKey)
+        break;
+
+    if (j < size())
+      m_bestfitHash[slot] = j;
+    else
+      removeBestfitSlot(slot);
+  }
+
+  if (i < size()) {
+    m_bestfitR[i] = rgba_getr(m_colors[i]) >> 3;
+    m_bestfitG[i] = rgba_getg(m_colors[i]) >> 3;
+    m_bestfitB[i] = rgba_getb(m_colors[i]) >> 3;
+
+    // Add the entry with its new color (if it's the first one).
+    slot = findBestfitSlot(getBestfitKey(i));
+    if (m_bestfitHash[slot] < 0 || m_bestfitHash[slot] > i)
+      m_bestfitHash[slot] = i;
+  }
+  else
+    m_bestfitR[i] = m_bestfitG[i] = m_bestfitB[i] = kUnusedEntry;
+}
+
+int Palette::getBestfitKey(int i) const
+{
+  return (m_bestfitR[i] << 10) | (m_bestfitG[i] << 5) | m_bestfitB[i];
+}
+
+// Returns the slot of the hash table with the given 5-bit color, or
+// the empty slot where it should be added.
+int Palette::findBestfitSlot(int key) const
+{
+  int h = bestfit_hash(key);
+
+  while (m_bestfitHash[h] >= 0 && getBestfitKey(m_bestfitHash[h]) != key)
+    h = (h+1) & (kBestfitHashSize-1);
 
+  return h;
+}
+
+// Empties a slot of the hash table, moving back the next entries of
+// the same cluster so they can be found from their hash position.
+void Palette::removeBestfitSlot(int slot)
+{
+  const int mask = kBestfitHashSize-1;
+  int hole = slot;
+
+  m_bestfitHash[hole] = -1;
+
+  for (int h=(hole+1) & mask; m_bestfitHash[h] >= 0; h=(h+1) & mask) {
+    int home = bestfit_hash(getBestfitKey(m_bestfitHash[h]));
+
+    if (((h - home) & mask) >= ((h - hole) & mask)) {
+      m_bestfitHash[hole] = m_bestfitHash[h];
+      m_bestfitHash[h] = -1;
+      hole = h;
+    }
+  }
+}
+
+int Palette::findBestfit(int r, int g, int b) const
+{
   ASSERT(r >= 0 && r <= 255);
   ASSERT(g >= 0 && g <= 255);
   ASSERT(b >= 0 && b <= 255);
 
-  if (col_diff[1] == 0)
-    bestfit_init();
-
-  bestfit = 0;
-  lowest = INT_MAX;
+  if (size() <= 1)
+    return 0;
 
   r >>= 3;
   g >>= 3;
   b >>= 3;
 
-  i = 1;
-  while (i < size()) {
-    color_t rgb = m_colors[i];
-
-    coldiff = (col_diff + 0) [ ((rgba_getg(rgb)>>3) - g) & 0x7F ];
-    if (coldiff < lowest) {
-      coldiff += (col_diff + 128) [ ((rgba_getr(rgb)>>3) - r) & 0x7F ];
-      if (coldiff < lowest) {
-        coldiff += (col_diff + 256) [ ((rgba_getb(rgb)>>3) - b) & 0x7F ];
-        if (coldiff < lowest) {
-          bestfit = i;
-          if (coldiff == 0)
-            return bestfit;
-          lowest = coldiff;
-        }
-      }
-    }
-    i++;
+  // Look for an exact match.
+  int slot = findBestfitSlot((r << 10) | (g << 5) | b);
+  if (m_bestfitHash[slot] >= 0)
+    return m_bestfitHash[slot];
+
+  // Calculate the distance to all entries using 16-bit differences,
+  // so the compiler can vectorize this loop. The number of entries is
+  // rounded up to a multiple of 8 (unused entries are far away from
+  // any color).
+  int n = (size() + 7) & ~7;
+  int dist[MaxColors];
+  int i, lowest = INT_MAX;
+
+  for (i=0; i<n; ++i) {
+    int16_t dr = m_bestfitR[i] - r;
+    int16_t dg = m_bestfitG[i] - g;
+    int16_t db = m_bestfitB[i] - b;
+    int16_t dr2 = dr*dr;
+    int16_t dg2 = dg*dg;
+    int16_t db2 = db*db;
+    dist[i] = dg2*kGreenWeight + dr2*kRedWeight + db2*kBlueWeight;
+    lowest = MIN(lowest, dist[i]);
   }
 
-  return bestfit;
+  // The first entry with the lowest distance.
+  for (i=1; dist[i] != lowest; ++i)
+    ;
+
+  return i;
 }
 
 } // namespace raster
@@ -75,6 +75,12 @@ namespace raster {
 
     int getModifications() const { return m_modifications; }
 
+    // Returns in "entries" the indexes of the entries modified since
+    // the given number of modifications (see getModifications()).
+    // Returns false if this is unknown (e.g. the palette was resized
+    // or too many entries were modified).
+    bool getModifiedEntries(int modifications, std::vector<int>& entries) const;
+
     FrameNumber getFrame() const { return m_frame; }
     void setFrame(FrameNumber frame);
 
@@ -104,10 +110,33 @@ namespace raster {
     int findBestfit(int r, int g, int b) const;
 
   private:
+    void entryModified(int i);
+    void allEntriesModified();
+    void resetModifiedEntries();
+    void updateBestfitTables();
+    void updateBestfitEntry(int i);
+    int getBestfitKey(int i) const;
+    int findBestfitSlot(int key) const;
+    void removeBestfitSlot(int slot);
+
     FrameNumber m_frame;
     std::vector<color_t> m_colors;
     int m_modifications;
     std::string m_filename; // If the palette is associated with a file.
+
+    // Index of the entry modified in each modification since
+    // m_modifiedEntriesBase modifications.
+    std::vector<int> m_modifiedEntries;
+    int m_modifiedEntriesBase;
+
+    // Tables used by findBestfit(): channels of each entry (5 bits per
+    // channel) as separated arrays, and a hash table to find entries
+    // with exactly the same 5-bit color. They are updated entry by
+    // entry when a color is modified.
+    int16_t m_bestfitR[MaxColors];
+    int16_t m_bestfitG[MaxColors];
+    int16_t m_bestfitB[MaxColors];
+    int16_t m_bestfitHash[2*MaxColors];
   };
 
 } // namespace raster
@@ -0,0 +1,137 @@
+/* Aseprite
+ * Copyright (C) 2001-2013  David Capello
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <gtest/gtest.h>
+
+#include "raster/palette.h"
+
+#include <climits>
+#include <cstdlib>
+
+using namespace raster;
+
+// The first entry (excluding the entry 0) with the lowest distance
+// using 5 bits per channel (as the old Allegro's bestfit_color()).
+static int brute_force_bestfit(const Palette& pal, int r, int g, int b)
+{
+  int best = 0, lowest = INT_MAX;
+
+  r >>= 3;
+  g >>= 3;
+  b >>= 3;
+
+  for (int i=1; i<pal.size(); ++i) {
+    color_t c = pal.getEntry(i);
+    int dr = (rgba_getr(c) >> 3) - r;
+    int dg = (rgba_getg(c) >> 3) - g;
+    int db = (rgba_getb(c) >> 3) - b;
+    int dist = dr*dr*30*30 + dg*dg*59*59 + db*db*11*11;
+    if (dist < lowest) {
+      best = i;
+      lowest = dist;
+    }
+  }
+
+  return best;
+}
+
+static color_t random_color(int values)
+{
+  return rgba(std::rand()%values * 255 / (values-1),
+              std::rand()%values * 255 / (values-1),
+              std::rand()%values * 255 / (values-1), 255);
+}
+
+static void expect_bestfit(const Palette& pal)
+{
+  for (int r=0; r<256; r+=7)
+    for (int g=0; g<256; g+=11)
+      for (int b=0; b<256; b+=13)
+        ASSERT_EQ(brute_force_bestfit(pal, r, g, b), pal.findBestfit(r, g, b));
+
+  // Exact colors of the palette
+  for (int i=0; i<pal.size(); ++i) {
+    color_t c = pal.getEntry(i);
+    ASSERT_EQ(brute_force_bestfit(pal, rgba_getr(c), rgba_getg(c), rgba_getb(c)),
+              pal.findBestfit(rgba_getr(c), rgba_getg(c), rgba_getb(c)));
+  }
+}
+
+TEST(Palette, FindBestfit)
+{
+  std::srand(1);
+
+  for (int ncolors=1; ncolors<=256; ncolors*=2) {
+    Palette pal(FrameNumber(0), ncolors);
+    for (int i=0; i<ncolors; ++i)
+      pal.setEntry(i, random_color(256));
+
+    expect_bestfit(pal);
+  }
+
+  EXPECT_EQ(0, Palette(FrameNumber(0), 1).findBestfit(255, 255, 255));
+}
+
+TEST(Palette, FindBestfitAfterModifications)
+{
+  std::srand(2);
+
+  // Few different values per channel, so there are repeated colors
+  Palette pal(FrameNumber(0), 64);
+  for (int i=0; i<pal.size(); ++i)
+    pal.setEntry(i, random_color(3));
+  expect_bestfit(pal);
+
+  for (int k=0; k<200; ++k) {
+    switch (std::rand() % 4) {
+      case 0:
+      case 1:
+        pal.setEntry(std::rand() % pal.size(), random_color(3));
+        break;
+      case 2:
+        if (pal.size() < Palette::MaxColors)
+          pal.addEntry(random_color(3));
+        break;
+      case 3:
+        pal.resize(1 + std::rand() % Palette::MaxColors);
+        break;
+    }
+    expect_bestfit(pal);
+
+    Palette copy(FrameNumber(0), pal.size());
+    pal.copyColorsTo(&copy);
+    expect_bestfit(copy);
+  }
+}
+
+TEST(Palette, FindBestfitGrayscale)
+{
+  Palette* pal = Palette::createGrayscale();
+  expect_bestfit(*pal);
+  delete pal;
+}
+
+int main(int argc, char** argv)
+{
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -26,7 +26,11 @@
 #include "raster/image.h"
 #include "raster/primitives.h"
 
+#include "base/mutex.h"
+#include "base/scoped_lock.h"
+
 #include <cmath>
+#include <list>
 
 namespace raster {
 
@@ -55,6 +59,7 @@ Pen::Pen(const Pen& pen)
   m_type = pen.m_type;
   m_size = pen.m_size;
   m_angle = pen.m_angle;
+  m_image = NULL;
 
   regenerate_pen();
 }
@@ -98,6 +103,114 @@ static void algo_hline(int x1, int y, int x2, void *data)
   draw_hline(reinterpret_cast<Image*>(data), x1, y, x2, BitmapTraits::max_value);
 }
 
+namespace {
+
+// Cache of the last generated pens, so changing the size or the angle
+// of the pen back and forth (or creating a new Pen for each tool
+// loop/cursor) doesn't rasterize the same shape again.
+class PenCache {
+public:
+  enum { kMaxEntries = 8 };
+
+  ~PenCache() {
+    for (Entries::iterator it=m_entries.begin(); it!=m_entries.end(); ++it)
+      delete it->image;
+  }
+
+  // Returns true if the given pen shape was found in the cache,
+  // in this case "image" and "scanline" are filled with a copy of
+  // the cached data.
+  bool get(PenType type, int size, int angle,
+           Image*& image, std::vector<PenScanline>& scanline) {
+    base::scoped_lock hold(m_mutex);
+
+    for (Entries::iterator it=m_entries.begin(); it!=m_entries.end(); ++it) {
+      if (it->type == type && it->size == size && it->angle == angle) {
+        // Move the entry to the front (most recently used)
+        if (it != m_entries.begin())
+          m_entries.splice(m_entries.begin(), m_entries, it);
+
+        image = Image::createCopy(m_entries.front().image);
+        scanline = m_entries.front().scanline;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void add(PenType type, int size, int angle,
+           const Image* image, const std::vector<PenScanline>& scanline) {
+    base::scoped_lock hold(m_mutex);
+
+    m_entries.push_front(Entry());
+    Entry& entry = m_entries.front();
+    entry.type = type;
+    entry.size = size;
+    entry.angle = angle;
+    entry.image = Image::createCopy(image);
+    entry.scanline = scanline;
+
+    // Remove the least recently used entry
+    if (m_entries.size() > kMaxEntries) {
+      delete m_entries.back().image;
+      m_entries.pop_back();
+    }
+  }
+
+private:
+  struct Entry {
+    PenType type;
+    int size;
+    int angle;
+    Image* image;
+    std::vector<PenScanline> scanline;
+  };
+
+  typedef std::list<Entry> Entries;
+
+  base::mutex m_mutex;
+  Entries m_entries;
+};
+
+PenCache pen_cache;
+
+} // anonymous namespace
+
+// Calculates the span of each row of the pen bitmap. Pens are convex
+// shapes (or lines), so each row has at most one span.
+static void calculate_scanlines(const Image* image, std::vector<PenScanline>& scanline)
+{
+  int w = image->getWidth();
+  int h = image->getHeight();
+
+  scanline.resize(h);
+  for (int y=0; y<h; y++) {
+    const uint8_t* row = image->getPixelAddress(0, y);
+    PenScanline& s = scanline[y];
+    int x = 0;
+
+    s.state = false;
+
+    // Skip empty bytes
+    while (x < w && (x & 7) == 0 && row[x>>3] == 0)
+      x += 8;
+
+    for (; x<w; x++) {
+      if (row[x>>3] & (1<<(x&7))) {
+        s.x1 = x;
+
+        for (; x<w; x++)
+          if (!(row[x>>3] & (1<<(x&7))))
+            break;
+
+        s.x2 = x-1;
+        s.state = true;
+        break;
+      }
+    }
+  }
+}
+
 // Regenerates the pen bitmap and its rectangle's region.
 void Pen::regenerate_pen()
 {
@@ -105,6 +218,20 @@ void Pen::regenerate_pen()
 
   ASSERT(m_size > 0);
 
+  if (!pen_cache.get(m_type, m_size, m_angle, m_image, m_scanline)) {
+    rasterize_pen();
+    calculate_scanlines(m_image, m_scanline);
+
+    pen_cache.add(m_type, m_size, m_angle, m_image, m_scanline);
+  }
+
+  m_bounds = gfx::Rect(-m_image->getWidth()/2, -m_image->getHeight()/2,
+                       m_image->getWidth(), m_image->getHeight());
+}
+
+// Draws the pen shape in a new m_image.
+void Pen::rasterize_pen()
+{
   int size = m_size;
   if (m_type == PEN_TYPE_SQUARE && m_angle != 0 && m_size > 2)
     size = std::sqrt((double)2*m_size*m_size)+2;
@@ -160,28 +287,6 @@ void Pen::regenerate_pen()
       }
     }
   }
-
-  m_scanline.resize(m_image->getHeight());
-  for (int y=0; y<m_image->getHeight(); y++) {
-    m_scanline[y].state = false;
-
-    for (int x=0; x<m_image->getWidth(); x++) {
-      if (get_pixel(m_image, x, y)) {
-        m_scanline[y].x1 = x;
-
-        for (; x<m_image->getWidth(); x++)
-          if (!get_pixel(m_image, x, y))
-            break;
-
-        m_scanline[y].x2 = x-1;
-        m_scanline[y].state = true;
-        break;
-      }
-    }
-  }
-
-  m_bounds = gfx::Rect(-m_image->getWidth()/2, -m_image->getHeight()/2,
-                       m_image->getWidth(), m_image->getHeight());
 }
 
 } // namespace raster
@@ -55,6 +55,7 @@ namespace raster {
   private:
     void clean_pen();
     void regenerate_pen();
+    void rasterize_pen();
 
     PenType m_type;                       // Type of pen
     int m_size;                           // Size (diameter)
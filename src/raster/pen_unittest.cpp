@@ -0,0 +1,95 @@
+/* Aseprite
+ * Copyright (C) 2001-2013  David Capello
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <gtest/gtest.h>
+
+#include "raster/image.h"
+#include "raster/pen.h"
+#include "raster/primitives.h"
+
+using namespace raster;
+
+static void expect_scanlines_match_image(Pen& pen)
+{
+  Image* image = pen.get_image();
+  const std::vector<PenScanline>& scanline = pen.get_scanline();
+
+  ASSERT_EQ(image->getHeight(), (int)scanline.size());
+
+  for (int y=0; y<image->getHeight(); ++y) {
+    for (int x=0; x<image->getWidth(); ++x) {
+      bool inside = (scanline[y].state &&
+                     x >= scanline[y].x1 &&
+                     x <= scanline[y].x2);
+
+      EXPECT_EQ(inside, get_pixel(image, x, y) != 0)
+        << "type=" << pen.get_type()
+        << " size=" << pen.get_size()
+        << " angle=" << pen.get_angle()
+        << " x=" << x << " y=" << y;
+    }
+  }
+}
+
+TEST(Pen, ScanlinesMatchImage)
+{
+  PenType types[] = { PEN_TYPE_CIRCLE, PEN_TYPE_SQUARE, PEN_TYPE_LINE };
+
+  for (int t=0; t<3; ++t) {
+    for (int size=1; size<=20; size+=3) {
+      for (int angle=0; angle<180; angle+=45) {
+        Pen pen(types[t], size, angle);
+        expect_scanlines_match_image(pen);
+      }
+    }
+  }
+}
+
+TEST(Pen, CachedPensAreEqual)
+{
+  Pen a(PEN_TYPE_CIRCLE, 17, 0);
+  a.set_size(3);
+  a.set_size(17);               // From the cache
+
+  Pen b(PEN_TYPE_CIRCLE, 17, 0);
+  Pen c(b);
+
+  ASSERT_TRUE(a.getBounds() == b.getBounds());
+  ASSERT_TRUE(a.getBounds() == c.getBounds());
+
+  for (int y=0; y<a.getBounds().h; ++y) {
+    for (int x=0; x<a.getBounds().w; ++x) {
+      EXPECT_EQ(get_pixel(a.get_image(), x, y), get_pixel(b.get_image(), x, y));
+      EXPECT_EQ(get_pixel(a.get_image(), x, y), get_pixel(c.get_image(), x, y));
+    }
+  }
+
+  // Each pen has its own copy of the image
+  EXPECT_NE(a.get_image(), b.get_image());
+  EXPECT_NE(b.get_image(), c.get_image());
+}
+
+int main(int argc, char** argv)
+{
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
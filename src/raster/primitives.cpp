@@ -50,7 +50,6 @@ void put_pixel(Image* image, int x, int y, color_t color)
 
 void put_pen(Image* image, Pen* pen, int x, int y, color_t fg, color_t bg)
 {
-  Image* pen_image = pen->get_image();
   const gfx::Rect& penBounds = pen->getBounds();
 
   x += penBounds.x;
@@ -60,14 +59,12 @@ void put_pen(Image* image, Pen* pen, int x, int y, color_t fg, color_t bg)
     fill_rect(image, x, y, x+penBounds.w-1, y+penBounds.h-1, bg);
   }
   else {
-    int u, v;
-    for (v=0; v<penBounds.h; v++) {
-      for (u=0; u<penBounds.w; u++) {
-        if (get_pixel(pen_image, u, v))
-          put_pixel(image, x+u, y+v, fg);
-        else
-          put_pixel(image, x+u, y+v, bg);
-      }
+    const std::vector<PenScanline>& scanline = pen->get_scanline();
+
+    fill_rect(image, x, y, x+penBounds.w-1, y+penBounds.h-1, bg);
+    for (int v=0; v<penBounds.h; v++) {
+      if (scanline[v].state)
+        draw_hline(image, x+scanline[v].x1, y+v, x+scanline[v].x2, fg);
     }
   }
 }
@@ -22,6 +22,9 @@
 
 #include "raster/quantization.h"
 
+#include "base/mutex.h"
+#include "base/scoped_lock.h"
+#include "base/thread.h"
 #include "gfx/hsv.h"
 #include "gfx/rgb.h"
 #include "raster/blend.h"
@@ -36,6 +39,7 @@
 #include "raster/sprite.h"
 
 #include <algorithm>
+#include <cmath>
 #include <limits>
 #include <vector>
 
@@ -50,17 +54,35 @@ static Image* ordered_dithering(const Image* src_image,
                                 const RgbMap* rgbmap,
                                 const Palette* palette);
 
-static void create_palette_from_bitmaps(const std::vector<Image*>& images, Palette* palette, bool has_background_layer);
+// Converts a RGB image to indexed diffusing the quantization error
+// with the kernel of the given method.
+static Image* error_diffusion_dithering(const Image* src_image,
+                                        DitheringMethod method,
+                                        const RgbMap* rgbmap,
+                                        const Palette* palette);
 
-Palette* create_palette_from_rgb(const Sprite* sprite, FrameNumber frameNumber)
+static void create_palette_from_bitmaps(const std::vector<Image*>& images, Palette* palette, bool has_background_layer,
+                                        const PaletteOptions& options);
+
+// The gray level of a RGB color is its HSV value, which depends only
+// on the maximum component, so it's calculated for each possible
+// maximum instead of converting each pixel to HSV.
+static void create_gray_table(uint8_t* table)
+{
+  for (int i=0; i<256; ++i)
+    table[i] = 255 * Hsv(Rgb(i, i, i)).valueInt() / 100;
+}
+
+Palette* create_palette_from_rgb(const Sprite* sprite, FrameNumber frameNumber,
+                                 const PaletteOptions& options)
 {
   bool has_background_layer = (sprite->getBackgroundLayer() != NULL);
   Palette* palette = new Palette(FrameNumber(0), 256);
   Image* flat_image;
 
   ImagesCollector images(sprite->getFolder(), // All layers
-                         frameNumber,         // Ignored, we'll use all frames
-                         true,                // All frames,
+                         frameNumber,         // Ignored if we use all frames
+                         options.allFrames,
                          false); // forWrite=false, read only
 
   // Add a flat image with the current sprite's frame rendered
@@ -78,7 +100,7 @@ Palette* create_palette_from_rgb(const Sprite* sprite, FrameNumber frameNumber)
   image_array[c++] = flat_image; // The 'flat_image'
 
   // Generate an optimized palette for all images
-  create_palette_from_bitmaps(image_array, palette, has_background_layer);
+  create_palette_from_bitmaps(image_array, palette, has_background_layer, options);
 
   delete flat_image;
   return palette;
@@ -98,6 +120,15 @@ Image* convert_pixel_format(const Image* image,
     return ordered_dithering(image, 0, 0, rgbmap, palette);
   }
 
+  // RGB -> Indexed with error diffusion
+  if (image->getPixelFormat() == IMAGE_RGB &&
+      pixelFormat == IMAGE_INDEXED &&
+      (ditheringMethod == DITHERING_FLOYD_STEINBERG ||
+       ditheringMethod == DITHERING_SIERRA_LITE ||
+       ditheringMethod == DITHERING_ATKINSON)) {
+    return error_diffusion_dithering(image, ditheringMethod, rgbmap, palette);
+  }
+
   Image* new_image = Image::create(pixelFormat, image->getWidth(), image->getHeight());
   color_t c;
   int r, g, b;
@@ -119,14 +150,14 @@ Image* convert_pixel_format(const Image* image,
         case IMAGE_GRAYSCALE: {
           LockImageBits<GrayscaleTraits> dstBits(new_image, Image::WriteLock);
           LockImageBits<GrayscaleTraits>::iterator dst_it = dstBits.begin(), dst_end = dstBits.end();
+          uint8_t grayTable[256];
+          create_gray_table(grayTable);
 
           for (; src_it != src_end; ++src_it, ++dst_it) {
             ASSERT(dst_it != dst_end);
             c = *src_it;
 
-            g = 255 * Hsv(Rgb(rgba_getr(c),
-                              rgba_getg(c),
-                              rgba_getb(c))).valueInt() / 100;
+            g = grayTable[MAX(rgba_getr(c), MAX(rgba_getg(c), rgba_getb(c)))];
 
             *dst_it = graya(g, rgba_geta(c));
           }
@@ -238,6 +269,17 @@ Image* convert_pixel_format(const Image* image,
         case IMAGE_GRAYSCALE: {
           LockImageBits<GrayscaleTraits> dstBits(new_image, Image::WriteLock);
           LockImageBits<GrayscaleTraits>::iterator dst_it = dstBits.begin(), dst_end = dstBits.end();
+          uint8_t grayTable[256];
+          create_gray_table(grayTable);
+
+          // Gray value of each palette entry.
+          std::vector<color_t> entries(palette->size());
+          for (int i=0; i<palette->size(); ++i) {
+            r = rgba_getr(palette->getEntry(i));
+            g = rgba_getg(palette->getEntry(i));
+            b = rgba_getb(palette->getEntry(i));
+            entries[i] = graya(grayTable[MAX(r, MAX(g, b))], 255);
+          }
 
           for (; src_it != src_end; ++src_it, ++dst_it) {
             ASSERT(dst_it != dst_end);
@@ -245,14 +287,10 @@ Image* convert_pixel_format(const Image* image,
 
             if (c == 0 && !has_background_layer)
               *dst_it = 0;
-            else {
-              r = rgba_getr(palette->getEntry(c));
-              g = rgba_getg(palette->getEntry(c));
-              b = rgba_getb(palette->getEntry(c));
-
-              g = 255 * Hsv(Rgb(r, g, b)).valueInt() / 100;
-              *dst_it = graya(g, 255);
-            }
+            else if (c < entries.size())
+              *dst_it = entries[c];
+            else
+              *dst_it = graya(0, 255);
           }
           ASSERT(dst_it == dst_end);
           break;
@@ -401,37 +439,374 @@ static Image* ordered_dithering(const Image* src_image,
   return dst_image;
 }
 
+//////////////////////////////////////////////////////////////////////
+// Error diffusion dithering
+
+namespace {
+
+// Each tap of a kernel receives "weight/divisor" of the quantization
+// error of the current pixel, at the (dx, dy) offset from it.
+struct DiffusionTap {
+  int dx, dy, weight;
+};
+
+struct DiffusionKernel {
+  const DiffusionTap* taps;
+  int ntaps;
+  int divisor;
+  int rows;                     // Rows below the current one reached by the taps
+};
+
+const DiffusionTap floyd_steinberg_taps[] = {
+  { 1, 0, 7 }, { -1, 1, 3 }, { 0, 1, 5 }, { 1, 1, 1 }
+};
+
+const DiffusionTap sierra_lite_taps[] = {
+  { 1, 0, 2 }, { -1, 1, 1 }, { 0, 1, 1 }
+};
+
+// Atkinson diffuses only 6/8 of the error.
+const DiffusionTap atkinson_taps[] = {
+  { 1, 0, 1 }, { 2, 0, 1 }, { -1, 1, 1 }, { 0, 1, 1 }, { 1, 1, 1 }, { 0, 2, 1 }
+};
+
+const DiffusionKernel floyd_steinberg_kernel = { floyd_steinberg_taps, 4, 16, 1 };
+const DiffusionKernel sierra_lite_kernel = { sierra_lite_taps, 3, 4, 1 };
+const DiffusionKernel atkinson_kernel = { atkinson_taps, 6, 8, 2 };
+
+// Taps can reach two pixels at both sides of the current one, so
+// error rows have this margin to avoid checking the bounds.
+const int kErrorMargin = 2;
+
+// Pixels processed between each notification of the row progress.
+const int kPixelsPerStep = 64;
+
+// Minimum number of rows per thread to use more than one thread.
+const int kRowsPerThread = 16;
+
+// Diffuses the error of each pixel to the next pixels of the same
+// row and to the rows below. As the pixel (x,y) needs the error of
+// the pixels (x-1..x+1,y-1), several rows can be processed at the
+// same time (a "wavefront"): each row goes behind the previous one,
+// waiting for it when it's needed. Each thread processes rows
+// "first, first+nthreads, first+2*nthreads, ...", and the result is
+// the same that we get processing rows one after another.
+class ErrorDiffusion {
+public:
+  ErrorDiffusion(const Image* src, Image* dst,
+                 const DiffusionKernel& kernel,
+                 const RgbMap* rgbmap,
+                 const Palette* palette,
+                 int nthreads)
+    : m_src(src)
+    , m_dst(dst)
+    , m_kernel(kernel)
+    , m_rgbmap(rgbmap)
+    , m_palette(palette)
+    , m_nthreads(nthreads)
+    , m_width(src->getWidth())
+    , m_height(src->getHeight())
+    , m_stride(3 * (m_width + 2*kErrorMargin))
+    // A row slot is reused when the row that used it and all the
+    // previous ones were completely processed.
+    , m_slots(nthreads + kernel.rows + 1)
+    , m_errors(m_slots * m_stride, 0)
+    , m_progress(m_height, 0) {
+  }
+
+  void run() {
+    std::vector<base::thread*> threads(m_nthreads-1);
+
+    for (int i=0; i<m_nthreads-1; ++i)
+      threads[i] = new base::thread(&ErrorDiffusion::thread_proxy, this, i+1);
+
+    processRows(0);
+
+    for (int i=0; i<m_nthreads-1; ++i) {
+      threads[i]->join();
+      delete threads[i];
+    }
+  }
+
+private:
+  static void thread_proxy(ErrorDiffusion* self, int first) {
+    self->processRows(first);
+  }
+
+  void processRows(int first) {
+    for (int y=first; y<m_height; y += m_nthreads)
+      processRow(y);
+  }
+
+  void processRow(int y) {
+    const uint32_t* src = (const uint32_t*)m_src->getPixelAddress(0, y);
+    uint8_t* dst = (uint8_t*)m_dst->getPixelAddress(0, y);
+    const int divisor = m_kernel.divisor;
+
+    // Clear the slot of the farthest row reached from this one (the
+    // previous rows don't reach it).
+    std::fill_n(errorRow(y+m_kernel.rows) - 3*kErrorMargin, m_stride, 0);
+
+    for (int x=0; x<m_width; ) {
+      int x2 = MIN(x+kPixelsPerStep, m_width);
+
+      // Wait the previous row until it has diffused all its error to
+      // the pixels [x,x2) of this row.
+      if (y > 0)
+        waitRow(y-1, MIN(x2+1, m_width));
+
+      int* err = errorRow(y) + 3*x;
+
+      for (; x<x2; ++x, err += 3) {
+        color_t c = src[x];
+
+        if (rgba_geta(c) == 0) {
+          dst[x] = 0;
+          continue;
+        }
+
+        int r = MID(0, rgba_getr(c) + divide_error(err[0], divisor), 255);
+        int g = MID(0, rgba_getg(c) + divide_error(err[1], divisor), 255);
+        int b = MID(0, rgba_getb(c) + divide_error(err[2], divisor), 255);
+
+        int i = m_rgbmap->mapColor(r, g, b);
+        dst[x] = i;
+
+        color_t nearest = m_palette->getEntry(i);
+        r -= rgba_getr(nearest);
+        g -= rgba_getg(nearest);
+        b -= rgba_getb(nearest);
+
+        for (int t=0; t<m_kernel.ntaps; ++t) {
+          const DiffusionTap& tap = m_kernel.taps[t];
+          int* e = errorRow(y+tap.dy) + 3*(x+tap.dx);
+          e[0] += r * tap.weight;
+          e[1] += g * tap.weight;
+          e[2] += b * tap.weight;
+        }
+      }
+
+      notifyRow(y, x);
+    }
+  }
+
+  int* errorRow(int y) {
+    return &m_errors[(y % m_slots) * m_stride + 3*kErrorMargin];
+  }
+
+  void notifyRow(int y, int x) {
+    if (m_nthreads > 1) {
+      base::scoped_lock hold(m_mutex);
+      m_progress[y] = x;
+    }
+  }
+
+  void waitRow(int y, int x) {
+    if (m_nthreads == 1)
+      return;
+
+    for (;;) {
+      {
+        base::scoped_lock hold(m_mutex);
+        if (m_progress[y] >= x)
+          break;
+      }
+      base::this_thread::yield();
+    }
+  }
+
+  // Rounds to the nearest integer (symmetrically for negative errors).
+  static int divide_error(int error, int divisor) {
+    if (error >= 0)
+      return (error + divisor/2) / divisor;
+    else
+      return -((-error + divisor/2) / divisor);
+  }
+
+  const Image* m_src;
+  Image* m_dst;
+  const DiffusionKernel& m_kernel;
+  const RgbMap* m_rgbmap;
+  const Palette* m_palette;
+  int m_nthreads;
+  int m_width;
+  int m_height;
+  int m_stride;
+  int m_slots;
+  std::vector<int> m_errors;  // Accumulated RGB error of each pixel (multiplied by the kernel divisor)
+  std::vector<int> m_progress;  // Number of processed pixels in each row
+  base::mutex m_mutex;
+};
+
+} // anonymous namespace
+
+static Image* error_diffusion_dithering(const Image* src_image,
+                                        DitheringMethod method,
+                                        const RgbMap* rgbmap,
+                                        const Palette* palette)
+{
+  const DiffusionKernel* kernel;
+  switch (method) {
+    case DITHERING_FLOYD_STEINBERG: kernel = &floyd_steinberg_kernel; break;
+    case DITHERING_SIERRA_LITE: kernel = &sierra_lite_kernel; break;
+    case DITHERING_ATKINSON: kernel = &atkinson_kernel; break;
+    default:
+      ASSERT(false);
+      return NULL;
+  }
+
+  Image* dst_image = Image::create(IMAGE_INDEXED, src_image->getWidth(), src_image->getHeight());
+  if (!dst_image)
+    return NULL;
+
+  int nthreads = MID(1,
+                     (int)base::thread::hardware_concurrency(),
+                     src_image->getHeight() / kRowsPerThread);
+
+  ErrorDiffusion(src_image, dst_image, *kernel, rgbmap, palette, nthreads).run();
+  return dst_image;
+}
+
 //////////////////////////////////////////////////////////////////////
 // Creation of optimized palette for RGB images
 // by David Capello
 
-static void create_palette_from_bitmaps(const std::vector<Image*>& images, Palette* palette, bool has_background_layer)
-{
-  quantization::ColorHistogram<5, 6, 5> histogram;
-  uint32_t color;
+namespace {
+
+typedef ColorHistogram<5, 6, 5> PaletteHistogram;
+
+// Minimum number of pixels to be processed by each thread.
+const double kPixelsPerThread = 256*256;
+
+// Fills a histogram with the pixels of a range of rows of the
+// images (the rows of all images are numbered consecutively). Only
+// pixels in rows and columns multiple of "step" are added.
+class HistogramRows {
+public:
+  HistogramRows(const std::vector<Image*>& images, int step, int firstRow, int lastRow)
+    : m_images(images)
+    , m_step(step)
+    , m_firstRow(firstRow)
+    , m_lastRow(lastRow) {
+  }
+
+  const PaletteHistogram& histogram() const {
+    return m_histogram;
+  }
+
+  static void thread_proxy(HistogramRows* self) {
+    self->fill();
+  }
+
+  void fill() {
+    int imageRow = 0;           // Number of the first row of the image
+
+    for (int i=0; i<(int)m_images.size() && imageRow < m_lastRow; ++i) {
+      const Image* image = m_images[i];
+      int y1 = MAX(m_firstRow - imageRow, 0);
+      int y2 = MIN(m_lastRow - imageRow, image->getHeight());
+
+      y1 = (y1+m_step-1) / m_step * m_step;
+      for (int y=y1; y<y2; y += m_step)
+        addRow((const uint32_t*)image->getPixelAddress(0, y), image->getWidth());
 
+      imageRow += image->getHeight();
+    }
+  }
+
+private:
+  void addRow(const uint32_t* src, int width) {
+    // Runs of the same color are added at once, the high-precision
+    // table of the histogram is expensive to look up for each pixel.
+    uint32_t runColor = 0;
+    size_t runLength = 0;
+
+    for (int x=0; x<width; x += m_step) {
+      uint32_t color = src[x];
+
+      if (rgba_geta(color) > 0) {
+        color |= rgba(0, 0, 0, 255);
+
+        if (runLength > 0 && color == runColor)
+          ++runLength;
+        else {
+          if (runLength > 0)
+            m_histogram.addSamples(runColor, runLength);
+
+          runColor = color;
+          runLength = 1;
+        }
+      }
+    }
+
+    if (runLength > 0)
+      m_histogram.addSamples(runColor, runLength);
+  }
+
+  const std::vector<Image*>& m_images;
+  int m_step;
+  int m_firstRow;
+  int m_lastRow;
+  PaletteHistogram m_histogram;
+};
+
+} // anonymous namespace
+
+static void create_palette_from_bitmaps(const std::vector<Image*>& images, Palette* palette, bool has_background_layer,
+                                        const PaletteOptions& options)
+{
   // If the sprite has a background layer, the first entry can be
   // used, in other case the 0 indexed will be the mask color, so it
   // will not be used later in the color conversion (from RGB to
   // Indexed).
   int first_usable_entry = (has_background_layer ? 0: 1);
 
+  int rows = 0;
+  double pixels = 0.0;
   for (int i=0; i<(int)images.size(); ++i) {
-    const Image* image = images[i];
-    const LockImageBits<RgbTraits> bits(image);
-    LockImageBits<RgbTraits>::const_iterator it = bits.begin(), end = bits.end();
+    rows += images[i]->getHeight();
+    pixels += double(images[i]->getWidth()) * images[i]->getHeight();
+  }
 
-    for (; it != end; ++it) {
-      color = *it;
+  // Sample one pixel of each step*step square if there are too many.
+  int step = 1;
+  if (options.maxSamples > 0 && pixels > options.maxSamples)
+    step = (int)std::ceil(std::sqrt(pixels / options.maxSamples));
 
-      if (rgba_geta(color) > 0) {
-        color |= rgba(0, 0, 0, 255);
-        histogram.addSamples(color, 1);
-      }
-    }
+  // Each thread fills its own histogram with a consecutive range of
+  // rows, so merging them in order gives the same result as filling
+  // one histogram serially.
+  int nthreads = (int)MID(1.0,
+                          (double)base::thread::hardware_concurrency(),
+                          pixels / step / step / kPixelsPerThread);
+  nthreads = MIN(nthreads, MAX(rows, 1));
+
+  std::vector<HistogramRows*> parts(nthreads);
+  std::vector<base::thread*> threads(nthreads-1);
+
+  for (int i=0; i<nthreads; ++i)
+    parts[i] = new HistogramRows(images, step,
+                                 int((int64_t)rows * i / nthreads),
+                                 int((int64_t)rows * (i+1) / nthreads));
+
+  for (int i=0; i<nthreads-1; ++i)
+    threads[i] = new base::thread(&HistogramRows::thread_proxy, parts[i+1]);
+
+  parts[0]->fill();
+
+  for (int i=0; i<nthreads-1; ++i) {
+    threads[i]->join();
+    delete threads[i];
+  }
+
+  PaletteHistogram histogram;
+  for (int i=0; i<nthreads; ++i) {
+    histogram.addHistogram(parts[i]->histogram());
+    delete parts[i];
   }
 
-  int used_colors = histogram.createOptimizedPalette(palette, first_usable_entry, 255);
+  int used_colors = histogram.createOptimizedPalette(palette, first_usable_entry, 255,
+                                                     options.refinementIterations);
   //palette->resize(first_usable_entry+used_colors);   // TODO
 }
 
@@ -34,8 +34,32 @@ namespace raster {
 
   namespace quantization {
 
+    // Options to create a palette from RGB images.
+    struct PaletteOptions {
+      // Maximum number of pixels added to the histogram of colors
+      // (zero means all pixels). Bigger inputs are sampled with a
+      // regular grid.
+      int maxSamples;
+
+      // Maximum number of k-means iterations to refine the
+      // median-cut palette (zero, the default, to disable the
+      // refinement).
+      int refinementIterations;
+
+      // True to use the cels of all frames, false to use only the
+      // cels of the given frame.
+      bool allFrames;
+
+      PaletteOptions()
+        : maxSamples(0)
+        , refinementIterations(0)
+        , allFrames(true) {
+      }
+    };
+
     // Creates a new palette suitable to quantize the given RGB sprite to Indexed color.
-    Palette* create_palette_from_rgb(const Sprite* sprite, FrameNumber frameNumber);
+    Palette* create_palette_from_rgb(const Sprite* sprite, FrameNumber frameNumber,
+                                     const PaletteOptions& options = PaletteOptions());
 
     // Changes the image pixel format. The dithering method is used only
     // when you want to convert from RGB to Indexed.
@@ -22,23 +22,157 @@
 
 #include "raster/rgbmap.h"
 
-#include "raster/conversion_alleg.h"
 #include "raster/palette.h"
 
-#include <allegro.h>
+#include <algorithm>
+#include <climits>
+#include <vector>
 
 namespace raster {
 
+// Number of bits per channel used in the cache of the map.
+static const int kCacheBits = 6;
+static const int kCacheSize = 1 << (3*kCacheBits);
+
+// Maximum number of modified palette entries to update the cache
+// incrementally (instead of clearing it).
+static const int kMaxIncrementalEntries = 16;
+
+// Weights for each channel to calculate the distance between two
+// colors (the same used by Allegro's bestfit_color()).
+static const int kRedWeight = 30;
+static const int kGreenWeight = 59;
+static const int kBlueWeight = 11;
+
+namespace {
+
+  // A k-d tree to find the nearest palette entry to a color. Each
+  // entry is a point in the RGB space (scaled by the channel
+  // weights). The tree is implicit: each sub-range of m_points is a
+  // node where the middle element splits the space in m_axis.
+  class PaletteTree {
+  public:
+    void build(const Palette* palette) {
+      m_points.clear();
+
+      // The entry 0 is never used as the nearest color (it's the
+      // transparent color, as in Allegro's create_rgb_table()).
+      for (int i=1; i<palette->size(); ++i) {
+        color_t c = palette->getEntry(i);
+        Point pt;
+        pt.v[0] = rgba_getr(c) * kRedWeight;
+        pt.v[1] = rgba_getg(c) * kGreenWeight;
+        pt.v[2] = rgba_getb(c) * kBlueWeight;
+        pt.index = i;
+        pt.axis = 0;
+        m_points.push_back(pt);
+      }
+
+      if (!m_points.empty())
+        buildNode(0, m_points.size());
+    }
+
+    int nearest(int r, int g, int b) const {
+      if (m_points.empty())
+        return 0;
+
+      int q[3] = { r * kRedWeight, g * kGreenWeight, b * kBlueWeight };
+      int bestIndex = 0;
+      int bestDist = INT_MAX;
+
+      searchNode(0, m_points.size(), q, bestIndex, bestDist);
+      return bestIndex;
+    }
+
+  private:
+    struct Point {
+      int v[3];
+      int index;
+      int axis;
+    };
+
+    class PointLess {
+    public:
+      PointLess(int axis) : m_axis(axis) { }
+      bool operator()(const Point& a, const Point& b) const {
+        return a.v[m_axis] < b.v[m_axis];
+      }
+    private:
+      int m_axis;
+    };
+
+    void buildNode(int begin, int end) {
+      if (end - begin <= 1)
+        return;
+
+      // Split by the axis where the points are more spread.
+      int axis = 0, spread = -1;
+      for (int a=0; a<3; ++a) {
+        int lo = INT_MAX, hi = INT_MIN;
+        for (int i=begin; i<end; ++i) {
+          lo = MIN(lo, m_points[i].v[a]);
+          hi = MAX(hi, m_points[i].v[a]);
+        }
+        if (hi - lo > spread) {
+          spread = hi - lo;
+          axis = a;
+        }
+      }
+
+      int mid = (begin + end) / 2;
+      std::nth_element(m_points.begin()+begin,
+                       m_points.begin()+mid,
+                       m_points.begin()+end, PointLess(axis));
+      m_points[mid].axis = axis;
+
+      buildNode(begin, mid);
+      buildNode(mid+1, end);
+    }
+
+    void searchNode(int begin, int end, const int* q, int& bestIndex, int& bestDist) const {
+      if (begin >= end)
+        return;
+
+      int mid = (begin + end) / 2;
+      const Point& pt = m_points[mid];
+      int dr = q[0] - pt.v[0];
+      int dg = q[1] - pt.v[1];
+      int db = q[2] - pt.v[2];
+      int dist = dr*dr + dg*dg + db*db;
+
+      // On ties the lowest index wins (as in Palette::findBestfit()).
+      if (dist < bestDist || (dist == bestDist && pt.index < bestIndex)) {
+        bestDist = dist;
+        bestIndex = pt.index;
+      }
+
+      if (end - begin == 1)
+        return;
+
+      int diff = q[pt.axis] - pt.v[pt.axis];
+      if (diff < 0) {
+        searchNode(begin, mid, q, bestIndex, bestDist);
+        if (diff*diff <= bestDist)
+          searchNode(mid+1, end, q, bestIndex, bestDist);
+      }
+      else {
+        searchNode(mid+1, end, q, bestIndex, bestDist);
+        if (diff*diff <= bestDist)
+          searchNode(begin, mid, q, bestIndex, bestDist);
+      }
+    }
+
+    std::vector<Point> m_points;
+  };
+
+}
+
 class RgbMapImpl {
 public:
-  RgbMapImpl() {
-    m_allegMap = new RGB_MAP;
-    m_palette = NULL;
-    m_modifications = 0;
-  }
-
-  ~RgbMapImpl() {
-    delete m_allegMap;
+  RgbMapImpl()
+    : m_cache(kCacheSize, 0)
+    , m_palette(NULL)
+    , m_modifications(0) {
   }
 
   bool match(const Palette* palette) const {
@@ -47,32 +181,117 @@ public:
   }
 
   void regenerate(const Palette* palette) {
+    std::vector<int> entries;
+
+    // If only some entries of the same palette were modified, we
+    // can keep the cells of the cache that are not affected.
+    if (m_palette == palette &&
+        palette->getModifiedEntries(m_modifications, entries) &&
+        (int)entries.size() <= kMaxIncrementalEntries) {
+      invalidateCells(palette, entries);
+    }
+    else {
+      std::fill(m_cache.begin(), m_cache.end(), 0);
+    }
+
     m_palette = palette;
     m_modifications = palette->getModifications();
-
-    PALETTE allegPal;
-    convert_palette_to_allegro(palette, allegPal);
-    create_rgb_table(m_allegMap, allegPal, NULL);
-
-    for (int r=0; r<32; ++r)
-      for (int g=0; g<32; ++g)
-        for (int b=0; b<32; ++b) {
-          if (m_allegMap->data[r][g][b] >= palette->size())
-            m_allegMap->data[r][g][b] = palette->findBestfit(_rgb_scale_5[r],
-                                                             _rgb_scale_5[g],
-                                                             _rgb_scale_5[b]);
-        }
+    m_tree.build(palette);
   }
 
   int mapColor(int r, int g, int b) const {
     ASSERT(r >= 0 && r < 256);
     ASSERT(g >= 0 && g < 256);
     ASSERT(b >= 0 && b < 256);
-    return m_allegMap->data[r>>3][g>>3][b>>3];
+
+    r >>= 8-kCacheBits;
+    g >>= 8-kCacheBits;
+    b >>= 8-kCacheBits;
+
+    int cell = (r << (2*kCacheBits)) | (g << kCacheBits) | b;
+    int index = m_cache[cell];
+
+    // A zero in the cache means that the cell must be calculated (the
+    // entry 0 is never the result of PaletteTree::nearest() when
+    // there are other entries). mapColor() can be called from several
+    // threads at the same time: the tree isn't modified until the
+    // next regenerate(), and threads that calculate the same cell
+    // store the same one-byte value in it.
+    if (index == 0) {
+      index = m_tree.nearest(scale_cache_bits(r), scale_cache_bits(g), scale_cache_bits(b));
+      m_cache[cell] = index;
+    }
+
+    return index;
   }
 
 private:
-  RGB_MAP* m_allegMap;
+
+  // Clears the cells of the cache that could be mapped to a
+  // different entry after modifying the given palette entries:
+  // cells mapped to a modified entry, and cells that are nearer to
+  // the new color of a modified entry than to their current entry.
+  void invalidateCells(const Palette* palette, const std::vector<int>& entries) {
+    std::vector<int> modified;
+    std::vector<int> points;
+
+    for (size_t i=0; i<entries.size(); ++i) {
+      int index = entries[i];
+      if (index > 0 && std::find(modified.begin(), modified.end(), index) == modified.end()) {
+        color_t c = palette->getEntry(index);
+        modified.push_back(index);
+        points.push_back(rgba_getr(c) * kRedWeight);
+        points.push_back(rgba_getg(c) * kGreenWeight);
+        points.push_back(rgba_getb(c) * kBlueWeight);
+      }
+    }
+
+    if (modified.empty())
+      return;
+
+    for (int cell=0; cell<kCacheSize; ++cell) {
+      uint8_t& index = m_cache[cell];
+      if (index == 0)
+        continue;
+
+      if (std::find(modified.begin(), modified.end(), index) != modified.end()) {
+        index = 0;
+        continue;
+      }
+
+      int q[3] = {
+        scale_cache_bits(cell >> (2*kCacheBits)) * kRedWeight,
+        scale_cache_bits((cell >> kCacheBits) & ((1 << kCacheBits)-1)) * kGreenWeight,
+        scale_cache_bits(cell & ((1 << kCacheBits)-1)) * kBlueWeight
+      };
+
+      color_t c = palette->getEntry(index);
+      int dr = q[0] - rgba_getr(c) * kRedWeight;
+      int dg = q[1] - rgba_getg(c) * kGreenWeight;
+      int db = q[2] - rgba_getb(c) * kBlueWeight;
+      int dist = dr*dr + dg*dg + db*db;
+
+      for (size_t i=0; i<modified.size(); ++i) {
+        dr = q[0] - points[3*i];
+        dg = q[1] - points[3*i+1];
+        db = q[2] - points[3*i+2];
+        int newDist = dr*dr + dg*dg + db*db;
+
+        if (newDist < dist || (newDist == dist && modified[i] < index)) {
+          index = 0;
+          break;
+        }
+      }
+    }
+  }
+
+  // Converts a channel from the cache resolution to 8 bits.
+  static int scale_cache_bits(int v) {
+    return (v << (8-kCacheBits)) | (v >> (2*kCacheBits-8));
+  }
+
+  mutable std::vector<uint8_t> m_cache;
+  PaletteTree m_tree;
   const Palette* m_palette;
   int m_modifications;
 };
@@ -0,0 +1,196 @@
+/* Aseprite
+ * Copyright (C) 2001-2013  David Capello
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <gtest/gtest.h>
+
+#include "base/thread.h"
+#include "raster/palette.h"
+#include "raster/rgbmap.h"
+
+#include <climits>
+#include <cstdlib>
+
+using namespace raster;
+
+// Nearest entry (excluding the entry 0) using the same weighted
+// distance as the RgbMap.
+static int brute_force_nearest(const Palette& pal, int r, int g, int b)
+{
+  int best = 0, lowest = INT_MAX;
+
+  for (int i=1; i<pal.size(); ++i) {
+    color_t c = pal.getEntry(i);
+    int dr = (rgba_getr(c) - r) * 30;
+    int dg = (rgba_getg(c) - g) * 59;
+    int db = (rgba_getb(c) - b) * 11;
+    int dist = dr*dr + dg*dg + db*db;
+    if (dist < lowest) {
+      best = i;
+      lowest = dist;
+    }
+  }
+
+  return best;
+}
+
+TEST(RgbMap, NearestColor)
+{
+  std::srand(1);
+
+  for (int ncolors=2; ncolors<=256; ncolors*=2) {
+    Palette pal(FrameNumber(0), ncolors);
+    for (int i=0; i<ncolors; ++i)
+      pal.setEntry(i, rgba(std::rand()%256, std::rand()%256, std::rand()%256, 255));
+
+    RgbMap map;
+    map.regenerate(&pal);
+    EXPECT_TRUE(map.match(&pal));
+
+    // Colors with 6 bits per channel are represented exactly in the map.
+    for (int r=0; r<64; r+=3)
+      for (int g=0; g<64; g+=5)
+        for (int b=0; b<64; b+=7) {
+          int r8 = (r<<2) | (r>>4);
+          int g8 = (g<<2) | (g>>4);
+          int b8 = (b<<2) | (b>>4);
+          EXPECT_EQ(brute_force_nearest(pal, r8, g8, b8), map.mapColor(r8, g8, b8));
+        }
+  }
+}
+
+TEST(RgbMap, PaletteChanges)
+{
+  Palette pal(FrameNumber(0), 3);
+  pal.setEntry(0, rgba(0, 0, 0, 255));
+  pal.setEntry(1, rgba(0, 0, 0, 255));
+  pal.setEntry(2, rgba(255, 255, 255, 255));
+
+  RgbMap map;
+  map.regenerate(&pal);
+  EXPECT_EQ(1, map.mapColor(0, 0, 0));
+  EXPECT_EQ(2, map.mapColor(255, 255, 255));
+  EXPECT_EQ(2, map.mapColor(200, 200, 200));
+
+  pal.setEntry(1, rgba(200, 200, 200, 255));
+  EXPECT_FALSE(map.match(&pal));
+
+  map.regenerate(&pal);
+  EXPECT_EQ(1, map.mapColor(200, 200, 200));
+  EXPECT_EQ(1, map.mapColor(0, 0, 0));
+}
+
+TEST(RgbMap, ModifiedEntries)
+{
+  std::srand(2);
+
+  Palette pal(FrameNumber(0), 256);
+  for (int i=0; i<256; ++i)
+    pal.setEntry(i, rgba(std::rand()%256, std::rand()%256, std::rand()%256, 255));
+
+  RgbMap map;
+  map.regenerate(&pal);
+
+  for (int k=0; k<20; ++k) {
+    // Fill the cache
+    for (int r=0; r<64; r+=3)
+      for (int g=0; g<64; g+=3)
+        for (int b=0; b<64; b+=3)
+          map.mapColor(r<<2, g<<2, b<<2);
+
+    // Modify some entries (or copy a palette with some changes)
+    if (k & 1) {
+      Palette copy(pal);
+      for (int i=0; i<k; ++i)
+        copy.setEntry(std::rand()%256, rgba(std::rand()%256, std::rand()%256, std::rand()%256, 255));
+      copy.copyColorsTo(&pal);
+    }
+    else
+      pal.setEntry(std::rand()%256, rgba(std::rand()%256, std::rand()%256, std::rand()%256, 255));
+
+    EXPECT_FALSE(map.match(&pal));
+    map.regenerate(&pal);
+
+    for (int r=0; r<64; r+=3)
+      for (int g=0; g<64; g+=3)
+        for (int b=0; b<64; b+=3) {
+          int r8 = (r<<2) | (r>>4);
+          int g8 = (g<<2) | (g>>4);
+          int b8 = (b<<2) | (b>>4);
+          ASSERT_EQ(brute_force_nearest(pal, r8, g8, b8), map.mapColor(r8, g8, b8));
+        }
+  }
+}
+
+struct MapColorsData {
+  const RgbMap* map;
+  const Palette* pal;
+  int errors;
+};
+
+static void map_all_colors(MapColorsData* data)
+{
+  for (int r=0; r<64; r+=2)
+    for (int g=0; g<64; g+=2)
+      for (int b=0; b<64; b+=2) {
+        int r8 = (r<<2) | (r>>4);
+        int g8 = (g<<2) | (g>>4);
+        int b8 = (b<<2) | (b>>4);
+        if (data->map->mapColor(r8, g8, b8) != brute_force_nearest(*data->pal, r8, g8, b8))
+          ++data->errors;
+      }
+}
+
+TEST(RgbMap, SeveralThreads)
+{
+  std::srand(3);
+
+  Palette pal(FrameNumber(0), 256);
+  for (int i=0; i<256; ++i)
+    pal.setEntry(i, rgba(std::rand()%256, std::rand()%256, std::rand()%256, 255));
+
+  RgbMap map;
+  map.regenerate(&pal);
+
+  // The cells of the map are calculated by the threads that use them
+  const int nthreads = 4;
+  MapColorsData data[nthreads];
+  base::thread* threads[nthreads];
+
+  for (int i=0; i<nthreads; ++i) {
+    data[i].map = &map;
+    data[i].pal = &pal;
+    data[i].errors = 0;
+    threads[i] = new base::thread(&map_all_colors, data+i);
+  }
+
+  for (int i=0; i<nthreads; ++i) {
+    threads[i]->join();
+    delete threads[i];
+    EXPECT_EQ(0, data[i].errors);
+  }
+}
+
+int main(int argc, char** argv)
+{
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -23,12 +23,15 @@
 #include "raster/sprite.h"
 
 #include "base/memory.h"
+#include "base/mutex.h"
 #include "base/remove_from_container.h"
+#include "base/scoped_lock.h"
+#include "base/thread.h"
 #include "base/unique_ptr.h"
-#include "raster/image_bits.h"
 #include "raster/primitives.h"
 #include "raster/raster.h"
 
+#include <algorithm>
 #include <cstring>
 #include <vector>
 
@@ -142,8 +145,9 @@ int Sprite::getMemSize() const
   Image *image;
   int i, size = 0;
 
+  // Lazy images that aren't loaded don't use memory
   for (i=0; i<m_stock->size(); i++) {
-    image = m_stock->getImage(i);
+    image = (m_stock->isImageLoaded(i) ? m_stock->getImage(i): NULL);
     if (image != NULL)
       size += image->getRowStrideSize() * image->getHeight();
   }
@@ -352,6 +356,90 @@ void Sprite::getCels(CelList& cels)
   getFolder()->getCels(cels);
 }
 
+namespace {
+
+// Remaps the pixels of a set of indexed images using several threads
+// (each thread takes the next band of rows to be remapped).
+class ImagesRemap {
+public:
+  ImagesRemap(const std::vector<Image*>& images, const std::vector<uint8_t>& mapping)
+    : m_images(images)
+    , m_nextImage(0)
+    , m_nextRow(0) {
+    std::copy(mapping.begin(), mapping.end(), m_mapping);
+  }
+
+  void run() {
+    int rows = 0;
+    for (size_t i=0; i<m_images.size(); ++i)
+      rows += m_images[i]->getHeight();
+
+    int nthreads = MID(1, base::thread::hardware_concurrency(), rows / kRowsPerBand);
+    std::vector<base::thread*> threads;
+
+    for (int i=1; i<nthreads; ++i)
+      threads.push_back(new base::thread(&ImagesRemap::thread_proxy, this));
+
+    remapBands();
+
+    for (size_t i=0; i<threads.size(); ++i) {
+      threads[i]->join();
+      delete threads[i];
+    }
+  }
+
+private:
+  enum { kRowsPerBand = 64 };
+
+  static void thread_proxy(ImagesRemap* self) {
+    self->remapBands();
+  }
+
+  void remapBands() {
+    Image* image;
+    int y1, y2;
+
+    while (getNextBand(image, y1, y2)) {
+      int w = image->getWidth();
+
+      for (int y=y1; y<y2; ++y) {
+        uint8_t* p = image->getPixelAddress(0, y);
+
+        for (int x=0; x<w; ++x)
+          p[x] = m_mapping[p[x]];
+      }
+    }
+  }
+
+  bool getNextBand(Image*& image, int& y1, int& y2) {
+    base::scoped_lock hold(m_mutex);
+
+    if (m_nextImage < m_images.size() &&
+        m_nextRow >= m_images[m_nextImage]->getHeight()) {
+      ++m_nextImage;
+      m_nextRow = 0;
+    }
+
+    if (m_nextImage < m_images.size()) {
+      image = m_images[m_nextImage];
+      y1 = m_nextRow;
+      y2 = MIN(y1 + kRowsPerBand, image->getHeight());
+      m_nextRow = y2;
+      return true;
+    }
+    else
+      return false;
+  }
+
+  const std::vector<Image*>& m_images;
+  uint8_t m_mapping[256];
+  size_t m_nextImage;
+  int m_nextRow;
+  base::mutex m_mutex;
+};
+
+} // anonymous namespace
+
 void Sprite::remapImages(FrameNumber frameFrom, FrameNumber frameTo, const std::vector<uint8_t>& mapping)
 {
   ASSERT(m_format == IMAGE_INDEXED);
@@ -360,22 +448,29 @@ void Sprite::remapImages(FrameNumber frameFrom, FrameNumber frameTo, const std::
   CelList cels;
   getCels(cels);
 
+  // Each image is remapped just one time, even if it's used by
+  // several cels in the range.
+  std::vector<int> indexes;
   for (CelIterator it = cels.begin(); it != cels.end(); ++it) {
     Cel* cel = *it;
 
     // Remap this Cel because is inside the specified range
     if (cel->getFrame() >= frameFrom &&
-        cel->getFrame() <= frameTo) {
-      Image* image = getStock()->getImage(cel->getImage());
-      LockImageBits<IndexedTraits> bits(image);
-      LockImageBits<IndexedTraits>::iterator
-        it = bits.begin(),
-        end = bits.end();
-
-      for (; it != end; ++it)
-        *it = mapping[*it];
-    }
+        cel->getFrame() <= frameTo)
+      indexes.push_back(cel->getImage());
   }
+
+  std::sort(indexes.begin(), indexes.end());
+  indexes.erase(std::unique(indexes.begin(), indexes.end()), indexes.end());
+
+  std::vector<Image*> images;
+  for (size_t i=0; i<indexes.size(); ++i) {
+    Image* image = getStock()->getImage(indexes[i]);
+    if (image && image->getHeight() > 0)
+      images.push_back(image);
+  }
+
+  ImagesRemap(images, mapping).run();
 }
 
 //////////////////////////////////////////////////////////////////////
@@ -22,8 +22,10 @@
 
 #include "raster/stock.h"
 
+#include "base/scoped_lock.h"
 #include "raster/image.h"
 
+#include <algorithm>
 #include <cstring>
 
 namespace raster {
@@ -31,15 +33,22 @@ namespace raster {
 Stock::Stock(PixelFormat format)
   : Object(OBJECT_STOCK)
   , m_format(format)
+  , m_loader(NULL)
+  , m_useCounter(0)
 {
   // Image with index=0 is always NULL.
   m_image.push_back(NULL);
+  m_lazy.push_back(false);
+  m_lastUse.push_back(0);
 }
 
 Stock::Stock(const Stock& stock)
   : Object(stock)
   , m_format(stock.getPixelFormat())
+  , m_loader(NULL)
+  , m_useCounter(0)
 {
+  // Lazy images of the original stock are loaded and copied.
   try {
     for (int i=0; i<stock.size(); ++i) {
       if (!stock.getImage(i))
@@ -64,9 +73,11 @@ Stock::Stock(const Stock& stock)
 Stock::~Stock()
 {
   for (int i=0; i<size(); ++i) {
-    if (getImage(i))
-      delete getImage(i);
+    if (m_image[i])
+      delete m_image[i];
   }
+
+  delete m_loader;
 }
 
 PixelFormat Stock::getPixelFormat() const
@@ -83,6 +94,15 @@ Image* Stock::getImage(int index) const
 {
   ASSERT((index >= 0) && (index < size()));
 
+  if (m_lazy[index]) {
+    base::scoped_lock hold(m_mutex);
+
+    if (!m_image[index])
+      const_cast<Stock*>(this)->m_image[index] = m_loader->loadImage(index);
+
+    m_lastUse[index] = ++m_useCounter;
+  }
+
   return m_image[index];
 }
 
@@ -91,6 +111,8 @@ int Stock::addImage(Image* image)
   int i = m_image.size();
   try {
     m_image.resize(m_image.size()+1);
+    m_lazy.resize(m_image.size(), false);
+    m_lastUse.resize(m_image.size(), 0);
   }
   catch (...) {
     delete image;
@@ -105,6 +127,7 @@ void Stock::removeImage(Image* image)
   for (int i=0; i<size(); i++)
     if (m_image[i] == image) {
       m_image[i] = NULL;
+      m_lazy[i] = false;
       return;
     }
 
@@ -115,6 +138,103 @@ void Stock::replaceImage(int index, Image* image)
 {
   ASSERT((index > 0) && (index < size()));
   m_image[index] = image;
+  m_lazy[index] = false;
+}
+
+void Stock::setImageLoader(StockImageLoader* loader)
+{
+  ASSERT(m_loader == NULL);
+  m_loader = loader;
+}
+
+int Stock::addLazyImage()
+{
+  ASSERT(m_loader != NULL);
+
+  int i = addImage(NULL);
+  m_lazy[i] = true;
+  return i;
+}
+
+bool Stock::isLazyImage(int index) const
+{
+  ASSERT((index >= 0) && (index < size()));
+  return m_lazy[index];
+}
+
+bool Stock::isImageLoaded(int index) const
+{
+  ASSERT((index >= 0) && (index < size()));
+  return (m_image[index] != NULL);
+}
+
+bool Stock::hasUnloadedImages() const
+{
+  base::scoped_lock hold(m_mutex);
+
+  for (int i=0; i<size(); ++i) {
+    if (m_lazy[i] && !m_image[i])
+      return true;
+  }
+  return false;
+}
+
+std::string Stock::popLoadError()
+{
+  if (!m_loader)
+    return std::string();
+
+  base::scoped_lock hold(m_mutex);
+  return m_loader->popLoadError();
+}
+
+namespace {
+
+  struct LessRecentlyUsed {
+    const std::vector<unsigned int>& lastUse;
+
+    LessRecentlyUsed(const std::vector<unsigned int>& lastUse) : lastUse(lastUse) { }
+
+    bool operator()(int a, int b) const {
+      return lastUse[a] < lastUse[b];
+    }
+  };
+
+}
+
+void Stock::releaseLazyImages(size_t maxBytes, const std::set<const Image*>& keep)
+{
+  if (!m_loader)
+    return;
+
+  base::scoped_lock hold(m_mutex);
+  std::vector<int> loaded;
+  size_t bytes = 0;
+
+  for (int i=0; i<size(); ++i) {
+    if (m_lazy[i] && m_image[i]) {
+      loaded.push_back(i);
+      bytes += m_image[i]->getMemSize();
+    }
+  }
+
+  if (bytes <= maxBytes)
+    return;
+
+  std::sort(loaded.begin(), loaded.end(), LessRecentlyUsed(m_lastUse));
+
+  for (size_t j=0; j<loaded.size() && bytes > maxBytes; ++j) {
+    int i = loaded[j];
+    Image* image = m_image[i];
+
+    if (keep.find(image) != keep.end() ||
+        !m_loader->isImageUnmodified(i, image))
+      continue;
+
+    bytes -= image->getMemSize();
+    m_image[i] = NULL;
+    delete image;
+  }
 }
 
 } // namespace raster
@@ -20,9 +20,12 @@
 #define RASTER_STOCK_H_INCLUDED
 #pragma once
 
+#include "base/mutex.h"
 #include "raster/object.h"
 #include "raster/pixel_format.h"
 
+#include <set>
+#include <string>
 #include <vector>
 
 namespace raster {
@@ -31,6 +34,27 @@ namespace raster {
 
   typedef std::vector<Image*> ImagesList;
 
+  // Creates the images of a stock when they are used for the first
+  // time (see Stock::addLazyImage()).
+  class StockImageLoader {
+  public:
+    virtual ~StockImageLoader() { }
+
+    // Creates the image for the "index" position of the stock.
+    virtual Image* loadImage(int index) = 0;
+
+    // Returns true if the given image (which was created by
+    // loadImage() for the "index" position) has the same pixels that
+    // it had when it was loaded, so it can be released and loaded
+    // again later.
+    virtual bool isImageUnmodified(int index, const Image* image) = 0;
+
+    // Returns the error of the first image that couldn't be loaded
+    // since the last call (empty if all images were loaded), so it
+    // can be reported to the user.
+    virtual std::string popLoadError() = 0;
+  };
+
   class Stock : public Object {
   public:
     Stock(PixelFormat format);
@@ -45,7 +69,8 @@ namespace raster {
       return m_image.size();
     }
 
-    // Returns the image in the "index" position
+    // Returns the image in the "index" position. If it's a lazy image
+    // that is not in memory, it's created by the image loader.
     Image* getImage(int index) const;
 
     // Adds a new image in the stock resizing the images-array. Returns
@@ -66,9 +91,46 @@ namespace raster {
     //
     void replaceImage(int index, Image* image);
 
+    // Sets the loader used to create lazy images. The stock takes the
+    // ownership of the loader.
+    void setImageLoader(StockImageLoader* loader);
+    StockImageLoader* getImageLoader() const { return m_loader; }
+
+    // Adds an empty position in the stock for an image that will be
+    // created by the image loader when it's needed.
+    int addLazyImage();
+
+    // Returns true if the "index" position has a lazy image that can
+    // be created by the image loader (loaded or not).
+    bool isLazyImage(int index) const;
+
+    // Returns true if the image in the "index" position is in memory.
+    bool isImageLoaded(int index) const;
+
+    // Returns true if there are lazy images that are not in memory
+    // yet (so they must be created by the image loader to be used).
+    bool hasUnloadedImages() const;
+
+    // Returns the error of the first lazy image that couldn't be
+    // loaded since the last call (empty if there were no errors).
+    std::string popLoadError();
+
+    // Releases the least recently used lazy images (which weren't
+    // modified) until all loaded lazy images use less than "maxBytes".
+    // Images in "keep" are never released. You must be sure that no
+    // one is using other images of the stock when this is called.
+    void releaseLazyImages(size_t maxBytes, const std::set<const Image*>& keep);
+
     //private: TODO uncomment this line
     PixelFormat m_format; // Type of images (all images in the stock must be of this type).
     ImagesList m_image;   // The images-array where the images are.
+
+  private:
+    StockImageLoader* m_loader;
+    std::vector<bool> m_lazy;   // True in positions of lazy images
+    mutable std::vector<unsigned int> m_lastUse;
+    mutable unsigned int m_useCounter;
+    mutable base::mutex m_mutex; // To load lazy images from several threads
   };
 
 } // namespace raster
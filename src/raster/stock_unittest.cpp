@@ -0,0 +1,138 @@
+/* Aseprite
+ * Copyright (C) 2001-2013  David Capello
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <gtest/gtest.h>
+
+#include "raster/image.h"
+#include "raster/primitives.h"
+#include "raster/stock.h"
+
+using namespace raster;
+
+// Creates 4x4 indexed images filled with the stock index.
+class TestLoader : public StockImageLoader {
+public:
+  int loads;
+
+  TestLoader() : loads(0) { }
+
+  Image* loadImage(int index) OVERRIDE {
+    Image* image = Image::create(IMAGE_INDEXED, 4, 4);
+    clear_image(image, index);
+    ++loads;
+    return image;
+  }
+
+  bool isImageUnmodified(int index, const Image* image) OVERRIDE {
+    for (int y=0; y<image->getHeight(); ++y)
+      for (int x=0; x<image->getWidth(); ++x)
+        if (get_pixel(image, x, y) != (uint32_t)index)
+          return false;
+    return true;
+  }
+
+  std::string popLoadError() OVERRIDE {
+    return std::string();
+  }
+};
+
+TEST(Stock, LoadLazyImages)
+{
+  Stock stock(IMAGE_INDEXED);
+  TestLoader* loader = new TestLoader;
+  stock.setImageLoader(loader);
+
+  int a = stock.addLazyImage();
+  int b = stock.addLazyImage();
+  int c = stock.addImage(Image::create(IMAGE_INDEXED, 4, 4));
+
+  EXPECT_TRUE(stock.isLazyImage(a));
+  EXPECT_FALSE(stock.isLazyImage(c));
+  EXPECT_FALSE(stock.isImageLoaded(a));
+  EXPECT_FALSE(stock.isImageLoaded(b));
+  EXPECT_TRUE(stock.hasUnloadedImages());
+  EXPECT_EQ(0, loader->loads);
+
+  Image* image = stock.getImage(b);
+  ASSERT_TRUE(image != NULL);
+  EXPECT_EQ((uint32_t)b, get_pixel(image, 0, 0));
+  EXPECT_EQ(image, stock.getImage(b));
+  EXPECT_EQ(1, loader->loads);
+  EXPECT_FALSE(stock.isImageLoaded(a));
+
+  // A replaced image is not lazy anymore
+  Image* newImage = Image::create(IMAGE_INDEXED, 4, 4);
+  delete stock.getImage(a);
+  stock.replaceImage(a, newImage);
+  EXPECT_FALSE(stock.isLazyImage(a));
+  EXPECT_EQ(newImage, stock.getImage(a));
+  EXPECT_FALSE(stock.hasUnloadedImages());
+}
+
+TEST(Stock, ReleaseLazyImages)
+{
+  Stock stock(IMAGE_INDEXED);
+  TestLoader* loader = new TestLoader;
+  stock.setImageLoader(loader);
+
+  int index[4];
+  for (int i=0; i<4; ++i)
+    index[i] = stock.addLazyImage();
+
+  // Load in this order: 2, 0, 3, 1
+  stock.getImage(index[2]);
+  stock.getImage(index[0]);
+  stock.getImage(index[3]);
+  stock.getImage(index[1]);
+
+  // Modify image 0 and keep image 3
+  put_pixel(stock.getImage(index[0]), 1, 1, 255);
+  std::set<const Image*> keep;
+  keep.insert(stock.getImage(index[3]));
+
+  // Use image 1 again so 2 is the least recently used
+  stock.getImage(index[1]);
+
+  size_t imageSize = stock.getImage(index[1])->getMemSize();
+  stock.releaseLazyImages(imageSize*3, keep);
+
+  EXPECT_TRUE(stock.isImageLoaded(index[0]));  // Modified
+  EXPECT_TRUE(stock.isImageLoaded(index[1]));
+  EXPECT_FALSE(stock.isImageLoaded(index[2])); // Released
+  EXPECT_TRUE(stock.isImageLoaded(index[3]));  // Kept
+  EXPECT_TRUE(stock.hasUnloadedImages());
+
+  stock.releaseLazyImages(0, keep);
+  EXPECT_TRUE(stock.isImageLoaded(index[0]));
+  EXPECT_FALSE(stock.isImageLoaded(index[1]));
+  EXPECT_TRUE(stock.isImageLoaded(index[3]));
+
+  // Released images are loaded again when they are needed
+  EXPECT_EQ((uint32_t)index[2], get_pixel(stock.getImage(index[2]), 0, 0));
+  EXPECT_EQ(5, loader->loads);
+}
+
+int main(int argc, char** argv)
+{
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -71,6 +71,10 @@ namespace undo {
     // ObjectNotFoundException.
     virtual void* getObject(ObjectId id) = 0;
 
+    // Returns true if the given object pointer was added to the
+    // container (and it wasn't removed).
+    virtual bool hasObject(void* object) const = 0;
+
     // Helper method to cast getObject() to the expected object type.
     template<class T>
     T* getObjectT(ObjectId id)